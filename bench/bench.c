@@ -0,0 +1,703 @@
+/*
+@file bench.c in-process microbenchmarks of server hot paths
+
+Calls internal functions directly, without network, and prints results as
+JSON to stdout.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+#include <zlib.h>
+
+#include "../src/version.h"
+#include "../src/ed2k_proto.h"
+#include "../src/packet.h"
+#include "../src/server.h"
+#include "../src/client.h"
+#include "../src/arena.h"
+#include "../src/db.h"
+#include "../src/log.h"
+#include "../src/admission.h"
+#include "../src/hashset.h"
+
+#define DEFAULT_SCALE       1
+#define DEFAULT_MAX_THREADS 8
+
+#define OFFER_FILES         200
+#define VOCABULARY_SIZE     2048
+#define SHARE_BATCHES       500
+#define SHARE_CLIENTS       64
+#define QUEUE_CLIENTS       64
+#define BANNED_NETWORKS     10000
+#define ADMISSION_IPS       8192
+#define ADMISSION_WINDOW    4096
+#define HASHSET_FILES       20000
+
+struct server_instance g_srv;
+
+static struct {
+    /* iterations multiplier */
+    unsigned scale;
+    /* maximum threads for job queue benchmark */
+    size_t max_threads;
+    /* run only benchmarks containing this substring */
+    const char *filter;
+    /* printed results count */
+    size_t result_count;
+    /* random generator state */
+    uint64_t rng;
+    /* file name words */
+    char words[VOCABULARY_SIZE][12];
+    /* shared files */
+    struct pub_file *files;
+    /* shared files names */
+    char (*names)[64];
+    /* shared files count */
+    size_t file_count;
+} s_bench;
+
+// command line options
+static const char *optString = "hs:t:f:";
+static const struct option longOpts[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"scale", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 't'},
+        {"filter", required_argument, NULL, 'f'},
+        {NULL, no_argument, NULL, 0}
+};
+
+static void display_usage(void)
+{
+    puts(
+            "Options:\n"
+                    "--help, -h\tshow this help\n"
+                    "--scale, -s <n>\tmultiply iterations by <n> (default: " CSTR(DEFAULT_SCALE) ")\n"
+                    "--threads, -t <n>\tmaximum threads for job queue benchmark (default: " CSTR(DEFAULT_MAX_THREADS) ")\n"
+                    "--filter, -f <str>\trun only benchmarks with <str> in name"
+    );
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t rnd(void)
+{
+    s_bench.rng ^= s_bench.rng >> 12;
+    s_bench.rng ^= s_bench.rng << 25;
+    s_bench.rng ^= s_bench.rng >> 27;
+    return (uint32_t) ((s_bench.rng * 2685821657736338717ull) >> 32);
+}
+
+static int bench_enabled(const char *name)
+{
+    return !s_bench.filter || strstr(name, s_bench.filter);
+}
+
+/**
+@param items  processed items per iteration (files, nodes, bytes), 0 if not applicable
+*/
+static void report(const char *name, size_t threads, uint64_t iterations, uint64_t elapsed_ns, size_t items)
+{
+    double ns_per_op = iterations ? (double) elapsed_ns / iterations : 0;
+
+    printf("%s\n    {\"name\": \"%s\", \"threads\": %zu, \"iterations\": %llu, \"total_ns\": %llu, "
+            "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, \"items_per_op\": %zu}",
+            s_bench.result_count++ ? "," : "", name, threads, (unsigned long long) iterations,
+            (unsigned long long) elapsed_ns, ns_per_op, ns_per_op > 0 ? 1e9 / ns_per_op : 0, items);
+    fflush(stdout);
+}
+
+static void report_memory(const char *name, size_t items, size_t bytes)
+{
+    printf("%s\n    {\"name\": \"%s\", \"items\": %zu, \"bytes\": %zu, \"bytes_per_item\": %.1f}",
+            s_bench.result_count++ ? "," : "", name, items, bytes, items ? (double) bytes / items : 0);
+    fflush(stdout);
+}
+
+static unsigned char *put_tag_header(unsigned char *p, uint8_t type, uint8_t name)
+{
+    struct tag_header th;
+    th.type = type;
+    th.name_len = 1;
+    *th.name = name;
+    memcpy(p, &th, sizeof(th));
+    return p + sizeof(th);
+}
+
+static unsigned char *put_string(unsigned char *p, const char *str, uint16_t len)
+{
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), str, len);
+    return p + sizeof(len) + len;
+}
+
+static unsigned char *put_uint32(unsigned char *p, uint32_t val)
+{
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+static size_t make_name(char *name, size_t max_len)
+{
+    size_t len = 0;
+    int words = 2 + rnd() % 3;
+
+    while (words-- > 0) {
+        const char *w = s_bench.words[rnd() % VOCABULARY_SIZE];
+        size_t wlen = strlen(w);
+        if (len + wlen + 5 >= max_len)
+            break;
+        memcpy(name + len, w, wlen);
+        len += wlen;
+        name[len++] = words ? ' ' : '.';
+    }
+    memcpy(name + len, "mp3", 3);
+
+    return len + 3;
+}
+
+static void init_data(void)
+{
+    size_t i, j;
+
+    s_bench.rng = 88172645463325252ull;
+
+    for (i = 0; i < VOCABULARY_SIZE; ++i) {
+        size_t len = 3 + rnd() % 8;
+        for (j = 0; j < len; ++j) {
+            s_bench.words[i][j] = 'a' + rnd() % 26;
+        }
+        s_bench.words[i][len] = 0;
+    }
+
+    s_bench.file_count = SHARE_BATCHES * OFFER_FILES;
+    s_bench.files = (struct pub_file *) calloc(s_bench.file_count, sizeof(*s_bench.files));
+    s_bench.names = (char (*)[64]) malloc(s_bench.file_count * sizeof(*s_bench.names));
+
+    for (i = 0; i < s_bench.file_count; ++i) {
+        struct pub_file *f = &s_bench.files[i];
+        for (j = 0; j < sizeof(f->hash); ++j) {
+            f->hash[j] = (unsigned char) rnd();
+        }
+        f->name = s_bench.names[i];
+        f->name_len = make_name(s_bench.names[i], sizeof(s_bench.names[i]));
+        f->size = 1024 + rnd() % (10 * 1024 * 1024);
+        f->type = FT_AUDIO;
+        f->media_codec = "mp3";
+        f->media_codec_len = 3;
+        f->media_length = 60 + rnd() % 300;
+        f->media_bitrate = 128;
+        f->complete = 1;
+    }
+}
+
+/* OP_OFFERFILES payload (without header and opcode) */
+static size_t make_offer_payload(unsigned char *buf, const struct pub_file *files, size_t count)
+{
+    unsigned char *p = put_uint32(buf, count);
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        const struct pub_file *f = &files[i];
+
+        memcpy(p, f->hash, sizeof(f->hash));
+        p += sizeof(f->hash);
+        p = put_uint32(p, 0xfbfbfbfbu);
+        *p++ = 0xfb;
+        *p++ = 0xfb;
+        p = put_uint32(p, 6);
+
+        p = put_tag_header(p, TT_STRING, TN_FILENAME);
+        p = put_string(p, f->name, f->name_len);
+        p = put_tag_header(p, TT_UINT32, TN_FILESIZE);
+        p = put_uint32(p, (uint32_t) f->size);
+        p = put_tag_header(p, TT_STRING, TN_FILETYPE);
+        p = put_string(p, FTS_AUDIO, sizeof(FTS_AUDIO) - 1);
+        p = put_tag_header(p, TT_UINT32, TN_MEDIA_LENGTH);
+        p = put_uint32(p, f->media_length);
+        p = put_tag_header(p, TT_UINT32, TN_MEDIA_BITRATE);
+        p = put_uint32(p, f->media_bitrate);
+        p = put_tag_header(p, TT_STRING, TN_MEDIA_CODEC);
+        p = put_string(p, f->media_codec, f->media_codec_len);
+    }
+
+    return p - buf;
+}
+
+/* OP_SEARCHREQUEST payload: (word1 AND word2) AND size >= minsize */
+static size_t make_search_payload(unsigned char *buf)
+{
+    unsigned char *p = buf;
+    uint16_t oper = SO_AND;
+    int i;
+
+    memcpy(p, &oper, sizeof(oper));
+    p += sizeof(oper);
+    memcpy(p, &oper, sizeof(oper));
+    p += sizeof(oper);
+    for (i = 0; i < 2; ++i) {
+        const char *w = s_bench.words[rnd() % 64];
+        *p++ = SO_STRING_TERM;
+        p = put_string(p, w, strlen(w));
+    }
+    *p++ = SO_UINT32;
+    p = put_uint32(p, 1024);
+    p = put_uint32(p, SC_MINSIZE);
+
+    return p - buf;
+}
+
+static void bench_parse_offer(struct arena *arena)
+{
+    static unsigned char payload[MAX_UNCOMPRESSED_PACKET_SIZE];
+    size_t len = make_offer_payload(payload, s_bench.files, OFFER_FILES);
+    uint64_t i, iterations = 20000ull * s_bench.scale, start;
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        struct packet_buffer pb;
+        struct pub_file *files;
+        size_t count;
+
+        PB_INIT(&pb, payload, len);
+        if (!parse_offer_files(&pb, arena, &files, &count) || count != OFFER_FILES) {
+            ED2KD_LOGERR("failed to parse offer");
+            return;
+        }
+        arena_reset(arena);
+    }
+    report("parse_offer_files", 1, iterations, now_ns() - start, OFFER_FILES);
+}
+
+static void bench_parse_search(struct arena *arena)
+{
+    unsigned char payload[256];
+    size_t len = make_search_payload(payload);
+    uint64_t i, iterations = 2000000ull * s_bench.scale, start;
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        struct packet_buffer pb;
+        struct search_node root;
+
+        PB_INIT(&pb, payload, len);
+        if (!parse_search_request(&pb, arena, &root)) {
+            ED2KD_LOGERR("failed to parse search request");
+            return;
+        }
+        arena_reset(arena);
+    }
+    report("parse_search_request", 1, iterations, now_ns() - start, 5);
+}
+
+static void bench_write_search_file(void)
+{
+    struct evbuffer *buf = evbuffer_new();
+    uint64_t i, iterations = 1000000ull * s_bench.scale, start;
+    unsigned char hash[ED2K_HASH_SIZE] = {0};
+    struct search_file sf;
+
+    memset(&sf, 0, sizeof(sf));
+    sf.hash = hash;
+    sf.client_id = 0x0100007f;
+    sf.client_port = 4662;
+    sf.name = s_bench.files[0].name;
+    sf.name_len = s_bench.files[0].name_len;
+    sf.size = 5000000;
+    sf.type = FT_AUDIO;
+    sf.rating = 3;
+    sf.rated_count = 1;
+    sf.ext = "mp3";
+    sf.ext_len = 3;
+    sf.media_length = 240;
+    sf.media_bitrate = 192;
+    sf.media_codec = "mp3";
+    sf.media_codec_len = 3;
+    sf.srcavail = 10;
+    sf.srccomplete = 5;
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        write_search_file(buf, &sf);
+        // one search result worth of files
+        if (i % MAX_SEARCH_FILES == MAX_SEARCH_FILES - 1)
+            evbuffer_drain(buf, evbuffer_get_length(buf));
+    }
+    report("write_search_file", 1, iterations, now_ns() - start, 1);
+
+    evbuffer_free(buf);
+}
+
+static void bench_zlib_unpack(void)
+{
+    static unsigned char payload[MAX_UNCOMPRESSED_PACKET_SIZE];
+    static unsigned char unpacked[MAX_UNCOMPRESSED_PACKET_SIZE];
+    unsigned char *packed;
+    uLongf packed_len;
+    size_t len = make_offer_payload(payload, s_bench.files, OFFER_FILES);
+    uint64_t i, iterations = 10000ull * s_bench.scale, start;
+
+    packed_len = compressBound(len);
+    packed = (unsigned char *) malloc(packed_len);
+    if (Z_OK != compress(packed, &packed_len, payload, len)) {
+        ED2KD_LOGERR("failed to compress payload");
+        free(packed);
+        return;
+    }
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        uLongf unpacked_len = sizeof(unpacked);
+        if (Z_OK != uncompress(unpacked, &unpacked_len, packed, packed_len) || unpacked_len != len) {
+            ED2KD_LOGERR("failed to uncompress payload");
+            break;
+        }
+    }
+    report("zlib_unpack_offer", 1, iterations, now_ns() - start, len);
+
+    free(packed);
+}
+
+/* accept_cb() admission check against big ban list, with connections released in FIFO order */
+static void bench_admission(void)
+{
+    char path[] = "/tmp/ed2kd_bench_bans_XXXXXX";
+    uint32_t ips[ADMISSION_IPS], window[ADMISSION_WINDOW];
+    uint64_t i, iterations = 2000000ull * s_bench.scale, start;
+    FILE *fp;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0 || !(fp = fdopen(fd, "w"))) {
+        ED2KD_LOGERR("failed to create ban file");
+        return;
+    }
+    for (i = 0; i < BANNED_NETWORKS; ++i) {
+        uint32_t net = rnd();
+        fprintf(fp, "%u.%u.%u.%u/%u\n", net >> 24, (net >> 16) & 0xff, (net >> 8) & 0xff, net & 0xff,
+                16 + rnd() % 17);
+    }
+    fclose(fp);
+
+    for (i = 0; i < ADMISSION_IPS; ++i) {
+        ips[i] = rnd() | 1;
+    }
+    memset(window, 0, sizeof(window));
+
+    if (!admission_init(100000, 4, path)) {
+        unlink(path);
+        return;
+    }
+    unlink(path);
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        uint32_t *slot = &window[i % ADMISSION_WINDOW];
+        uint32_t ip = ips[rnd() % ADMISSION_IPS];
+
+        if (*slot)
+            admission_release(*slot);
+        *slot = 0;
+        if (ADMISSION_OK == admission_accept(ip))
+            *slot = ip;
+    }
+    report("admission_accept", 1, iterations, now_ns() - start, 1);
+
+    for (i = 0; i < ADMISSION_WINDOW; ++i) {
+        if (window[i])
+            admission_release(window[i]);
+    }
+    admission_free();
+}
+
+/* client's shared files set filled by offers */
+static void bench_hashset(void)
+{
+    uint64_t i, iterations = 50ull * s_bench.scale, start;
+    size_t j, bytes = 0;
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        struct hashset set;
+
+        memset(&set, 0, sizeof(set));
+        for (j = 0; j < HASHSET_FILES; ++j) {
+            hashset_add(&set, s_bench.files[j].hash);
+        }
+        bytes = hashset_mem_usage(&set);
+        hashset_free(&set);
+    }
+    report("hashset_add", 1, iterations, now_ns() - start, HASHSET_FILES);
+    report_memory("hashset_mem_usage", HASHSET_FILES, bytes);
+}
+
+static void *db_bench_worker(void *arg)
+{
+    struct arena *arena = (struct arena *) arg;
+    struct client owners[SHARE_CLIENTS];
+    struct evbuffer *buf;
+    uint64_t i, iterations, start;
+    size_t total;
+
+    if (!db_open()) {
+        ED2KD_LOGERR("failed to open database");
+        return NULL;
+    }
+
+    memset(owners, 0, sizeof(owners));
+    for (i = 0; i < SHARE_CLIENTS; ++i) {
+        owners[i].id = 0x01000000 + i;
+        owners[i].port = 4662;
+    }
+
+    // fills database used by following benchmarks
+    start = now_ns();
+    for (i = 0; i < SHARE_BATCHES; ++i) {
+        if (!db_share_files(s_bench.files + i * OFFER_FILES, OFFER_FILES, &owners[i % SHARE_CLIENTS]))
+            goto exit;
+    }
+    if (bench_enabled("db_share_files"))
+        report("db_share_files", 1, SHARE_BATCHES, now_ns() - start, OFFER_FILES);
+
+    if (bench_enabled("db_search_files")) {
+        unsigned char payload[256];
+        size_t len;
+
+        buf = evbuffer_new();
+        iterations = 2000ull * s_bench.scale;
+        total = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; ++i) {
+            struct packet_buffer pb;
+            struct search_node root;
+            size_t count = MAX_SEARCH_FILES;
+
+            len = make_search_payload(payload);
+            PB_INIT(&pb, payload, len);
+            if (!parse_search_request(&pb, arena, &root) || !db_search_files(&root, buf, &count, NULL))
+                break;
+            total += count;
+            evbuffer_drain(buf, evbuffer_get_length(buf));
+            arena_reset(arena);
+        }
+        report("db_search_files", 1, i, now_ns() - start, i ? total / i : 0);
+        evbuffer_free(buf);
+    }
+
+    if (bench_enabled("db_get_sources")) {
+        struct file_source sources[MAX_FOUND_SOURCES];
+
+        iterations = 200000ull * s_bench.scale;
+        total = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; ++i) {
+            uint8_t count = MAX_FOUND_SOURCES;
+            if (!db_get_sources(s_bench.files[rnd() % s_bench.file_count].hash, sources, &count))
+                break;
+            total += count;
+        }
+        report("db_get_sources", 1, i, now_ns() - start, i ? total / i : 0);
+    }
+
+    if (bench_enabled("db_get_sources_batch")) {
+        static struct file_source sources[MAX_GETSOURCES_BATCH][MAX_FOUND_SOURCES];
+        struct source_query queries[MAX_GETSOURCES_BATCH];
+        size_t j;
+
+        // one iteration per hash, comparable with db_get_sources
+        iterations = 200000ull * s_bench.scale;
+        total = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i += MAX_GETSOURCES_BATCH) {
+            for (j = 0; j < MAX_GETSOURCES_BATCH; ++j) {
+                queries[j].hash = s_bench.files[rnd() % s_bench.file_count].hash;
+                queries[j].sources = sources[j];
+                queries[j].obfu = 0;
+                queries[j].count = MAX_FOUND_SOURCES;
+            }
+            if (!db_get_sources_batch(queries, MAX_GETSOURCES_BATCH))
+                break;
+            for (j = 0; j < MAX_GETSOURCES_BATCH; ++j) {
+                total += queries[j].count;
+            }
+        }
+        report("db_get_sources_batch", 1, i, now_ns() - start, i ? total / i : 0);
+    }
+
+    exit:
+    db_close();
+    return NULL;
+}
+
+static void bench_db(struct arena *arena)
+{
+    pthread_t thread;
+
+    // database connections are per thread, as in server job workers
+    pthread_create(&thread, NULL, db_bench_worker, arena);
+    pthread_join(thread, NULL);
+}
+
+static struct {
+    /* dequeued jobs count */
+    atomic_uint32_t done;
+    /* queued job owners */
+    struct client clients[QUEUE_CLIENTS];
+} s_queue;
+
+static void *queue_bench_worker(void *arg)
+{
+    struct job *job;
+    (void) arg;
+
+    // same loop as server_job_worker() without job processing
+    while ((job = server_get_job())) {
+        server_release_job(job);
+        atomic_fetch_add(&s_queue.done, 1);
+    }
+
+    return NULL;
+}
+
+/* main thread enqueues jobs like event loop thread does, workers dequeue them */
+static void bench_job_queue(size_t threads)
+{
+    pthread_t *tids = (pthread_t *) malloc(threads * sizeof(*tids));
+    uint64_t i, total = 500000ull * s_bench.scale, start;
+    char name[64];
+
+    memset(&s_queue, 0, sizeof(s_queue));
+    for (i = 0; i < QUEUE_CLIENTS; ++i) {
+        // extra reference, so clients are never deleted
+        s_queue.clients[i].ref_cnt = 1;
+    }
+    atomic_store(&g_srv.terminate, 0);
+
+    for (i = 0; i < threads; ++i) {
+        pthread_create(&tids[i], NULL, queue_bench_worker, NULL);
+    }
+
+    start = now_ns();
+    for (i = 0; i < total; ++i) {
+        struct job *job = (struct job *) malloc(sizeof(*job));
+        job->type = JOB_SERVER_READ;
+        job->clnt = &s_queue.clients[rnd() % QUEUE_CLIENTS];
+        server_add_job(job);
+    }
+    while (atomic_load(&s_queue.done) < total) {
+        struct timespec ts = {0, 10000};
+        nanosleep(&ts, NULL);
+    }
+    snprintf(name, sizeof(name), "job_queue_%zu_threads", threads);
+    report(name, threads, total, now_ns() - start, 1);
+
+    pthread_mutex_lock(&g_srv.job_mutex);
+    atomic_store(&g_srv.terminate, 1);
+    pthread_cond_broadcast(&g_srv.job_cond);
+    pthread_mutex_unlock(&g_srv.job_mutex);
+
+    for (i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, longIndex = 0;
+    struct arena arena;
+    size_t threads;
+
+    s_bench.scale = DEFAULT_SCALE;
+    s_bench.max_threads = DEFAULT_MAX_THREADS;
+
+    opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    while (opt != -1) {
+        switch (opt) {
+            case 'h':
+                display_usage();
+                return EXIT_SUCCESS;
+
+            case 's':
+                s_bench.scale = atoi(optarg);
+                break;
+
+            case 't':
+                s_bench.max_threads = atoi(optarg);
+                break;
+
+            case 'f':
+                s_bench.filter = optarg;
+                break;
+
+            default:
+                display_usage();
+                return EXIT_FAILURE;
+        }
+        opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    }
+
+    if (!s_bench.scale || !s_bench.max_threads) {
+        display_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!arena_init(&arena, MAX_UNCOMPRESSED_PACKET_SIZE + MAX_SEARCH_FILES * sizeof(struct pub_file))) {
+        ED2KD_LOGERR("failed to allocate arena");
+        return EXIT_FAILURE;
+    }
+
+    if (!db_create()) {
+        ED2KD_LOGERR("failed to create database");
+        return EXIT_FAILURE;
+    }
+
+    pthread_cond_init(&g_srv.job_cond, NULL);
+    pthread_mutex_init(&g_srv.job_mutex, NULL);
+    TAILQ_INIT(&g_srv.jqueue);
+
+    init_data();
+
+    printf("{\n  \"version\": \"%s\",\n  \"scale\": %u,\n  \"benchmarks\": [", ED2KD_VER_STR, s_bench.scale);
+
+    if (bench_enabled("parse_offer_files"))
+        bench_parse_offer(&arena);
+    if (bench_enabled("parse_search_request"))
+        bench_parse_search(&arena);
+    if (bench_enabled("write_search_file"))
+        bench_write_search_file();
+    if (bench_enabled("zlib_unpack_offer"))
+        bench_zlib_unpack();
+    if (bench_enabled("admission_accept"))
+        bench_admission();
+    if (bench_enabled("hashset"))
+        bench_hashset();
+    if (bench_enabled("db_share_files") || bench_enabled("db_search_files") || bench_enabled("db_get_sources")
+            || bench_enabled("db_get_sources_batch"))
+        bench_db(&arena);
+    for (threads = 1; threads <= s_bench.max_threads; threads *= 2) {
+        if (bench_enabled("job_queue"))
+            bench_job_queue(threads);
+    }
+
+    printf("\n  ]\n}\n");
+
+    pthread_mutex_destroy(&g_srv.job_mutex);
+    pthread_cond_destroy(&g_srv.job_cond);
+    db_destroy();
+    arena_destroy(&arena);
+    free(s_bench.files);
+    free(s_bench.names);
+
+    return EXIT_SUCCESS;
+}
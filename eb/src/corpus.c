@@ -0,0 +1,312 @@
+#include "corpus.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "../../src/ed2k_proto.h"
+
+// word and name length limits used to size the strings pool
+#define MAX_WORD_LEN 24
+#define MAX_NAME_LEN 192
+
+// Zipf exponents of words frequency and files popularity
+#define WORD_ZIPF_S 1.0
+#define FILE_ZIPF_S 0.9
+
+// share of media files having media tags
+#define MEDIA_TAGS_PERCENT 70
+
+struct file_kind {
+    uint8_t type;
+    /* share of files, percents */
+    unsigned weight;
+    /* lognormal size parameters: median in bytes and sigma */
+    double size_median;
+    double size_sigma;
+    const char *exts[5];
+    const char *codecs[4];
+};
+
+// weights and sizes approximate public eDonkey network statistics
+static const struct file_kind s_kinds[] = {
+        {FT_AUDIO, 44, 4.5e6, 0.5, {"mp3", "mp3", "flac", "ogg", "wma"}, {"mp3", "flac", "vorbis", "aac"}},
+        {FT_VIDEO, 26, 350e6, 0.9, {"avi", "avi", "mkv", "mp4", "wmv"}, {"xvid", "divx", "h264", "hevc"}},
+        {FT_IMAGE, 4, 300e3, 1.0, {"jpg", "jpg", "png", "gif", "bmp"}, {NULL}},
+        {FT_PROGRAM, 8, 30e6, 1.5, {"exe", "exe", "msi", "exe", "apk"}, {NULL}},
+        {FT_DOCUMENT, 7, 800e3, 1.2, {"pdf", "pdf", "doc", "txt", "epub"}, {NULL}},
+        {FT_ARCHIVE, 8, 50e6, 1.5, {"zip", "rar", "rar", "7z", "zip"}, {NULL}},
+        {FT_CDIMAGE, 3, 700e6, 0.6, {"iso", "iso", "bin", "nrg", "cue"}, {NULL}}
+};
+
+static const char *s_onsets[] = {
+        "b", "c", "d", "f", "g", "h", "k", "l", "m", "n", "p", "r", "s", "t", "v", "z",
+        "br", "ch", "dr", "gr", "kr", "sh", "st", "tr", "th", "", ""
+};
+
+// a few multibyte vowels exercise unicode tokenization
+static const char *s_vowels[] = {
+        "a", "e", "i", "o", "u", "a", "e", "i", "o", "u", "ai", "ea", "ou", "y",
+        "\xc3\xa9", "\xc3\xbc"
+};
+
+static const char *s_codas[] = {"", "", "", "n", "r", "s", "l", "t", "x", "m"};
+
+static const char *s_qualities[] = {"DVDRip", "720p", "1080p", "HDTV", "BRRip", "CAM"};
+
+#define COUNT_OF(x) (sizeof(x) / sizeof((x)[0]))
+#define PICK(rng, arr) ((arr)[rng_next(rng) % COUNT_OF(arr)])
+
+static double rng_normal(uint64_t *rng)
+{
+    // Box-Muller transform
+    return sqrt(-2.0 * log(rng_unit(rng))) * cos(2.0 * M_PI * rng_unit(rng));
+}
+
+static double rng_lognormal(uint64_t *rng, double median, double sigma)
+{
+    return median * exp(sigma * rng_normal(rng));
+}
+
+static double *zipf_cdf(size_t n, double s)
+{
+    size_t i;
+    double sum = 0;
+    double *cdf = (double *) malloc(n * sizeof(*cdf));
+
+    if (!cdf)
+        return NULL;
+
+    for (i = 0; i < n; ++i) {
+        sum += 1.0 / pow((double) (i + 1), s);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < n; ++i) {
+        cdf[i] /= sum;
+    }
+
+    return cdf;
+}
+
+static size_t zipf_sample(const double *cdf, size_t n, double u)
+{
+    size_t lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static char *append(char *p, const char *str, size_t len)
+{
+    memcpy(p, str, len);
+    return p + len;
+}
+
+static char *append_str(char *p, const char *str)
+{
+    return append(p, str, strlen(str));
+}
+
+static char *make_word(char *p, size_t rank, uint64_t *rng)
+{
+    // frequent words are shorter
+    int syl = 1 + (rank > 100) + (rank > 5000) + rng_next(rng) % 2;
+    char *start = p;
+
+    for (; syl > 0; --syl) {
+        p = append_str(p, PICK(rng, s_onsets));
+        p = append_str(p, PICK(rng, s_vowels));
+        p = append_str(p, PICK(rng, s_codas));
+    }
+    if (p == start)
+        *p++ = 'a';
+
+    return p;
+}
+
+static char *append_word(char *p, const struct corpus *c, struct corpus_file *f, uint64_t *rng, int capitalize)
+{
+    uint32_t w = corpus_rnd_word(c, rng);
+    char *start = p;
+
+    p = append(p, c->words[w], c->word_lens[w]);
+    if (capitalize && *start >= 'a' && *start <= 'z')
+        *start -= 'a' - 'A';
+    if (f->word_cnt < COUNT_OF(f->words))
+        f->words[f->word_cnt++] = w;
+
+    return p;
+}
+
+static char *make_name(char *p, const struct corpus *c, struct corpus_file *f, const struct file_kind *kind,
+        uint64_t *rng)
+{
+    int i, cnt;
+    char sep = PICK(rng, " _.");
+    int caps = rng_next(rng) % 2;
+
+    switch (kind->type) {
+        case FT_AUDIO:
+            // [track] artist - title
+            if (rng_next(rng) % 3 == 0)
+                p += sprintf(p, "%02u ", 1 + rng_next(rng) % 15);
+            cnt = 1 + rng_next(rng) % 2;
+            for (i = 0; i < cnt; ++i) {
+                if (i) *p++ = ' ';
+                p = append_word(p, c, f, rng, caps);
+            }
+            p = append_str(p, " - ");
+            cnt = 1 + rng_next(rng) % 3;
+            for (i = 0; i < cnt; ++i) {
+                if (i) *p++ = ' ';
+                p = append_word(p, c, f, rng, caps);
+            }
+            break;
+
+        case FT_VIDEO:
+            // title.year.quality.codec
+            cnt = 1 + rng_next(rng) % 4;
+            for (i = 0; i < cnt; ++i) {
+                if (i) *p++ = sep;
+                p = append_word(p, c, f, rng, 1);
+            }
+            if (rng_next(rng) % 2)
+                p += sprintf(p, "%c%u", sep, 1970 + rng_next(rng) % 45);
+            if (rng_next(rng) % 2)
+                p += sprintf(p, "%c%s", sep, PICK(rng, s_qualities));
+            break;
+
+        default:
+            cnt = 1 + rng_next(rng) % 4;
+            for (i = 0; i < cnt; ++i) {
+                if (i) *p++ = sep;
+                p = append_word(p, c, f, rng, caps);
+            }
+            if (FT_PROGRAM == kind->type && rng_next(rng) % 2)
+                p += sprintf(p, " v%u.%u", rng_next(rng) % 10, rng_next(rng) % 20);
+            break;
+    }
+
+    *p++ = '.';
+    p = append_str(p, PICK(rng, kind->exts));
+
+    return p;
+}
+
+static void make_media(struct corpus_file *f, const struct file_kind *kind, uint64_t *rng)
+{
+    double len, bitrate;
+
+    if (rng_next(rng) % 100 >= MEDIA_TAGS_PERCENT)
+        return;
+
+    if (FT_AUDIO == kind->type) {
+        static const uint32_t bitrates[] = {128, 128, 160, 192, 192, 256, 320};
+        f->codec = PICK(rng, kind->codecs);
+        len = rng_lognormal(rng, 230, 0.35);
+        bitrate = strcmp(f->codec, "flac") ? PICK(rng, bitrates) : rng_lognormal(rng, 900, 0.2);
+    } else {
+        f->codec = PICK(rng, kind->codecs);
+        len = rng_lognormal(rng, 2700, 0.6);
+        bitrate = rng_lognormal(rng, 1200, 0.5);
+    }
+
+    f->media_length = (uint32_t) len + 1;
+    f->media_bitrate = (uint32_t) bitrate;
+    // keep size consistent with media tags
+    f->size = (uint64_t) (len * bitrate * 125.0) + 1;
+}
+
+int corpus_init(struct corpus *c, size_t word_cnt, size_t file_cnt, uint64_t seed)
+{
+    size_t i;
+    char *p;
+    uint64_t rng = seed ? seed : 1;
+    unsigned total_weight = 0;
+
+    memset(c, 0, sizeof(*c));
+    if (!word_cnt || !file_cnt)
+        return 0;
+
+    c->word_cnt = word_cnt;
+    c->file_cnt = file_cnt;
+    c->words = (const char **) malloc(word_cnt * sizeof(*c->words));
+    c->word_lens = (uint16_t *) malloc(word_cnt * sizeof(*c->word_lens));
+    c->files = (struct corpus_file *) calloc(file_cnt, sizeof(*c->files));
+    c->pool = (char *) malloc(word_cnt * MAX_WORD_LEN + file_cnt * MAX_NAME_LEN);
+    c->word_cdf = zipf_cdf(word_cnt, WORD_ZIPF_S);
+    c->file_cdf = zipf_cdf(file_cnt, FILE_ZIPF_S);
+    if (!c->words || !c->word_lens || !c->files || !c->pool || !c->word_cdf || !c->file_cdf) {
+        corpus_free(c);
+        return 0;
+    }
+
+    p = c->pool;
+    for (i = 0; i < word_cnt; ++i) {
+        char *end = make_word(p, i, &rng);
+        c->words[i] = p;
+        c->word_lens[i] = (uint16_t) (end - p);
+        p = end;
+    }
+
+    for (i = 0; i < COUNT_OF(s_kinds); ++i) {
+        total_weight += s_kinds[i].weight;
+    }
+
+    for (i = 0; i < file_cnt; ++i) {
+        struct corpus_file *f = &c->files[i];
+        const struct file_kind *kind = s_kinds;
+        unsigned w = rng_next(&rng) % total_weight;
+        char *end;
+        size_t j;
+
+        while (w >= kind->weight) {
+            w -= kind->weight;
+            kind++;
+        }
+
+        for (j = 0; j < sizeof(f->hash); ++j) {
+            f->hash[j] = (unsigned char) rng_next(&rng);
+        }
+        f->type = kind->type;
+        f->size = (uint64_t) rng_lognormal(&rng, kind->size_median, kind->size_sigma) + 1;
+        if (FT_AUDIO == kind->type || FT_VIDEO == kind->type)
+            make_media(f, kind, &rng);
+
+        end = make_name(p, c, f, kind, &rng);
+        f->name = p;
+        f->name_len = (uint16_t) (end - p);
+        p = end;
+    }
+
+    return 1;
+}
+
+void corpus_free(struct corpus *c)
+{
+    free(c->words);
+    free(c->word_lens);
+    free(c->word_cdf);
+    free(c->files);
+    free(c->file_cdf);
+    free(c->pool);
+    memset(c, 0, sizeof(*c));
+}
+
+const struct corpus_file *corpus_rnd_file(const struct corpus *c, uint64_t *rng)
+{
+    return &c->files[zipf_sample(c->file_cdf, c->file_cnt, rng_unit(rng))];
+}
+
+uint32_t corpus_rnd_word(const struct corpus *c, uint64_t *rng)
+{
+    return (uint32_t) zipf_sample(c->word_cdf, c->word_cnt, rng_unit(rng));
+}
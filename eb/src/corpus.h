@@ -0,0 +1,97 @@
+#ifndef EB_CORPUS_H
+#define EB_CORPUS_H
+
+/**
+@file corpus.h synthetic shared files corpus
+
+Vocabulary words follow Zipf's law, file names are built from them, file
+popularity is Zipfian as well and shared by all clients, so popular files
+are offered by many clients under the same hash. File types, extensions,
+sizes and media tags are drawn from per-type distributions resembling
+real eDonkey networks.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DEFAULT_CORPUS_WORDS 50000
+#define DEFAULT_CORPUS_FILES 100000
+
+struct corpus_file {
+    /* ed2k hash */
+    unsigned char hash[16];
+    /* file size */
+    uint64_t size;
+    /* file name (not null terminated) */
+    const char *name;
+    /* file name length */
+    uint16_t name_len;
+    /* FT_* file type */
+    uint8_t type;
+    /* media codec, NULL if none */
+    const char *codec;
+    /* media length in seconds, 0 if none */
+    uint32_t media_length;
+    /* media bitrate in kbps, 0 if none */
+    uint32_t media_bitrate;
+    /* indexes of vocabulary words used in name */
+    uint32_t words[6];
+    /* name words count */
+    uint8_t word_cnt;
+};
+
+struct corpus {
+    /* vocabulary */
+    const char **words;
+    /* vocabulary words lengths */
+    uint16_t *word_lens;
+    /* cumulative Zipf distribution of words */
+    double *word_cdf;
+    /* vocabulary size */
+    size_t word_cnt;
+    /* files sorted by popularity */
+    struct corpus_file *files;
+    /* cumulative Zipf distribution of files */
+    double *file_cdf;
+    /* files count */
+    size_t file_cnt;
+    /* storage for words and names */
+    char *pool;
+};
+
+/* xorshift64*, state must be non-zero */
+static inline uint32_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t) ((*state * 2685821657736338717ull) >> 32);
+}
+
+/* uniform in (0, 1] */
+static inline double rng_unit(uint64_t *state)
+{
+    return ((double) rng_next(state) + 1.0) / 4294967296.0;
+}
+
+/**
+@brief generates corpus, same seed gives same corpus
+@param word_cnt  vocabulary size
+@param file_cnt  files count
+@return non-zero on success
+*/
+int corpus_init(struct corpus *c, size_t word_cnt, size_t file_cnt, uint64_t seed);
+
+void corpus_free(struct corpus *c);
+
+/**
+@return random file, more popular files are returned more often
+*/
+const struct corpus_file *corpus_rnd_file(const struct corpus *c, uint64_t *rng);
+
+/**
+@return random vocabulary word index, frequent words are returned more often
+*/
+uint32_t corpus_rnd_word(const struct corpus *c, uint64_t *rng);
+
+#endif // EB_CORPUS_H
@@ -0,0 +1,90 @@
+#include "histogram.h"
+#include <string.h>
+
+static unsigned bucket_index(uint64_t value)
+{
+    unsigned msb, shift;
+
+    if (value < (1u << HIST_SUB_BITS))
+        return (unsigned) value;
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS + 1;
+
+    return shift * HIST_HALF + (unsigned) (value >> shift);
+}
+
+/* middle of the values range counted by bucket */
+static uint64_t bucket_value(unsigned idx)
+{
+    unsigned shift;
+
+    if (idx < (1u << HIST_SUB_BITS))
+        return idx;
+
+    shift = idx / HIST_HALF - 1;
+
+    return ((uint64_t) (idx - shift * HIST_HALF) << shift) + ((1ull << shift) >> 1);
+}
+
+void hist_init(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *h, uint64_t value)
+{
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_quantile(const struct histogram *h, double q)
+{
+    unsigned i;
+    uint64_t rank, seen = 0;
+
+    if (!h->count)
+        return 0;
+
+    rank = (uint64_t) (q * (double) h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t val = bucket_value(i);
+            if (val < h->min)
+                return h->min;
+            if (val > h->max)
+                return h->max;
+            return val;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,45 @@
+#ifndef EB_HISTOGRAM_H
+#define EB_HISTOGRAM_H
+
+/**
+@file histogram.h log-linear (HDR-style) histogram of 64-bit values
+
+Values below 2^HIST_SUB_BITS are counted exactly, larger values fall into
+buckets with relative error below 1/2^(HIST_SUB_BITS-1).
+*/
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_HALF (1u << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+struct histogram {
+    /* recorded values count */
+    uint64_t count;
+    /* minimal recorded value */
+    uint64_t min;
+    /* maximal recorded value */
+    uint64_t max;
+    /* sum of recorded values */
+    uint64_t sum;
+    /* value counters */
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+
+void hist_record(struct histogram *h, uint64_t value);
+
+/**
+@brief adds all values recorded in src to dst
+*/
+void hist_merge(struct histogram *dst, const struct histogram *src);
+
+/**
+@param q quantile in [0, 1]
+@return approximated value at given quantile, 0 for empty histogram
+*/
+uint64_t hist_quantile(const struct histogram *h, double q);
+
+#endif // EB_HISTOGRAM_H
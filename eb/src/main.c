@@ -4,16 +4,22 @@
 #include <signal.h>
 #include <getopt.h>
 #include <time.h>
+#include <math.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <zlib.h>
 #include <event2/util.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 
 #include "../../src/ed2k_proto.h"
 #include "../../src/packet.h"
+#include "histogram.h"
+#include "corpus.h"
+#include "trace.h"
 
 // stringize macro
 #define _CSTR(x) #x
@@ -23,11 +29,21 @@
 #define DEFAULT_SPAWN_PAUSE 100 // msecs
 #define DEFAULT_ACTION_PAUSE 500 // msecs
 
-#define EB_VERSION "0.01"
+#define EB_VERSION "0.04"
+
+// maximum unanswered requests per client
+#define MAX_PENDING 16
+// files in one OP_OFFERFILES packet
+#define OFFER_FILES_COUNT 200
+// maximum words in generated search query
+#define MAX_QUERY_WORDS 3
+// maximum words in replayed search query
+#define MAX_TRACE_QUERY_WORDS 16
+// action pauses to wait for pending answers before disconnect
+#define DRAIN_ROUNDS 10
 
 // definitions for fixed length fields in ed2k packets
 #define NICK_LEN 5
-#define FILENAME_LEN 5
 
 enum actions {
     ACTION_OFFER = 0,
@@ -36,9 +52,15 @@ enum actions {
     ACTION_COUNT
 };
 
+struct ebthread;
+
 struct ebclient {
     /* Index */
     int idx;
+    /* Owner thread */
+    struct ebthread *thr;
+    /* Position in owner's ready clients array, -1 if not logged in */
+    int ready_idx;
     /* eDonkey2000 ID */
     uint32_t id;
     /* eDonkey2000 hash */
@@ -49,29 +71,98 @@ struct ebclient {
     struct event *ev_action;
     /* connection established flag */
     unsigned connected:1;
+    /* send times (usecs) of unanswered search requests, oldest first */
+    uint64_t pending_search[MAX_PENDING];
+    /* unanswered search requests count */
+    int pending_search_cnt;
+    /* unanswered source requests */
+    struct {
+        unsigned char hash[ED2K_HASH_SIZE];
+        uint64_t sent;
+    } pending_source[MAX_PENDING];
+    /* unanswered source requests count */
+    int pending_source_cnt;
+    /* action pauses left to wait for pending answers */
+    int drain_rounds;
 };
 
-struct ebinstance {
-    /* event base */
+struct action_stats {
+    /* requests sent */
+    uint64_t sent;
+    /* answers received */
+    uint64_t answered;
+    /* non-empty answers */
+    uint64_t hits;
+    /* request->answer latency (usecs) */
+    struct histogram latency;
+};
+
+struct ebthread {
+    /* Thread index */
+    int idx;
+    /* Thread handle */
+    pthread_t thread;
+    /* Event base */
     struct event_base *evbase;
     /* Client spawn timer */
     struct event *ev_spawn;
+    /* Open-loop requests scheduler timer */
+    struct event *ev_sched;
     /* Common pause between spawning clients */
     const struct timeval *spawn_pause;
-    /* Server address to connect */
-    struct sockaddr_in server_sa;
-    /* Count of concurrently working clients */
+    /* Common pause between client actions */
+    const struct timeval *action_pause;
+    /* Count of clients left to spawn */
     int client_cnt;
-    /* Total count of actions to perform */
+    /* Count of actions left to perform */
     int repeat_cnt;
     /* Count currently running clients */
     int running_cnt;
-    /* Common pause between client actions */
-    const struct timeval *action_pause;
+    /* Logged in clients */
+    struct ebclient **ready;
+    /* Logged in clients count */
+    int ready_cnt;
+    /* Open-loop scheduler started flag */
+    unsigned sched_started:1;
+    /* Intended send time of next open-loop request (usecs) */
+    uint64_t next_send;
+    /* Mean interval between open-loop requests (usecs) */
+    double mean_interval;
+    /* Requests not sent because client(s) had MAX_PENDING unanswered requests */
+    uint64_t skipped;
+    /* Time when load generation started (usecs) */
+    uint64_t start_time;
+    /* Random generator state */
+    uint64_t rng;
+    /* Per action statistics */
+    struct action_stats stats[ACTION_COUNT];
+    /* Trace events to replay */
+    const struct trace_event **events;
+    /* Next trace event to replay */
+    size_t event_pos;
+};
+
+struct ebinstance {
+    /* Server address to connect */
+    struct sockaddr_in server_sa;
+    /* Pause between spawning clients */
+    struct timeval tv_spawn;
+    /* Pause between client actions (closed-loop mode) */
+    struct timeval tv_action;
+    /* Target aggregate requests rate, 0 for closed-loop mode */
+    double rate;
+    /* Number of threads */
+    int thread_cnt;
+    /* Threads */
+    struct ebthread *threads;
     /* Number of selected actions */
     int action_cnt;
     /* Array of selected actions */
     int actions[ACTION_COUNT];
+    /* Shared files corpus */
+    struct corpus corpus;
+    /* Replayed session trace */
+    struct trace trace;
 };
 
 struct packet_login {
@@ -85,19 +176,19 @@ struct packet_login {
         struct tag_header hdr;
         uint16_t len;
         unsigned char val[NICK_LEN];
-    } tag_nick;
+    } __attribute__((__packed__)) tag_nick;
     struct {
         struct tag_header hdr;
         uint16_t val;
-    } tag_port;
+    } __attribute__((__packed__)) tag_port;
     struct {
         struct tag_header hdr;
         uint32_t val;
-    } tag_version;
+    } __attribute__((__packed__)) tag_version;
     struct {
         struct tag_header hdr;
         uint32_t val;
-    } tag_tcp_flags;
+    } __attribute__((__packed__)) tag_tcp_flags;
 } __attribute__((__packed__));
 
 struct packet_offer_files {
@@ -106,34 +197,10 @@ struct packet_offer_files {
     uint32_t file_count;
 } __attribute__((__packed__));
 
-struct pub_file {
-    unsigned char hash[ED2K_HASH_SIZE];
-    uint32_t id;
-    uint16_t port;
-    uint32_t tag_count;
-    struct {
-        struct tag_header hdr;
-        uint16_t len;
-        unsigned char val[FILENAME_LEN];
-    } tag_name;
-    struct {
-        struct tag_header hdr;
-        uint32_t val;
-    } tag_size;
-    struct {
-        struct tag_header hdr;
-        uint32_t val;
-    } tag_rating;
-    struct {
-        struct tag_header hdr;
-        uint32_t val;
-    } tag_type;
-} __attribute__((__packed__));
-
 struct ebinstance g_eb;
 
 // command line options
-static const char *optString = "vhs:c:w:r:p:OQS";
+static const char *optString = "vhs:c:w:r:p:t:R:F:e:T:OQS";
 static const struct option longOpts[] = {
         {"version", no_argument, NULL, 'v'},
         {"help", no_argument, NULL, 'h'},
@@ -142,35 +209,80 @@ static const struct option longOpts[] = {
         {"spawn-pause", required_argument, NULL, 'w'},
         {"repeat", required_argument, NULL, 'r'},
         {"action-pause", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"rate", required_argument, NULL, 'R'},
+        {"files", required_argument, NULL, 'F'},
+        {"seed", required_argument, NULL, 'e'},
+        {"replay", required_argument, NULL, 'T'},
         {"offer", no_argument, NULL, 'O'},
         {"query", no_argument, NULL, 'Q'},
         {"source", no_argument, NULL, 'S'},
         {NULL, no_argument, NULL, 0}
 };
 
-void get_rnd_str(unsigned char *str, size_t len)
+uint64_t now_usec(void)
 {
-    size_t i;
-    static const unsigned char alphanum[] =
-            "0123456789"
-                    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                    "abcdefghijklmnopqrstuvwxyz";
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t rnd(struct ebthread *thr)
+{
+    return rng_next(&thr->rng);
+}
+
+double rnd_unit(struct ebthread *thr)
+{
+    return rng_unit(&thr->rng);
+}
 
+void get_rnd_bytes(struct ebthread *thr, unsigned char *buf, size_t len)
+{
+    size_t i;
     for (i = 0; i < len; ++i) {
-        str[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+        buf[i] = (unsigned char) rnd(thr);
     }
 }
 
+int open_loop(void)
+{
+    return g_eb.rate || g_eb.trace.count;
+}
+
+void client_set_ready(struct ebclient *clnt)
+{
+    struct ebthread *thr = clnt->thr;
+    clnt->ready_idx = thr->ready_cnt;
+    thr->ready[thr->ready_cnt++] = clnt;
+}
+
+void client_unset_ready(struct ebclient *clnt)
+{
+    struct ebthread *thr = clnt->thr;
+
+    if (clnt->ready_idx < 0)
+        return;
+
+    // move last one to freed position
+    thr->ready[clnt->ready_idx] = thr->ready[--thr->ready_cnt];
+    thr->ready[clnt->ready_idx]->ready_idx = clnt->ready_idx;
+    clnt->ready_idx = -1;
+}
+
 void client_free(struct ebclient *clnt)
 {
+    struct ebthread *thr = clnt->thr;
+
+    client_unset_ready(clnt);
     bufferevent_free(clnt->bev);
     if (clnt->ev_action)
         event_free(clnt->ev_action);
     free(clnt);
 
-    g_eb.running_cnt--;
-    if (!g_eb.running_cnt && !g_eb.client_cnt) {
-        event_base_loopbreak(g_eb.evbase);
+    thr->running_cnt--;
+    if (!thr->running_cnt && !thr->client_cnt) {
+        event_base_loopbreak(thr->evbase);
     }
 }
 
@@ -216,95 +328,454 @@ void send_login_request(struct ebclient *clnt)
     bufferevent_write(clnt->bev, &data, sizeof data);
 }
 
-void send_offer_files(struct ebclient *clnt)
+void add_tag_header(struct evbuffer *buf, uint8_t type, uint8_t name)
+{
+    struct tag_header th;
+    th.type = type;
+    th.name_len = 1;
+    *th.name = name;
+    evbuffer_add(buf, &th, sizeof(th));
+}
+
+void add_tag_uint32(struct evbuffer *buf, uint8_t name, uint32_t val)
+{
+    add_tag_header(buf, TT_UINT32, name);
+    evbuffer_add(buf, &val, sizeof(val));
+}
+
+void add_tag_string(struct evbuffer *buf, uint8_t name, const char *str, uint16_t len)
+{
+    add_tag_header(buf, TT_STRING, name);
+    evbuffer_add(buf, &len, sizeof(len));
+    evbuffer_add(buf, str, len);
+}
+
+void add_pub_file(struct evbuffer *buf, const struct corpus_file *f)
+{
+    static const char *type_names[] = {
+            "", FTS_AUDIO, FTS_VIDEO, FTS_IMAGE, FTS_PROGRAM, FTS_DOCUMENT, FTS_ARCHIVE, FTS_CDIMAGE,
+            FTS_EMULECOLLECTION
+    };
+    // complete source
+    uint32_t id = 0xfbfbfbfbu;
+    uint16_t port = 0xfbfbu;
+    uint32_t tag_count = 3 + ((f->size >> 32) != 0) + (f->codec ? 3 : 0);
+
+    evbuffer_add(buf, f->hash, sizeof(f->hash));
+    evbuffer_add(buf, &id, sizeof(id));
+    evbuffer_add(buf, &port, sizeof(port));
+    evbuffer_add(buf, &tag_count, sizeof(tag_count));
+
+    add_tag_string(buf, TN_FILENAME, f->name, f->name_len);
+    add_tag_uint32(buf, TN_FILESIZE, (uint32_t) f->size);
+    if (f->size >> 32)
+        add_tag_uint32(buf, TN_FILESIZE_HI, (uint32_t) (f->size >> 32));
+    // clients send file type as string
+    if (f->type && f->type < sizeof(type_names) / sizeof(type_names[0]))
+        add_tag_string(buf, TN_FILETYPE, type_names[f->type], strlen(type_names[f->type]));
+    else
+        add_tag_uint32(buf, TN_FILETYPE, f->type);
+    if (f->codec) {
+        add_tag_uint32(buf, TN_MEDIA_LENGTH, f->media_length);
+        add_tag_uint32(buf, TN_MEDIA_BITRATE, f->media_bitrate);
+        add_tag_string(buf, TN_MEDIA_CODEC, f->codec, strlen(f->codec));
+    }
+}
+
+void send_offer(struct ebclient *clnt, const struct corpus_file **files, uint32_t count)
 {
-    size_t i;
     struct packet_offer_files data;
     struct packet_header *ph;
-    struct pub_file pf;
     struct evbuffer *buf = evbuffer_new();
+    uint32_t i;
 
     data.hdr.proto = PROTO_EDONKEY;
-    //data.hdr.length = 0;
+    data.hdr.length = 0;
     data.opcode = OP_OFFERFILES;
-    data.file_count = 200;
+    data.file_count = count;
 
     evbuffer_add(buf, &data, sizeof(data));
+    for (i = 0; i < count; ++i) {
+        add_pub_file(buf, files[i]);
+    }
 
-    // complete source
-    pf.id = 0xfdfdfdfdu;
-    pf.port = 0xfdfdu;
+    ph = (struct packet_header *) evbuffer_pullup(buf, sizeof(*ph));
+    ph->length = evbuffer_get_length(buf) - sizeof(*ph);
+
+    bufferevent_write_buffer(clnt->bev, buf);
+    evbuffer_free(buf);
 
-    pf.tag_count = 4;
+    clnt->thr->stats[ACTION_OFFER].sent++;
+}
 
-    // file name
-    pf.tag_name.hdr.type = TT_STRING;
-    pf.tag_name.hdr.name_len = 1;
-    *pf.tag_name.hdr.name = TN_FILENAME;
-    pf.tag_name.len = 5;
+/* offers files by popularity, so popular ones are shared by many clients */
+void send_offer_files(struct ebclient *clnt)
+{
+    const struct corpus_file *files[OFFER_FILES_COUNT];
+    size_t i;
 
-    // file size
-    pf.tag_size.hdr.type = TT_UINT32;
-    pf.tag_size.hdr.name_len = 1;
-    *pf.tag_size.hdr.name = TN_FILESIZE;
-    pf.tag_size.val = 10240;
+    for (i = 0; i < OFFER_FILES_COUNT; ++i) {
+        files[i] = corpus_rnd_file(&g_eb.corpus, &clnt->thr->rng);
+    }
 
-    // file type
-    pf.tag_type.hdr.type = TT_UINT32;
-    pf.tag_type.hdr.name_len = 1;
-    *pf.tag_type.hdr.name = TN_FILETYPE;
-    pf.tag_type.val = FT_PROGRAM;
+    send_offer(clnt, files, OFFER_FILES_COUNT);
+}
 
-    // file rating
-    pf.tag_rating.hdr.type = TT_UINT32;
-    pf.tag_rating.hdr.name_len = 1;
-    *pf.tag_rating.hdr.name = TN_FILERATING;
-    pf.tag_rating.val = 0;
+/**
+@brief sends search request with words combined by AND
+@param min_size  minimal file size constraint, 0 for none
+@param sent_time  time to measure latency from: actual send time in closed-loop mode, intended one in open-loop mode
+*/
+void send_search(struct ebclient *clnt, const char **words, const uint16_t *lens, size_t count, uint32_t min_size,
+        uint64_t sent_time)
+{
+    struct packet_header hdr, *ph;
+    struct evbuffer *buf;
+    uint8_t opcode = OP_SEARCHREQUEST;
+    uint16_t oper = SO_AND;
+    size_t i;
 
-    for (i = 0; i < data.file_count; ++i) {
-        evutil_secure_rng_get_bytes(pf.hash, sizeof(pf.hash));
-        get_rnd_str(pf.tag_name.val, sizeof(pf.tag_name.val));
+    buf = evbuffer_new();
+    hdr.proto = PROTO_EDONKEY;
+    hdr.length = 0;
+    evbuffer_add(buf, &hdr, sizeof(hdr));
+    evbuffer_add(buf, &opcode, sizeof(opcode));
 
-        evbuffer_add(buf, &pf, sizeof(pf));
+    // prefix notation: n-1 operators followed by n operands
+    for (i = 1; i < count + (min_size != 0); ++i) {
+        evbuffer_add(buf, &oper, sizeof(oper));
+    }
+    for (i = 0; i < count; ++i) {
+        uint8_t type = SO_STRING_TERM;
+        evbuffer_add(buf, &type, sizeof(type));
+        evbuffer_add(buf, &lens[i], sizeof(lens[i]));
+        evbuffer_add(buf, words[i], lens[i]);
+    }
+    if (min_size) {
+        uint8_t type = SO_UINT32;
+        uint32_t constr = SC_MINSIZE;
+        evbuffer_add(buf, &type, sizeof(type));
+        evbuffer_add(buf, &min_size, sizeof(min_size));
+        evbuffer_add(buf, &constr, sizeof(constr));
     }
 
     ph = (struct packet_header *) evbuffer_pullup(buf, sizeof(*ph));
     ph->length = evbuffer_get_length(buf) - sizeof(*ph);
 
+    clnt->pending_search[clnt->pending_search_cnt++] = sent_time;
+    clnt->thr->stats[ACTION_QUERY].sent++;
+
     bufferevent_write_buffer(clnt->bev, buf);
     evbuffer_free(buf);
 }
 
+/* searches words of popular file name, sometimes adding frequent word which may give no results */
+void send_search_request(struct ebclient *clnt, uint64_t sent_time)
+{
+    struct ebthread *thr = clnt->thr;
+    const struct corpus *c = &g_eb.corpus;
+    const struct corpus_file *f = corpus_rnd_file(c, &thr->rng);
+    const char *words[MAX_QUERY_WORDS];
+    uint16_t lens[MAX_QUERY_WORDS];
+    size_t i, count = 1 + rnd(thr) % MAX_QUERY_WORDS;
+    uint32_t min_size = 0;
+
+    if (count > f->word_cnt)
+        count = f->word_cnt;
+
+    for (i = 0; i < count; ++i) {
+        uint32_t w = f->words[(i + rnd(thr)) % f->word_cnt];
+        if (i && rnd(thr) % 5 == 0)
+            w = corpus_rnd_word(c, &thr->rng);
+        words[i] = c->words[w];
+        lens[i] = c->word_lens[w];
+    }
+
+    // every fourth query filters by minimal size
+    if (rnd(thr) % 4 == 0)
+        min_size = f->size > UINT32_MAX ? UINT32_MAX : (uint32_t) (f->size / 2);
+
+    send_search(clnt, words, lens, count, min_size, sent_time);
+}
+
+void send_get_sources(struct ebclient *clnt, const unsigned char *hash, uint64_t sent_time)
+{
+    struct {
+        struct packet_header hdr;
+        uint8_t opcode;
+        unsigned char hash[ED2K_HASH_SIZE];
+    } __attribute__((__packed__)) data;
+
+    data.hdr.proto = PROTO_EDONKEY;
+    data.hdr.length = sizeof(data) - sizeof(data.hdr);
+    data.opcode = OP_GETSOURCES;
+    memcpy(data.hash, hash, sizeof(data.hash));
+
+    memcpy(clnt->pending_source[clnt->pending_source_cnt].hash, data.hash, sizeof(data.hash));
+    clnt->pending_source[clnt->pending_source_cnt].sent = sent_time;
+    clnt->pending_source_cnt++;
+    clnt->thr->stats[ACTION_SOURCE].sent++;
+
+    bufferevent_write(clnt->bev, &data, sizeof(data));
+}
+
+int can_perform(struct ebclient *clnt, int action)
+{
+    switch (action) {
+        case ACTION_QUERY:
+            return clnt->pending_search_cnt < MAX_PENDING;
+        case ACTION_SOURCE:
+            return clnt->pending_source_cnt < MAX_PENDING;
+        default:
+            return 1;
+    }
+}
+
+void perform_action(struct ebclient *clnt, int action, uint64_t sent_time)
+{
+    switch (action) {
+        case ACTION_OFFER:
+            send_offer_files(clnt);
+            break;
+
+        case ACTION_QUERY:
+            send_search_request(clnt, sent_time);
+            break;
+
+        case ACTION_SOURCE:
+            send_get_sources(clnt, corpus_rnd_file(&g_eb.corpus, &clnt->thr->rng)->hash, sent_time);
+            break;
+
+        default:
+            assert(0);
+            break;
+    }
+}
+
 void timer_cb(evutil_socket_t fd, short what, void *ctx)
 {
     struct ebclient *clnt = (struct ebclient *) ctx;
+    struct ebthread *thr = clnt->thr;
     (void) fd;
     (void) what;
 
-    if (g_eb.action_cnt && g_eb.repeat_cnt) {
-        switch (g_eb.actions[rand() % g_eb.action_cnt]) {
-            case ACTION_OFFER:
-                send_offer_files(clnt);
-                break;
+    if (!open_loop() && g_eb.action_cnt && thr->repeat_cnt) {
+        int action = g_eb.actions[rnd(thr) % g_eb.action_cnt];
+
+        if (can_perform(clnt, action))
+            perform_action(clnt, action, now_usec());
+        else
+            thr->skipped++;
+        thr->repeat_cnt--;
+        evtimer_add(clnt->ev_action, thr->action_pause);
+    } else if ((clnt->pending_search_cnt || clnt->pending_source_cnt) && clnt->drain_rounds++ < DRAIN_ROUNDS) {
+        // wait for answers to already sent requests
+        evtimer_add(clnt->ev_action, thr->action_pause);
+    } else {
+        client_free(clnt);
+    }
+}
 
-            case ACTION_QUERY:
-                break;
+/* sends open-loop request on behalf of random logged in client */
+void issue_request(struct ebthread *thr, uint64_t intended)
+{
+    int action = g_eb.actions[rnd(thr) % g_eb.action_cnt];
+    int i, start;
+
+    if (thr->ready_cnt) {
+        start = rnd(thr) % thr->ready_cnt;
+        for (i = 0; i < thr->ready_cnt; ++i) {
+            struct ebclient *clnt = thr->ready[(start + i) % thr->ready_cnt];
+            if (can_perform(clnt, action)) {
+                perform_action(clnt, action, intended);
+                return;
+            }
+        }
+    }
 
-            case ACTION_SOURCE:
-                break;
+    thr->skipped++;
+}
 
-            default:
-                assert(0);
-                break;
+/* sends search request for space separated words */
+void replay_search(struct ebclient *clnt, const char *query, size_t len, uint64_t intended)
+{
+    const char *words[MAX_TRACE_QUERY_WORDS];
+    uint16_t lens[MAX_TRACE_QUERY_WORDS];
+    const char *end = query + len;
+    size_t count = 0;
+
+    while (query < end && count < MAX_TRACE_QUERY_WORDS) {
+        const char *sp = memchr(query, ' ', end - query);
+        if (!sp)
+            sp = end;
+        if (sp > query) {
+            words[count] = query;
+            lens[count++] = (uint16_t) (sp - query);
+        }
+        query = sp + 1;
+    }
+
+    send_search(clnt, words, lens, count, 0, intended);
+}
+
+/* replays next trace event on behalf of client mapped from trace client number */
+void replay_event(struct ebthread *thr, uint64_t intended)
+{
+    const struct trace_event *ev = thr->events[thr->event_pos++];
+    struct ebclient *clnt;
+
+    thr->repeat_cnt--;
+
+    if (!thr->ready_cnt) {
+        thr->skipped++;
+        return;
+    }
+    clnt = thr->ready[(ev->client / g_eb.thread_cnt) % thr->ready_cnt];
+
+    switch (ev->op) {
+        case TRACE_OFFER: {
+            const struct corpus_file *files[OFFER_FILES_COUNT];
+            uint32_t count = 0;
+
+            // following offers of the same client and time go into the same packet
+            files[count++] = &ev->file;
+            while (thr->repeat_cnt > 0 && count < OFFER_FILES_COUNT) {
+                const struct trace_event *next = thr->events[thr->event_pos];
+                if (next->op != TRACE_OFFER || next->client != ev->client || next->time != ev->time)
+                    break;
+                files[count++] = &next->file;
+                thr->event_pos++;
+                thr->repeat_cnt--;
+            }
+            send_offer(clnt, files, count);
+            break;
         }
 
-        g_eb.repeat_cnt--;
-        evtimer_add(clnt->ev_action, g_eb.action_pause);
+        case TRACE_SEARCH:
+            if (can_perform(clnt, ACTION_QUERY))
+                replay_search(clnt, ev->query, ev->query_len, intended);
+            else
+                thr->skipped++;
+            break;
+
+        case TRACE_SOURCES:
+            if (can_perform(clnt, ACTION_SOURCE))
+                send_get_sources(clnt, ev->file.hash, intended);
+            else
+                thr->skipped++;
+            break;
+
+        default:
+            assert(0);
+            break;
+    }
+}
+
+uint64_t next_intended(struct ebthread *thr)
+{
+    if (g_eb.trace.count)
+        return thr->start_time + thr->events[thr->event_pos]->time;
+    return thr->next_send;
+}
+
+void sched_cb(evutil_socket_t fd, short what, void *ctx)
+{
+    struct ebthread *thr = (struct ebthread *) ctx;
+    uint64_t now = now_usec(), intended;
+    (void) fd;
+    (void) what;
+
+    // catch up with all requests which should have been sent by now
+    while (thr->repeat_cnt > 0 && (intended = next_intended(thr)) <= now) {
+        if (g_eb.trace.count) {
+            replay_event(thr, intended);
+        } else {
+            issue_request(thr, intended);
+            thr->repeat_cnt--;
+            // exponential inter-arrival times give Poisson arrivals
+            thr->next_send += (uint64_t) (-log(rnd_unit(thr)) * thr->mean_interval);
+        }
+    }
+
+    if (thr->repeat_cnt > 0) {
+        struct timeval tv;
+        uint64_t wait = next_intended(thr) - now;
+        tv.tv_sec = wait / 1000000;
+        tv.tv_usec = wait % 1000000;
+        evtimer_add(thr->ev_sched, &tv);
     } else {
-        client_free(clnt);
+        int i;
+        // let clients drain pending answers and disconnect
+        for (i = 0; i < thr->ready_cnt; ++i) {
+            evtimer_add(thr->ready[i]->ev_action, thr->action_pause);
+        }
     }
 }
 
+/* open-loop load starts when all thread's clients are logged in */
+void sched_try_start(struct ebthread *thr)
+{
+    if (!open_loop() || thr->sched_started || thr->client_cnt || !thr->ready_cnt || (thr->ready_cnt < thr->running_cnt))
+        return;
+
+    thr->sched_started = 1;
+    thr->start_time = thr->next_send = now_usec();
+    event_active(thr->ev_sched, EV_TIMEOUT, 0);
+}
+
+int process_search_result(struct packet_buffer *pb, struct ebclient *clnt)
+{
+    uint32_t count;
+    struct action_stats *st = &clnt->thr->stats[ACTION_QUERY];
+
+    PB_READ_UINT32(pb, count);
+
+    if (clnt->pending_search_cnt) {
+        hist_record(&st->latency, now_usec() - clnt->pending_search[0]);
+        clnt->pending_search_cnt--;
+        memmove(clnt->pending_search, clnt->pending_search + 1, clnt->pending_search_cnt * sizeof(*clnt->pending_search));
+        st->answered++;
+        if (count)
+            st->hits++;
+    }
+
+    return 0;
+
+    malformed:
+    printf("%d# malformed OP_SEARCHRESULT\n", clnt->idx);
+    return -1;
+}
+
+int process_found_sources(struct packet_buffer *pb, struct ebclient *clnt)
+{
+    const unsigned char *hash = pb->ptr;
+    uint8_t count;
+    int i;
+    struct action_stats *st = &clnt->thr->stats[ACTION_SOURCE];
+
+    PB_SEEK(pb, ED2K_HASH_SIZE);
+    PB_READ_UINT8(pb, count);
+
+    for (i = 0; i < clnt->pending_source_cnt; ++i) {
+        if (memcmp(clnt->pending_source[i].hash, hash, ED2K_HASH_SIZE) == 0) {
+            hist_record(&st->latency, now_usec() - clnt->pending_source[i].sent);
+            clnt->pending_source_cnt--;
+            memmove(&clnt->pending_source[i], &clnt->pending_source[i + 1],
+                    (clnt->pending_source_cnt - i) * sizeof(*clnt->pending_source));
+            st->answered++;
+            if (count)
+                st->hits++;
+            break;
+        }
+    }
+
+    return 0;
+
+    malformed:
+    printf("%d# malformed OP_FOUNDSOURCES\n", clnt->idx);
+    return -1;
+}
+
 int process_id_change(struct packet_buffer *pb, struct ebclient *clnt)
 {
     uint32_t tcp_flags;
@@ -325,8 +796,14 @@ int process_packet(struct packet_buffer *pb, uint8_t opcode, struct ebclient *cl
     switch (opcode) {
         case OP_IDCHANGE:
             PB_CHECK(process_id_change(pb, clnt) == 0);
-            clnt->ev_action = evtimer_new(g_eb.evbase, timer_cb, clnt);
-            evtimer_add(clnt->ev_action, g_eb.action_pause);
+            if (clnt->ready_idx >= 0)
+                return 0;
+            clnt->ev_action = evtimer_new(clnt->thr->evbase, timer_cb, clnt);
+            client_set_ready(clnt);
+            if (!open_loop() || !clnt->thr->repeat_cnt)
+                evtimer_add(clnt->ev_action, clnt->thr->action_pause);
+            else
+                sched_try_start(clnt->thr);
             return 0;
 
         case OP_SERVERMESSAGE:
@@ -339,8 +816,11 @@ int process_packet(struct packet_buffer *pb, uint8_t opcode, struct ebclient *cl
             return 0;
 
         case OP_FOUNDSOURCES:
+            PB_CHECK(process_found_sources(pb, clnt) == 0);
+            return 0;
 
         case OP_SEARCHRESULT:
+            PB_CHECK(process_search_result(pb, clnt) == 0);
             return 0;
 
         case OP_DISCONNECT:
@@ -417,6 +897,7 @@ void read_cb(struct bufferevent *bev, void *ctx)
 void event_cb(struct bufferevent *bev, short events, void *ctx)
 {
     struct ebclient *clnt = (struct ebclient *) ctx;
+    struct ebthread *thr = clnt->thr;
     (void) bev;
 
     if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
@@ -426,6 +907,7 @@ void event_cb(struct bufferevent *bev, short events, void *ctx)
             printf("%d# got error/EOF!\n", clnt->idx);
         }
         client_free(clnt);
+        sched_try_start(thr);
     } else if (events & BEV_EVENT_CONNECTED) {
         clnt->connected = 1;
         send_login_request(clnt);
@@ -434,45 +916,128 @@ void event_cb(struct bufferevent *bev, short events, void *ctx)
 
 void spawn_cb(evutil_socket_t fd, short what, void *ctx)
 {
+    struct ebthread *thr = (struct ebthread *) ctx;
     static int idx = 0;
     (void) fd;
     (void) what;
-    (void) ctx;
 
-    if (g_eb.client_cnt > 0) {
+    if (thr->client_cnt > 0) {
         struct bufferevent *bev;
         struct ebclient *clnt;
 
-        bev = bufferevent_socket_new(g_eb.evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+        bev = bufferevent_socket_new(thr->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
         clnt = (struct ebclient *) calloc(1, sizeof *clnt);
-        clnt->idx = idx++;
+        clnt->idx = __sync_fetch_and_add(&idx, 1);
+        clnt->thr = thr;
+        clnt->ready_idx = -1;
         clnt->bev = bev;
+        get_rnd_bytes(thr, clnt->hash, sizeof(clnt->hash));
 
         bufferevent_setcb(bev, read_cb, NULL, event_cb, (void *) clnt);
         bufferevent_enable(bev, EV_READ | EV_WRITE);
 
+        thr->client_cnt--;
+        thr->running_cnt++;
+
         if (bufferevent_socket_connect(bev, (struct sockaddr *) &g_eb.server_sa, sizeof(g_eb.server_sa)) < 0) {
             printf("%d# failed to connect\n", clnt->idx);
-            bufferevent_free(bev);
-            free(clnt);
+            client_free(clnt);
         }
 
-        g_eb.running_cnt++;
-        g_eb.client_cnt--;
-        if (g_eb.client_cnt) {
-            event_add(g_eb.ev_spawn, g_eb.spawn_pause);
+        if (thr->client_cnt) {
+            event_add(thr->ev_spawn, thr->spawn_pause);
         }
     }
 }
 
+void *thread_main(void *arg)
+{
+    struct ebthread *thr = (struct ebthread *) arg;
+
+    if (event_base_dispatch(thr->evbase) < 0) {
+        printf("thread %d: dispatch loop finished with error\n", thr->idx);
+    }
+
+    return NULL;
+}
+
 void signal_cb(evutil_socket_t fd, short what, void *ctx)
 {
+    int i;
     (void) fd;
     (void) what;
     (void) ctx;
 
     printf("caught SIGINT, terminating...\n");
-    event_base_loopexit(g_eb.evbase, NULL);
+    for (i = 0; i < g_eb.thread_cnt; ++i) {
+        event_base_loopexit(g_eb.threads[i].evbase, NULL);
+    }
+}
+
+void print_report(uint64_t start_time)
+{
+    static const char *names[ACTION_COUNT] = {"offer", "query", "source"};
+    struct action_stats stats[ACTION_COUNT];
+    uint64_t skipped = 0;
+    double elapsed;
+    int i, t;
+
+    // merge per thread statistics
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < ACTION_COUNT; ++i) {
+        hist_init(&stats[i].latency);
+    }
+    for (t = 0; t < g_eb.thread_cnt; ++t) {
+        const struct ebthread *thr = &g_eb.threads[t];
+        for (i = 0; i < ACTION_COUNT; ++i) {
+            stats[i].sent += thr->stats[i].sent;
+            stats[i].answered += thr->stats[i].answered;
+            stats[i].hits += thr->stats[i].hits;
+            hist_merge(&stats[i].latency, &thr->stats[i].latency);
+        }
+        skipped += thr->skipped;
+        // in open-loop mode count time from load start, not from spawning
+        if (thr->sched_started && thr->start_time > start_time)
+            start_time = thr->start_time;
+    }
+
+    elapsed = (double) (now_usec() - start_time) / 1000000.0;
+
+    printf("\ntotal time: %.3f s\n", elapsed);
+    if (g_eb.rate) {
+        uint64_t sent = 0;
+        for (i = 0; i < ACTION_COUNT; ++i) {
+            sent += stats[i].sent;
+        }
+        printf("target rate: %.1f ops/s, achieved: %.1f ops/s, skipped: %llu\n",
+                g_eb.rate, sent / elapsed, (unsigned long long) skipped);
+    } else if (g_eb.trace.count) {
+        printf("replayed events: %zu, skipped: %llu\n", g_eb.trace.count, (unsigned long long) skipped);
+    } else if (skipped) {
+        printf("skipped: %llu\n", (unsigned long long) skipped);
+    }
+    printf("%-8s %10s %10s %8s %10s %10s %10s %10s %10s\n",
+            "action", "sent", "answered", "hits%", "ops/s", "p50,ms", "p99,ms", "p999,ms", "max,ms");
+
+    for (i = 0; i < ACTION_COUNT; ++i) {
+        const struct action_stats *st = &stats[i];
+        const struct histogram *h = &st->latency;
+
+        if (!st->sent)
+            continue;
+
+        if (ACTION_OFFER == i) {
+            // server does not answer offers
+            printf("%-8s %10llu %10s %8s %10.1f %10s %10s %10s %10s\n", names[i],
+                    (unsigned long long) st->sent, "-", "-", st->sent / elapsed, "-", "-", "-", "-");
+        } else {
+            printf("%-8s %10llu %10llu %8.1f %10.1f %10.3f %10.3f %10.3f %10.3f\n", names[i],
+                    (unsigned long long) st->sent, (unsigned long long) st->answered,
+                    st->answered ? 100.0 * st->hits / st->answered : 0.0, st->answered / elapsed,
+                    hist_quantile(h, 0.5) / 1000.0, hist_quantile(h, 0.99) / 1000.0,
+                    hist_quantile(h, 0.999) / 1000.0, h->max / 1000.0);
+        }
+    }
 }
 
 void display_version()
@@ -494,6 +1059,12 @@ void display_usage()
                     "--spawn-pause, -w <msecs>\t pause between client spawning(default:" CSTR(DEFAULT_SPAWN_PAUSE) "ms)\n"
                     "--repeat, -r <count>\trepeat <count> times\n"
                     "--action-pause, -p <msecs>\t pause between activities (default:" CSTR(DEFAULT_ACTION_PAUSE) "ms)\n"
+                    "--threads, -t <count>\tworker threads, each with own event loop (default: 1)\n"
+                    "--rate, -R <ops/s>\topen-loop mode: issue requests at constant aggregate rate with Poisson arrivals,\n"
+                    "\t\tlatency is measured from intended send time (default: closed-loop)\n"
+                    "--files, -F <count>\tshared files corpus size (default: " CSTR(DEFAULT_CORPUS_FILES) ")\n"
+                    "--seed, -e <number>\tcorpus generator seed (default: 1)\n"
+                    "--replay, -T <file>\treplay recorded session trace instead of generated actions\n"
                     "--offer, -O\toffer files\n"
                     "--query, -Q\tsearch queries\n"
                     "--source, -S\tsources requests"
@@ -502,11 +1073,15 @@ void display_usage()
 
 int main(int argc, char *argv[])
 {
-    int ret, opt, longIndex = 0;
+    int ret, opt, longIndex = 0, i;
     struct event *ev_sigint;
     unsigned offer_flag = 0, query_flag = 0, source_flag = 0;
-    struct timeval tv_action = {0, 0}, tv_spawn = {0, 0};
-    char *server_addr = NULL;
+    int client_cnt = 0, repeat_cnt = 0;
+    size_t file_cnt = DEFAULT_CORPUS_FILES;
+    uint64_t start_time, seed = 1;
+    char *server_addr = NULL, *trace_path = NULL;
+
+    g_eb.thread_cnt = 1;
 
     // parse command line arguments
     opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
@@ -526,24 +1101,44 @@ int main(int argc, char *argv[])
 
             case 'p': {
                 int val = atoi(optarg);
-                tv_action.tv_sec = val / 1000;
-                tv_action.tv_usec = (val % 1000) * 1000;
+                g_eb.tv_action.tv_sec = val / 1000;
+                g_eb.tv_action.tv_usec = (val % 1000) * 1000;
                 break;
             }
 
             case 'c':
-                g_eb.client_cnt = atoi(optarg);
+                client_cnt = atoi(optarg);
                 break;
 
             case 'w': {
                 int val = atoi(optarg);
-                tv_spawn.tv_sec = val / 1000;
-                tv_spawn.tv_usec = (val % 1000) * 1000;
+                g_eb.tv_spawn.tv_sec = val / 1000;
+                g_eb.tv_spawn.tv_usec = (val % 1000) * 1000;
                 break;
             }
 
             case 'r':
-                g_eb.repeat_cnt = atoi(optarg);
+                repeat_cnt = atoi(optarg);
+                break;
+
+            case 't':
+                g_eb.thread_cnt = atoi(optarg);
+                break;
+
+            case 'R':
+                g_eb.rate = atof(optarg);
+                break;
+
+            case 'F':
+                file_cnt = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'e':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'T':
+                trace_path = optarg;
                 break;
 
             case 'O':
@@ -570,11 +1165,16 @@ int main(int argc, char *argv[])
         int sa_len = sizeof(g_eb.server_sa);
         ret = evutil_parse_sockaddr_port(server_addr, (struct sockaddr *) &g_eb.server_sa, &sa_len);
     }
-    if (!server_addr || (ret < 0) || (g_eb.repeat_cnt <= 0) || (g_eb.client_cnt <= 0)) {
+    if (!server_addr || (ret < 0) || (!trace_path && repeat_cnt <= 0) || (client_cnt <= 0) || (g_eb.thread_cnt <= 0)
+            || (g_eb.rate < 0) || !file_cnt) {
         display_usage();
         return EXIT_FAILURE;
     }
 
+    if (g_eb.thread_cnt > client_cnt) {
+        g_eb.thread_cnt = client_cnt;
+    }
+
     // prepare array with user selected actions
     if (offer_flag) {
         g_eb.actions[g_eb.action_cnt++] = ACTION_OFFER;
@@ -583,28 +1183,41 @@ int main(int argc, char *argv[])
         g_eb.actions[g_eb.action_cnt++] = ACTION_QUERY;
     }
     if (source_flag) {
-        g_eb.actions[g_eb.action_cnt] = ACTION_SOURCE;
+        g_eb.actions[g_eb.action_cnt++] = ACTION_SOURCE;
     }
 
     if (!g_eb.action_cnt) {
-        g_eb.repeat_cnt = 0;
+        repeat_cnt = 0;
+    }
+
+    if (trace_path) {
+        if (!trace_load(&g_eb.trace, trace_path))
+            return EXIT_FAILURE;
+        if (!g_eb.trace.count) {
+            printf("Trace %s is empty\n", trace_path);
+            return EXIT_FAILURE;
+        }
+        // trace defines request times
+        g_eb.rate = 0;
+    } else if (!corpus_init(&g_eb.corpus, DEFAULT_CORPUS_WORDS, file_cnt, seed)) {
+        printf("Failed to generate files corpus\n");
+        return EXIT_FAILURE;
     }
 
-    if (tv_spawn.tv_sec == 0 && tv_spawn.tv_usec == 0) {
-        tv_spawn.tv_sec = DEFAULT_SPAWN_PAUSE / 1000;
-        tv_spawn.tv_usec = (DEFAULT_SPAWN_PAUSE % 1000) * 1000;
+    if (g_eb.tv_spawn.tv_sec == 0 && g_eb.tv_spawn.tv_usec == 0) {
+        g_eb.tv_spawn.tv_sec = DEFAULT_SPAWN_PAUSE / 1000;
+        g_eb.tv_spawn.tv_usec = (DEFAULT_SPAWN_PAUSE % 1000) * 1000;
     }
 
-    if (tv_action.tv_sec == 0 && tv_action.tv_usec == 0) {
-        tv_action.tv_sec = DEFAULT_ACTION_PAUSE / 1000;
-        tv_action.tv_usec = (DEFAULT_ACTION_PAUSE % 1000) * 1000;
+    if (g_eb.tv_action.tv_sec == 0 && g_eb.tv_action.tv_usec == 0) {
+        g_eb.tv_action.tv_sec = DEFAULT_ACTION_PAUSE / 1000;
+        g_eb.tv_action.tv_usec = (DEFAULT_ACTION_PAUSE % 1000) * 1000;
     }
 
     if (evutil_secure_rng_init() < 0) {
         printf("Failed to seed random number generator\n");
         return EXIT_FAILURE;
     }
-    srand((unsigned int) time(NULL));
 
 #ifdef WIN32
     {
@@ -614,37 +1227,94 @@ int main(int argc, char *argv[])
             return EXIT_FAILURE;
         }
     }
+    ret = evthread_use_windows_threads();
+#else
+    ret = evthread_use_pthreads();
 #endif
-
-    g_eb.evbase = event_base_new();
-    if (NULL == g_eb.evbase) {
-        printf("Failed to create main event loop\n");
+    if (ret < 0) {
+        printf("Failed to init libevent threading support\n");
         return EXIT_FAILURE;
     }
 
+    g_eb.threads = (struct ebthread *) calloc(g_eb.thread_cnt, sizeof(*g_eb.threads));
+
+    for (i = 0; i < g_eb.thread_cnt; ++i) {
+        struct ebthread *thr = &g_eb.threads[i];
+        int j;
+
+        thr->idx = i;
+        // split clients and actions evenly between threads
+        thr->client_cnt = client_cnt / g_eb.thread_cnt + (i < client_cnt % g_eb.thread_cnt);
+        thr->repeat_cnt = repeat_cnt / g_eb.thread_cnt + (i < repeat_cnt % g_eb.thread_cnt);
+        thr->ready = (struct ebclient **) calloc(thr->client_cnt, sizeof(*thr->ready));
+        if (g_eb.trace.count) {
+            size_t k;
+            // trace client numbers are spread between threads
+            thr->events = (const struct trace_event **) calloc(g_eb.trace.count, sizeof(*thr->events));
+            thr->repeat_cnt = 0;
+            for (k = 0; k < g_eb.trace.count; ++k) {
+                if (g_eb.trace.events[k].client % g_eb.thread_cnt == (uint32_t) i)
+                    thr->events[thr->repeat_cnt++] = &g_eb.trace.events[k];
+            }
+        }
+        if (g_eb.rate)
+            thr->mean_interval = 1000000.0 * g_eb.thread_cnt / g_eb.rate;
+
+        do {
+            evutil_secure_rng_get_bytes(&thr->rng, sizeof(thr->rng));
+        } while (!thr->rng);
+
+        for (j = 0; j < ACTION_COUNT; ++j) {
+            hist_init(&thr->stats[j].latency);
+        }
+
+        thr->evbase = event_base_new();
+        if (NULL == thr->evbase) {
+            printf("Failed to create event loop\n");
+            return EXIT_FAILURE;
+        }
+
+        // setup common timers timeouts
+        thr->action_pause = event_base_init_common_timeout(thr->evbase, &g_eb.tv_action);
+        thr->spawn_pause = event_base_init_common_timeout(thr->evbase, &g_eb.tv_spawn);
+
+        // setup spawn and scheduler timers
+        thr->ev_sched = evtimer_new(thr->evbase, sched_cb, thr);
+        thr->ev_spawn = evtimer_new(thr->evbase, spawn_cb, thr);
+        event_add(thr->ev_spawn, thr->spawn_pause);
+    }
+
     // setup signals
-    ev_sigint = evsignal_new(g_eb.evbase, SIGINT, signal_cb, NULL);
+    ev_sigint = evsignal_new(g_eb.threads[0].evbase, SIGINT, signal_cb, NULL);
     evsignal_add(ev_sigint, NULL);
 
-    // setup common timers timeouts
-    g_eb.action_pause = event_base_init_common_timeout(g_eb.evbase, &tv_action);
-    g_eb.spawn_pause = event_base_init_common_timeout(g_eb.evbase, &tv_spawn);
+    start_time = now_usec();
 
-    // setup spawn timer
-    g_eb.ev_spawn = evtimer_new(g_eb.evbase, spawn_cb, NULL);
-    event_add(g_eb.ev_spawn, g_eb.spawn_pause);
-
-    ret = event_base_dispatch(g_eb.evbase);
-    if (ret < 0) {
-        printf("Main dispatch loop finished with error\n");
+    for (i = 0; i < g_eb.thread_cnt; ++i) {
+        if (pthread_create(&g_eb.threads[i].thread, NULL, thread_main, &g_eb.threads[i]) != 0) {
+            printf("Failed to create thread\n");
+            return EXIT_FAILURE;
+        }
     }
-    else if (0 == ret) {
-        printf("No active events in main loop\n");
+
+    for (i = 0; i < g_eb.thread_cnt; ++i) {
+        pthread_join(g_eb.threads[i].thread, NULL);
     }
 
-    event_free(g_eb.ev_spawn);
+    print_report(start_time);
+
     event_free(ev_sigint);
-    event_base_free(g_eb.evbase);
+    for (i = 0; i < g_eb.thread_cnt; ++i) {
+        struct ebthread *thr = &g_eb.threads[i];
+        event_free(thr->ev_sched);
+        event_free(thr->ev_spawn);
+        event_base_free(thr->evbase);
+        free(thr->ready);
+        free(thr->events);
+    }
+    free(g_eb.threads);
+    corpus_free(&g_eb.corpus);
+    trace_free(&g_eb.trace);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,195 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+static char *next_token(char **p)
+{
+    char *tok;
+
+    while (**p == ' ' || **p == '\t')
+        (*p)++;
+    if (!**p)
+        return NULL;
+
+    tok = *p;
+    while (**p && **p != ' ' && **p != '\t')
+        (*p)++;
+    if (**p)
+        *(*p)++ = '\0';
+
+    return tok;
+}
+
+static char *rest_of_line(char **p)
+{
+    char *end;
+
+    while (**p == ' ' || **p == '\t')
+        (*p)++;
+    end = *p + strlen(*p);
+    while (end > *p && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+
+    return **p ? *p : NULL;
+}
+
+static int parse_hash(unsigned char *hash, const char *str)
+{
+    size_t i;
+
+    if (!str || strlen(str) != 32)
+        return 0;
+
+    for (i = 0; i < 16; ++i) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char) str[i * 2]) || !isxdigit((unsigned char) str[i * 2 + 1])
+                || sscanf(str + i * 2, "%2x", &byte) != 1)
+            return 0;
+        hash[i] = (unsigned char) byte;
+    }
+
+    return 1;
+}
+
+static int parse_line(struct trace_event *ev, char *line)
+{
+    char *tok, *end;
+    double msecs;
+
+    memset(ev, 0, sizeof(*ev));
+
+    if (!(tok = next_token(&line)))
+        return 0;
+    msecs = strtod(tok, &end);
+    if (*end || msecs < 0)
+        return 0;
+    ev->time = (uint64_t) (msecs * 1000.0);
+
+    if (!(tok = next_token(&line)))
+        return 0;
+    ev->client = (uint32_t) strtoul(tok, &end, 10);
+    if (*end)
+        return 0;
+
+    if (!(tok = next_token(&line)))
+        return 0;
+
+    if (strcmp(tok, "offer") == 0) {
+        ev->op = TRACE_OFFER;
+        if (!parse_hash(ev->file.hash, next_token(&line)))
+            return 0;
+        if (!(tok = next_token(&line)))
+            return 0;
+        ev->file.size = strtoull(tok, &end, 10);
+        if (*end)
+            return 0;
+        if (!(tok = next_token(&line)))
+            return 0;
+        ev->file.type = (uint8_t) strtoul(tok, &end, 10);
+        if (*end)
+            return 0;
+        if (!(ev->file.name = rest_of_line(&line)))
+            return 0;
+        ev->file.name_len = (uint16_t) strlen(ev->file.name);
+    } else if (strcmp(tok, "search") == 0) {
+        ev->op = TRACE_SEARCH;
+        if (!(ev->query = rest_of_line(&line)))
+            return 0;
+        ev->query_len = (uint16_t) strlen(ev->query);
+    } else if (strcmp(tok, "sources") == 0) {
+        ev->op = TRACE_SOURCES;
+        if (!parse_hash(ev->file.hash, next_token(&line)))
+            return 0;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+    const struct trace_event *ea = (const struct trace_event *) a;
+    const struct trace_event *eb = (const struct trace_event *) b;
+
+    if (ea->time != eb->time)
+        return ea->time < eb->time ? -1 : 1;
+    // keep file order of simultaneous events
+    return ea->line < eb->line ? -1 : (ea->line > eb->line);
+}
+
+int trace_load(struct trace *t, const char *path)
+{
+    FILE *fp;
+    long size;
+    size_t lines = 0, line_no = 0;
+    char *p, *line;
+
+    memset(t, 0, sizeof(*t));
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        printf("failed to open trace %s\n", path);
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    t->data = (char *) malloc(size + 1);
+    if (!t->data || fread(t->data, 1, size, fp) != (size_t) size) {
+        printf("failed to read trace %s\n", path);
+        fclose(fp);
+        trace_free(t);
+        return 0;
+    }
+    fclose(fp);
+    t->data[size] = '\0';
+
+    for (p = t->data; *p; ++p) {
+        if (*p == '\n')
+            lines++;
+    }
+
+    t->events = (struct trace_event *) malloc((lines + 1) * sizeof(*t->events));
+    if (!t->events) {
+        trace_free(t);
+        return 0;
+    }
+
+    for (line = t->data; line; line = p) {
+        char *s;
+
+        p = strchr(line, '\n');
+        if (p)
+            *p++ = '\0';
+        line_no++;
+
+        for (s = line; isspace((unsigned char) *s); ++s);
+        if (!*s || *s == '#')
+            continue;
+
+        if (!parse_line(&t->events[t->count], s)) {
+            printf("%s:%zu: malformed trace line\n", path, line_no);
+            trace_free(t);
+            return 0;
+        }
+        t->events[t->count].line = line_no;
+        t->count++;
+    }
+
+    qsort(t->events, t->count, sizeof(*t->events), event_cmp);
+
+    return 1;
+}
+
+void trace_free(struct trace *t)
+{
+    free(t->events);
+    free(t->data);
+    memset(t, 0, sizeof(*t));
+}
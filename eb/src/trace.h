@@ -0,0 +1,64 @@
+#ifndef EB_TRACE_H
+#define EB_TRACE_H
+
+/**
+@file trace.h recorded session trace
+
+Text file, one request per line, lines starting with '#' are comments:
+
+    <msecs> <client> offer <hash> <size> <type> <name>
+    <msecs> <client> search <word> [<word> ...]
+    <msecs> <client> sources <hash>
+
+<msecs> is request time relative to session start, <client> is client
+number, <hash> is 32 hex digits, <type> is FT_* number. Offers of the same
+client with the same time are sent in one OP_OFFERFILES packet, search
+words are combined with AND.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "corpus.h"
+
+enum trace_op {
+    TRACE_OFFER,
+    TRACE_SEARCH,
+    TRACE_SOURCES
+};
+
+struct trace_event {
+    /* time relative to session start (usecs) */
+    uint64_t time;
+    /* client number */
+    uint32_t client;
+    /* TRACE_* operation */
+    uint8_t op;
+    /* offered file (TRACE_OFFER) or requested hash (TRACE_SOURCES) */
+    struct corpus_file file;
+    /* space separated search words (TRACE_SEARCH) */
+    const char *query;
+    /* search words length */
+    uint16_t query_len;
+    /* line number in trace file */
+    uint32_t line;
+};
+
+struct trace {
+    /* events sorted by time */
+    struct trace_event *events;
+    /* events count */
+    size_t count;
+    /* file contents, events point here */
+    char *data;
+};
+
+/**
+@brief loads trace file
+@return non-zero on success
+*/
+int trace_load(struct trace *t, const char *path);
+
+void trace_free(struct trace *t);
+
+#endif // EB_TRACE_H
@@ -0,0 +1,667 @@
+#include "admin.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "client.h"
+#include "job.h"
+#include "db.h"
+#include "metrics.h"
+#include "jobtrace.h"
+#include "admission.h"
+#include "portcheck.h"
+#include "serverlist.h"
+#include "snapshot.h"
+#include "idmap.h"
+#include "rcu.h"
+#include "log.h"
+
+#define ADMIN_MAX_LINE      256
+#define ADMIN_MAX_NICK      64
+
+struct admin_command {
+    const char *name;
+    const char *help;
+    void (*handler)(struct evbuffer *out, char *args);
+};
+
+/* copy of client fields for clients list */
+struct client_info {
+    uint32_t id;
+    uint32_t ip;
+    uint16_t port;
+    uint32_t file_count;
+    unsigned lowid:1;
+    char nick[ADMIN_MAX_NICK + 1];
+};
+
+/* clients list copy */
+struct clients_copy {
+    struct client_info *items;
+    size_t count;
+    size_t size;
+    unsigned failed:1;
+};
+
+/* referenced clients to disconnect */
+struct client_refs {
+    struct client **items;
+    size_t count;
+    size_t size;
+    /* drop filter, 0 matches nothing */
+    uint32_t ip;
+    uint32_t id;
+};
+
+static struct evconnlistener *s_listener;
+static char *s_path;
+
+/* background db optimization thread */
+static pthread_t s_optimize_thread;
+static int s_optimize_started;
+static atomic_uint32_t s_optimize_running;
+
+static void cmd_help(struct evbuffer *out, char *args);
+
+static void write_quantiles(struct evbuffer *out, const struct metrics_snapshot *snap, enum metric_hist h)
+{
+    evbuffer_add_printf(out, "%s count %" PRIu64 " avg %" PRIu64 "us p50 %" PRIu64 "us p90 %" PRIu64 "us p99 %"
+            PRIu64 "us max %" PRIu64 "us\n", metrics_hist_name(h), snap->hists[h].count,
+            snap->hists[h].sum / snap->hists[h].count / 1000,
+            metrics_quantile(snap, h, 0.5) / 1000, metrics_quantile(snap, h, 0.9) / 1000,
+            metrics_quantile(snap, h, 0.99) / 1000, snap->hists[h].max / 1000);
+}
+
+static void cmd_stats(struct evbuffer *out, char *args)
+{
+    struct metrics_snapshot *snap = (struct metrics_snapshot *) malloc(sizeof(*snap));
+    size_t i, pc_inflight, pc_pending;
+    (void) args;
+
+    if (!snap) {
+        evbuffer_add_printf(out, "error: out of memory\n");
+        return;
+    }
+
+    metrics_snapshot(snap);
+    portcheck_queue_stats(&pc_inflight, &pc_pending);
+
+    evbuffer_add_printf(out, "users %u\n", atomic_load(&g_srv.user_count));
+    evbuffer_add_printf(out, "files %u\n", atomic_load(&g_srv.file_count));
+    evbuffer_add_printf(out, "job_threads %zu\n", g_srv.thread_count);
+    evbuffer_add_printf(out, "job_queue_depth %zu\n", server_job_queue_depth());
+    evbuffer_add_printf(out, "portcheck_inflight %zu\n", pc_inflight);
+    evbuffer_add_printf(out, "portcheck_pending %zu\n", pc_pending);
+    evbuffer_add_printf(out, "portcheck_cache_entries %zu\n", portcheck_cache_count());
+    evbuffer_add_printf(out, "db_memory_bytes %" PRIu64 "\n", db_memory_used());
+    evbuffer_add_printf(out, "log_dropped %" PRIu64 "\n", log_dropped());
+    evbuffer_add_printf(out, "banned_networks %zu\n", admission_ban_count());
+
+    for (i = 0; i < MC_COUNT; ++i) {
+        evbuffer_add_printf(out, "%s %" PRIu64 "\n", metrics_counter_name(i), snap->counters[i]);
+    }
+    for (i = 0; i < MH_COUNT; ++i) {
+        if (snap->hists[i].count)
+            write_quantiles(out, snap, i);
+    }
+    for (i = 0; i < snap->worker_count; ++i) {
+        uint64_t total = snap->workers[i].busy_ns + snap->workers[i].idle_ns;
+        evbuffer_add_printf(out, "worker %zu busy %.1f%%\n", i,
+                total ? 100.0 * snap->workers[i].busy_ns / total : 0.0);
+    }
+
+    free(snap);
+}
+
+static void write_prom_gauge(struct evbuffer *out, const char *name, const char *help, uint64_t val)
+{
+    evbuffer_add_printf(out, "# HELP ed2kd_%s %s\n# TYPE ed2kd_%s gauge\ned2kd_%s %" PRIu64 "\n",
+            name, help, name, name, val);
+}
+
+static void cmd_prometheus(struct evbuffer *out, char *args)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    struct metrics_snapshot *snap = (struct metrics_snapshot *) malloc(sizeof(*snap));
+    size_t i, j, pc_inflight, pc_pending;
+    (void) args;
+
+    if (!snap) {
+        evbuffer_add_printf(out, "error: out of memory\n");
+        return;
+    }
+
+    metrics_snapshot(snap);
+    portcheck_queue_stats(&pc_inflight, &pc_pending);
+
+    write_prom_gauge(out, "users", "Connected clients.", atomic_load(&g_srv.user_count));
+    write_prom_gauge(out, "files", "Shared files.", atomic_load(&g_srv.file_count));
+    write_prom_gauge(out, "job_queue_depth", "Jobs waiting in queue.", server_job_queue_depth());
+    write_prom_gauge(out, "portcheck_inflight", "Port checks in flight.", pc_inflight);
+    write_prom_gauge(out, "portcheck_pending", "Port checks waiting in scheduler queue.", pc_pending);
+    write_prom_gauge(out, "portcheck_cache_entries", "Cached successful port checks.", portcheck_cache_count());
+    write_prom_gauge(out, "db_memory_bytes", "Memory used by database.", db_memory_used());
+    evbuffer_add_printf(out, "# TYPE ed2kd_log_dropped_total counter\ned2kd_log_dropped_total %" PRIu64 "\n",
+            log_dropped());
+
+    for (i = 0; i < MC_COUNT; ++i) {
+        const char *name = metrics_counter_name(i);
+        evbuffer_add_printf(out, "# TYPE ed2kd_%s_total counter\ned2kd_%s_total %" PRIu64 "\n",
+                name, name, snap->counters[i]);
+    }
+
+    for (i = 0; i < MH_COUNT; ++i) {
+        const char *name = metrics_hist_name(i);
+        evbuffer_add_printf(out, "# TYPE ed2kd_%s_seconds summary\n", name);
+        for (j = 0; j < ARRAY_SIZE(quantiles); ++j) {
+            evbuffer_add_printf(out, "ed2kd_%s_seconds{quantile=\"%g\"} %.9f\n", name, quantiles[j],
+                    metrics_quantile(snap, i, quantiles[j]) / 1e9);
+        }
+        evbuffer_add_printf(out, "ed2kd_%s_seconds_sum %.9f\ned2kd_%s_seconds_count %" PRIu64 "\n",
+                name, snap->hists[i].sum / 1e9, name, snap->hists[i].count);
+    }
+
+    evbuffer_add_printf(out, "# TYPE ed2kd_worker_busy_seconds_total counter\n");
+    for (i = 0; i < snap->worker_count; ++i) {
+        evbuffer_add_printf(out, "ed2kd_worker_busy_seconds_total{worker=\"%zu\"} %.9f\n", i,
+                snap->workers[i].busy_ns / 1e9);
+    }
+    evbuffer_add_printf(out, "# TYPE ed2kd_worker_idle_seconds_total counter\n");
+    for (i = 0; i < snap->worker_count; ++i) {
+        evbuffer_add_printf(out, "ed2kd_worker_idle_seconds_total{worker=\"%zu\"} %.9f\n", i,
+                snap->workers[i].idle_ns / 1e9);
+    }
+
+    free(snap);
+}
+
+static int copy_client(struct client *clnt, void *ctx)
+{
+    struct clients_copy *copy = (struct clients_copy *) ctx;
+    struct client_info *ci;
+
+    if (atomic_load(&clnt->deleted))
+        return 1;
+
+    if (copy->count == copy->size) {
+        size_t size = copy->size ? copy->size * 2 : 64;
+        struct client_info *items = (struct client_info *) realloc(copy->items, size * sizeof(*items));
+        if (!items) {
+            copy->failed = 1;
+            return 0;
+        }
+        copy->items = items;
+        copy->size = size;
+    }
+
+    ci = &copy->items[copy->count++];
+    ci->id = clnt->id;
+    ci->ip = clnt->ip;
+    ci->port = clnt->port;
+    ci->file_count = clnt->file_count;
+    ci->lowid = clnt->lowid;
+    if (clnt->nick) {
+        strncpy(ci->nick, clnt->nick, ADMIN_MAX_NICK);
+        ci->nick[ADMIN_MAX_NICK] = '\0';
+    } else {
+        ci->nick[0] = '\0';
+    }
+
+    return 1;
+}
+
+static void cmd_clients(struct evbuffer *out, char *args)
+{
+    struct clients_copy copy = {NULL, 0, 0, 0};
+    size_t i;
+    (void) args;
+
+    // copy while online, format after
+    rcu_online();
+    idmap_foreach(copy_client, &copy);
+    rcu_offline();
+
+    if (copy.failed) {
+        free(copy.items);
+        evbuffer_add_printf(out, "error: out of memory\n");
+        return;
+    }
+
+    evbuffer_add_printf(out, "%zu clients\n", copy.count);
+    for (i = 0; i < copy.count; ++i) {
+        struct client_info *ci = &copy.items[i];
+        char ip_str[INET_ADDRSTRLEN];
+        char *p;
+
+        // one client per line
+        for (p = ci->nick; *p; ++p) {
+            if ((unsigned char) *p < ' ')
+                *p = '?';
+        }
+
+        evutil_inet_ntop(AF_INET, &ci->ip, ip_str, sizeof(ip_str));
+        evbuffer_add_printf(out, "id %u addr %s:%u files %u %s \"%s\"\n", ci->id, ip_str, ci->port,
+                ci->file_count, ci->lowid ? "lowid" : "highid", ci->nick);
+    }
+
+    free(copy.items);
+}
+
+static void cmd_config(struct evbuffer *out, char *args)
+{
+    const struct server_config *cfg = g_srv.cfg;
+    char hash[sizeof(cfg->hash) * 2 + 1];
+    (void) args;
+
+    bin2hex(cfg->hash, hash, sizeof(hash));
+
+    evbuffer_add_printf(out, "listen_addr %s\n", cfg->listen_addr);
+    evbuffer_add_printf(out, "listen_port %u\n", cfg->listen_port);
+    evbuffer_add_printf(out, "listen_backlog %d\n", cfg->listen_backlog);
+    evbuffer_add_printf(out, "server_hash %s\n", hash);
+    evbuffer_add_printf(out, "server_name %s\n", cfg->server_name);
+    evbuffer_add_printf(out, "server_descr %s\n", cfg->server_descr);
+    evbuffer_add_printf(out, "allow_lowid %u\n", cfg->allow_lowid);
+    evbuffer_add_printf(out, "portcheck_timeout %ld\n",
+            (long) (cfg->portcheck_timeout_tv.tv_sec * 1000 + cfg->portcheck_timeout_tv.tv_usec / 1000));
+    evbuffer_add_printf(out, "portcheck_max_inflight %zu\n", cfg->portcheck_max_inflight);
+    evbuffer_add_printf(out, "portcheck_max_per_subnet %zu\n", cfg->portcheck_max_per_subnet);
+    evbuffer_add_printf(out, "portcheck_cache_size %zu\n", cfg->portcheck_cache_size);
+    evbuffer_add_printf(out, "portcheck_cache_ttl %u\n", cfg->portcheck_cache_ttl);
+    evbuffer_add_printf(out, "status_notify_interval %ld\n",
+            (long) (cfg->status_notify_tv.tv_sec * 1000 + cfg->status_notify_tv.tv_usec / 1000));
+    evbuffer_add_printf(out, "max_clients %zu\n", cfg->max_clients);
+    evbuffer_add_printf(out, "max_clients_per_ip %zu\n", cfg->max_clients_per_ip);
+    evbuffer_add_printf(out, "ban_file %s\n", cfg->ban_file ? cfg->ban_file : "");
+    evbuffer_add_printf(out, "max_files %zu\n", cfg->max_files);
+    evbuffer_add_printf(out, "max_files_per_client %zu\n", cfg->max_files_per_client);
+    evbuffer_add_printf(out, "max_offers_limit %zu\n", cfg->max_offers_limit);
+    evbuffer_add_printf(out, "max_searches_limit %zu\n", cfg->max_searches_limit);
+    evbuffer_add_printf(out, "job_trace_size %zu\n", cfg->job_trace_size);
+    evbuffer_add_printf(out, "slow_query_threshold %u\n", cfg->slow_query_threshold);
+    evbuffer_add_printf(out, "udp_enabled %u\n", cfg->udp_enabled);
+    evbuffer_add_printf(out, "udp_rate_limit %u\n", cfg->udp_rate_limit);
+    evbuffer_add_printf(out, "peer_servers %zu\n", cfg->peer_server_count);
+    evbuffer_add_printf(out, "peer_ping_interval %u\n", cfg->peer_ping_interval);
+    evbuffer_add_printf(out, "snapshot_file %s\n", cfg->snapshot_file ? cfg->snapshot_file : "");
+    evbuffer_add_printf(out, "snapshot_interval %u\n", cfg->snapshot_interval);
+    evbuffer_add_printf(out, "snapshot_grace %u\n", cfg->snapshot_grace);
+}
+
+static void cmd_reload(struct evbuffer *out, char *args)
+{
+    (void) args;
+
+    if (!server_reload_config()) {
+        evbuffer_add_printf(out, "error: failed to reload, running configuration kept\n");
+        return;
+    }
+
+    evbuffer_add_printf(out, "reloaded\n");
+}
+
+/* references not deleted client, returns zero if out of memory */
+static int refs_add(struct client_refs *refs, struct client *clnt)
+{
+    if (refs->count == refs->size) {
+        size_t size = refs->size ? refs->size * 2 : 64;
+        struct client **items = (struct client **) realloc(refs->items, size * sizeof(*items));
+        if (!items)
+            return 0;
+        refs->items = items;
+        refs->size = size;
+    }
+
+    if (client_tryref(clnt))
+        refs->items[refs->count++] = clnt;
+
+    return 1;
+}
+
+static int match_drop(struct client *clnt, void *ctx)
+{
+    struct client_refs *refs = (struct client_refs *) ctx;
+
+    if ((refs->ip && clnt->ip == refs->ip) || (refs->id && clnt->id == refs->id))
+        return refs_add(refs, clnt);
+
+    return 1;
+}
+
+static int match_banned(struct client *clnt, void *ctx)
+{
+    return admission_is_banned(clnt->ip) ? refs_add((struct client_refs *) ctx, clnt) : 1;
+}
+
+/* queues EOF job for every collected client and releases references */
+static size_t refs_disconnect(struct client_refs *refs)
+{
+    size_t i, count = refs->count;
+
+    for (i = 0; i < count; ++i) {
+        server_event_cb(NULL, BEV_EVENT_EOF, refs->items[i]);
+        client_decref(refs->items[i]);
+    }
+    free(refs->items);
+    memset(refs, 0, sizeof(*refs));
+
+    return count;
+}
+
+static void cmd_drop(struct evbuffer *out, char *args)
+{
+    struct client_refs refs = {NULL, 0, 0, 0, 0};
+    size_t count;
+    char *end;
+
+    if (!args || !*args) {
+        evbuffer_add_printf(out, "error: usage: drop <ip|id>\n");
+        return;
+    }
+
+    if (evutil_inet_pton(AF_INET, args, &refs.ip) <= 0) {
+        refs.ip = 0;
+        refs.id = (uint32_t) strtoul(args, &end, 10);
+        if (*end || !refs.id) {
+            evbuffer_add_printf(out, "error: bad client ip or id\n");
+            return;
+        }
+    }
+
+    // referenced clients outlive offline
+    rcu_online();
+    idmap_foreach(match_drop, &refs);
+    rcu_offline();
+
+    count = refs_disconnect(&refs);
+
+    ED2KD_LOGNFO("admin: dropped %zu clients by '%s'", count, args);
+    evbuffer_add_printf(out, "dropped %zu clients\n", count);
+}
+
+static void cmd_bans(struct evbuffer *out, char *args)
+{
+    struct client_refs refs = {NULL, 0, 0, 0, 0};
+    size_t count;
+
+    if (!args || !*args) {
+        evbuffer_add_printf(out, "%zu banned networks\n", admission_ban_count());
+        return;
+    }
+
+    if (strcmp(args, "reload") != 0) {
+        evbuffer_add_printf(out, "error: usage: bans [reload]\n");
+        return;
+    }
+
+    if (!g_srv.cfg->ban_file) {
+        evbuffer_add_printf(out, "error: ban_file not set in config\n");
+        return;
+    }
+
+    if (!admission_load_bans(g_srv.cfg->ban_file)) {
+        evbuffer_add_printf(out, "error: failed to load %s, previous list kept\n", g_srv.cfg->ban_file);
+        return;
+    }
+
+    // disconnect already connected clients from new banned networks
+    rcu_online();
+    idmap_foreach(match_banned, &refs);
+    rcu_offline();
+
+    count = refs_disconnect(&refs);
+
+    if (count)
+        ED2KD_LOGNFO("admin: dropped %zu banned clients", count);
+    evbuffer_add_printf(out, "loaded %zu banned networks, dropped %zu clients\n", admission_ban_count(), count);
+}
+
+static void *optimize_worker(void *arg)
+{
+    uint64_t start = metrics_now();
+    (void) arg;
+
+    if (db_open()) {
+        if (db_optimize())
+            ED2KD_LOGNFO("admin: db optimized in %" PRIu64 "ms", (metrics_now() - start) / 1000000);
+        db_close();
+    } else {
+        ED2KD_LOGERR("failed to open database");
+    }
+
+    atomic_store(&s_optimize_running, 0);
+
+    return NULL;
+}
+
+static void cmd_vacuum(struct evbuffer *out, char *args)
+{
+    (void) args;
+
+    if (atomic_load(&s_optimize_running)) {
+        evbuffer_add_printf(out, "error: already running\n");
+        return;
+    }
+
+    // previous run is finished
+    if (s_optimize_started)
+        pthread_join(s_optimize_thread, NULL);
+
+    atomic_store(&s_optimize_running, 1);
+    s_optimize_started = !pthread_create(&s_optimize_thread, NULL, optimize_worker, NULL);
+    if (!s_optimize_started) {
+        atomic_store(&s_optimize_running, 0);
+        evbuffer_add_printf(out, "error: failed to start thread\n");
+        return;
+    }
+
+    evbuffer_add_printf(out, "started\n");
+}
+
+static void cmd_servers(struct evbuffer *out, char *args)
+{
+    (void) args;
+    serverlist_dump(out);
+}
+
+static void cmd_snapshot(struct evbuffer *out, char *args)
+{
+    (void) args;
+
+    if (!snapshot_request()) {
+        evbuffer_add_printf(out, "error: snapshot_file is not set\n");
+        return;
+    }
+
+    evbuffer_add_printf(out, "started\n");
+}
+
+static void cmd_jobtrace(struct evbuffer *out, char *args)
+{
+    (void) args;
+
+    if (!jobtrace_enabled()) {
+        evbuffer_add_printf(out, "error: job trace disabled, set job_trace_size in config\n");
+        return;
+    }
+
+    jobtrace_dump(out);
+}
+
+static const struct admin_command s_commands[] = {
+        {"help", "list commands", cmd_help},
+        {"stats", "server counters and latencies", cmd_stats},
+        {"prometheus", "stats in prometheus text exposition format", cmd_prometheus},
+        {"clients", "connected clients with assigned id", cmd_clients},
+        {"config", "current configuration", cmd_config},
+        {"reload", "reload configuration file, same as SIGHUP", cmd_reload},
+        {"drop", "<ip|id> disconnect clients", cmd_drop},
+        {"bans", "[reload] banned networks count, reload ban_file", cmd_bans},
+        {"vacuum", "optimize db full-text index in background", cmd_vacuum},
+        {"jobtrace", "last jobs of every worker in chrome trace event JSON", cmd_jobtrace},
+        {"servers", "peer servers and their load", cmd_servers},
+        {"snapshot", "save files index snapshot in background", cmd_snapshot}
+};
+
+static void cmd_help(struct evbuffer *out, char *args)
+{
+    size_t i;
+    (void) args;
+
+    for (i = 0; i < ARRAY_SIZE(s_commands); ++i) {
+        evbuffer_add_printf(out, "%s - %s\n", s_commands[i].name, s_commands[i].help);
+    }
+}
+
+static void process_command(struct evbuffer *out, char *line)
+{
+    char *args;
+    size_t i;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (!*line)
+        return;
+
+    args = strpbrk(line, " \t");
+    if (args) {
+        *args++ = '\0';
+        while (*args == ' ' || *args == '\t')
+            args++;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s_commands); ++i) {
+        if (strcmp(line, s_commands[i].name) == 0) {
+            s_commands[i].handler(out, args);
+            return;
+        }
+    }
+
+    evbuffer_add_printf(out, "error: unknown command '%s'\n", line);
+}
+
+static void admin_write_cb(struct bufferevent *bev, void *ctx)
+{
+    (void) ctx;
+    // reply is sent to peer which already closed its side
+    bufferevent_free(bev);
+}
+
+static void admin_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+    (void) ctx;
+
+    if ((events & BEV_EVENT_EOF) && evbuffer_get_length(bufferevent_get_output(bev))) {
+        bufferevent_disable(bev, EV_READ);
+        bufferevent_setcb(bev, NULL, admin_write_cb, admin_event_cb, NULL);
+        return;
+    }
+
+    bufferevent_free(bev);
+}
+
+static void admin_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct evbuffer *input = bufferevent_get_input(bev);
+    char *line;
+    (void) ctx;
+
+    while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY))) {
+        process_command(bufferevent_get_output(bev), line);
+        free(line);
+    }
+
+    if (evbuffer_get_length(input) > ADMIN_MAX_LINE) {
+        ED2KD_LOGWRN("admin: too long command line");
+        bufferevent_free(bev);
+    }
+}
+
+static void admin_accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *ctx)
+{
+    struct bufferevent *bev;
+    (void) listener;
+    (void) sa;
+    (void) socklen;
+    (void) ctx;
+
+    bev = bufferevent_socket_new(g_srv.evbase_main, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+
+    bufferevent_setcb(bev, admin_read_cb, NULL, admin_event_cb, NULL);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+int admin_start(const char *path)
+{
+    struct sockaddr_un sa;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        ED2KD_LOGERR("admin socket path too long '%s'", path);
+        return 0;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    // remove socket left by previous run
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    // clients are read from id index without locks
+    if (!rcu_register_thread()) {
+        ED2KD_LOGERR("failed to register admin thread");
+        return 0;
+    }
+
+    s_listener = evconnlistener_new_bind(g_srv.evbase_main, admin_accept_cb, NULL, LEV_OPT_CLOSE_ON_FREE,
+            -1, (struct sockaddr *) &sa, sizeof(sa));
+    if (!s_listener) {
+        int err = EVUTIL_SOCKET_ERROR();
+        ED2KD_LOGERR("failed to listen admin socket %s, last error: %s", path, evutil_socket_error_to_string(err));
+        rcu_unregister_thread();
+        return 0;
+    }
+
+    chmod(path, S_IRUSR | S_IWUSR);
+    s_path = strdup(path);
+
+    ED2KD_LOGNFO("admin socket listening on %s", path);
+
+    return 1;
+}
+
+void admin_stop(void)
+{
+    if (s_listener) {
+        evconnlistener_free(s_listener);
+        s_listener = NULL;
+        rcu_unregister_thread();
+    }
+    if (s_path) {
+        unlink(s_path);
+        free(s_path);
+        s_path = NULL;
+    }
+    if (s_optimize_started) {
+        pthread_join(s_optimize_thread, NULL);
+        s_optimize_started = 0;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef ED2KD_ADMIN_H
+#define ED2KD_ADMIN_H
+
+/**
+@file admin.h local control socket
+
+Line based text protocol on UNIX domain socket served by main event loop.
+Every command gets its reply immediately, data is taken from metrics
+snapshot and short copies made under clients list lock, so the reactors
+are never blocked by admin clients. Send "help" for list of commands.
+*/
+
+/**
+@brief starts listening on given socket path in main event base, registers
+main thread as rcu reader
+@return non-zero on success
+*/
+int admin_start(const char *path);
+
+/**
+@brief closes control socket and waits for background tasks
+*/
+void admin_stop(void);
+
+#endif // ED2KD_ADMIN_H
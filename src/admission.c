@@ -0,0 +1,360 @@
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <event2/util.h>
+
+#include "server.h"
+#include "log.h"
+
+#define BAN_MAX_LINE    128
+
+/* radix tree node, covers all addresses with first len bits equal to prefix */
+struct ban_node {
+    /* host byte order, bits after len are zero */
+    uint32_t prefix;
+    uint8_t len;
+    /* node is banned network, not only branching point */
+    uint8_t banned;
+    struct ban_node *child[2];
+};
+
+struct ban_list {
+    struct ban_node *root;
+    size_t count;
+};
+
+/* connections from one ip */
+struct ip_slot {
+    /* network byte order, 0 for empty slot */
+    uint32_t ip;
+    uint32_t count;
+};
+
+static struct {
+    size_t max_clients;
+    size_t max_per_ip;
+    struct ban_list bans;
+
+    /* guards per ip table, connections are released from job workers */
+    pthread_mutex_t mutex;
+    struct ip_slot *slots;
+    /* table size - 1 */
+    uint32_t mask;
+    /* hash shift for table size */
+    unsigned shift;
+    /* used slots count */
+    uint32_t used;
+} s_adm = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static inline uint32_t prefix_mask(unsigned len)
+{
+    return len ? ~(uint32_t) 0 << (32 - len) : 0;
+}
+
+static inline unsigned prefix_bit(uint32_t addr, unsigned pos)
+{
+    return (addr >> (31 - pos)) & 1;
+}
+
+static struct ban_node *ban_node_new(uint32_t prefix, unsigned len, int banned)
+{
+    struct ban_node *node = (struct ban_node *) calloc(1, sizeof(*node));
+
+    if (node) {
+        node->prefix = prefix;
+        node->len = (uint8_t) len;
+        node->banned = (uint8_t) banned;
+    }
+
+    return node;
+}
+
+static void ban_tree_free(struct ban_node *node)
+{
+    while (node) {
+        struct ban_node *next = node->child[1];
+        ban_tree_free(node->child[0]);
+        free(node);
+        node = next;
+    }
+}
+
+/**
+@return non-zero on success
+*/
+static int ban_list_insert(struct ban_list *list, uint32_t prefix, unsigned len)
+{
+    struct ban_node **link = &list->root;
+
+    prefix &= prefix_mask(len);
+
+    for (;;) {
+        struct ban_node *node = *link, *split;
+        unsigned common;
+        uint32_t diff;
+
+        if (!node) {
+            if (!(*link = ban_node_new(prefix, len, 1)))
+                return 0;
+            list->count++;
+            return 1;
+        }
+
+        // common leading bits of node and inserted network
+        common = node->len < len ? node->len : len;
+        diff = node->prefix ^ prefix;
+        if (diff && (unsigned) __builtin_clz(diff) < common)
+            common = __builtin_clz(diff);
+
+        if (common == node->len) {
+            if (node->len == len) {
+                if (!node->banned) {
+                    node->banned = 1;
+                    list->count++;
+                }
+                return 1;
+            }
+            link = &node->child[prefix_bit(prefix, node->len)];
+            continue;
+        }
+
+        // node and inserted network diverge, or inserted network contains node
+        split = ban_node_new(prefix & prefix_mask(common), common, common == len);
+        if (!split)
+            return 0;
+        split->child[prefix_bit(node->prefix, common)] = node;
+        if (common != len) {
+            struct ban_node *leaf = ban_node_new(prefix, len, 1);
+            if (!leaf) {
+                free(split);
+                return 0;
+            }
+            split->child[prefix_bit(prefix, common)] = leaf;
+        }
+        *link = split;
+        list->count++;
+
+        return 1;
+    }
+}
+
+static int ban_list_lookup(const struct ban_list *list, uint32_t addr)
+{
+    const struct ban_node *node = list->root;
+
+    while (node) {
+        if ((addr & prefix_mask(node->len)) != node->prefix)
+            return 0;
+        if (node->banned)
+            return 1;
+        if (node->len == 32)
+            return 0;
+        node = node->child[prefix_bit(addr, node->len)];
+    }
+
+    return 0;
+}
+
+/**
+@brief parses "a.b.c.d" or "a.b.c.d/len"
+@return non-zero on success
+*/
+static int parse_network(char *str, uint32_t *prefix, unsigned *len)
+{
+    char *slash = strchr(str, '/');
+    uint32_t addr;
+
+    *len = 32;
+    if (slash) {
+        char *end;
+        unsigned long val = strtoul(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || val > 32)
+            return 0;
+        *slash = '\0';
+        *len = (unsigned) val;
+    }
+
+    if (evutil_inet_pton(AF_INET, str, &addr) <= 0)
+        return 0;
+    *prefix = ntohl(addr);
+
+    return 1;
+}
+
+int admission_load_bans(const char *path)
+{
+    struct ban_list list = {NULL, 0};
+    char line[BAN_MAX_LINE];
+    unsigned line_no = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        ED2KD_LOGERR("failed to open ban file %s", path);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line, *end;
+        uint32_t prefix;
+        unsigned len;
+
+        line_no++;
+
+        if ((end = strchr(p, '#')))
+            *end = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        end = p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+            *--end = '\0';
+        if (!*p)
+            continue;
+
+        if (!parse_network(p, &prefix, &len)) {
+            ED2KD_LOGERR("ban file %s: bad network at line %u", path, line_no);
+            goto failed;
+        }
+        if (!ban_list_insert(&list, prefix, len)) {
+            ED2KD_LOGERR("ban file %s: out of memory", path);
+            goto failed;
+        }
+    }
+
+    fclose(fp);
+
+    ban_tree_free(s_adm.bans.root);
+    s_adm.bans = list;
+
+    ED2KD_LOGNFO("loaded %zu banned networks from %s", list.count, path);
+
+    return 1;
+
+    failed:
+    fclose(fp);
+    ban_tree_free(list.root);
+    return 0;
+}
+
+size_t admission_ban_count(void)
+{
+    return s_adm.bans.count;
+}
+
+int admission_is_banned(uint32_t ip)
+{
+    return ban_list_lookup(&s_adm.bans, ntohl(ip));
+}
+
+static inline uint32_t ip_hash(uint32_t ip)
+{
+    return (ip * 0x9E3779B1u) >> s_adm.shift;
+}
+
+int admission_init(size_t max_clients, size_t max_per_ip, const char *ban_file)
+{
+    s_adm.max_clients = max_clients;
+    s_adm.max_per_ip = max_per_ip;
+
+    if (max_per_ip) {
+        // distinct ips never exceed max_clients, so load factor stays under 1/2
+        uint32_t size = 64;
+        unsigned bits = 6;
+
+        while (size < max_clients * 2) {
+            size <<= 1;
+            bits++;
+        }
+
+        s_adm.slots = (struct ip_slot *) calloc(size, sizeof(*s_adm.slots));
+        if (!s_adm.slots) {
+            ED2KD_LOGERR("failed to allocate per ip connections table");
+            return 0;
+        }
+        s_adm.mask = size - 1;
+        s_adm.shift = 32 - bits;
+        s_adm.used = 0;
+    }
+
+    if (ban_file && !admission_load_bans(ban_file))
+        return 0;
+
+    return 1;
+}
+
+void admission_free(void)
+{
+    ban_tree_free(s_adm.bans.root);
+    s_adm.bans.root = NULL;
+    s_adm.bans.count = 0;
+
+    free(s_adm.slots);
+    s_adm.slots = NULL;
+}
+
+enum admission_result admission_accept(uint32_t ip)
+{
+    enum admission_result ret = ADMISSION_OK;
+    uint32_t i;
+
+    if (s_adm.bans.root && admission_is_banned(ip))
+        return ADMISSION_BANNED;
+
+    if (atomic_load(&g_srv.user_count) >= s_adm.max_clients)
+        return ADMISSION_SERVER_FULL;
+
+    if (!s_adm.slots)
+        return ADMISSION_OK;
+
+    pthread_mutex_lock(&s_adm.mutex);
+    for (i = ip_hash(ip); s_adm.slots[i].ip && s_adm.slots[i].ip != ip; i = (i + 1) & s_adm.mask);
+
+    if (s_adm.slots[i].ip) {
+        if (s_adm.slots[i].count >= s_adm.max_per_ip)
+            ret = ADMISSION_IP_LIMIT;
+        else
+            s_adm.slots[i].count++;
+    } else if (s_adm.used >= s_adm.mask - s_adm.mask / 4) {
+        // should not happen while server limit holds
+        ret = ADMISSION_SERVER_FULL;
+    } else {
+        s_adm.slots[i].ip = ip;
+        s_adm.slots[i].count = 1;
+        s_adm.used++;
+    }
+    pthread_mutex_unlock(&s_adm.mutex);
+
+    return ret;
+}
+
+void admission_release(uint32_t ip)
+{
+    uint32_t i, j;
+
+    if (!s_adm.slots)
+        return;
+
+    pthread_mutex_lock(&s_adm.mutex);
+    for (i = ip_hash(ip); s_adm.slots[i].ip && s_adm.slots[i].ip != ip; i = (i + 1) & s_adm.mask);
+
+    if (!s_adm.slots[i].ip || --s_adm.slots[i].count) {
+        pthread_mutex_unlock(&s_adm.mutex);
+        return;
+    }
+
+    // backward shift deletion keeps probe sequences without tombstones
+    for (j = (i + 1) & s_adm.mask; s_adm.slots[j].ip; j = (j + 1) & s_adm.mask) {
+        uint32_t home = ip_hash(s_adm.slots[j].ip);
+        if (((j - home) & s_adm.mask) >= ((j - i) & s_adm.mask)) {
+            s_adm.slots[i] = s_adm.slots[j];
+            i = j;
+        }
+    }
+    s_adm.slots[i].ip = 0;
+    s_adm.slots[i].count = 0;
+    s_adm.used--;
+    pthread_mutex_unlock(&s_adm.mutex);
+}
@@ -0,0 +1,66 @@
+#ifndef ED2KD_ADMISSION_H
+#define ED2KD_ADMISSION_H
+
+/**
+@file admission.h incoming connections admission control
+
+Connections are checked in accept callback before any client state is
+allocated. Banned networks are kept in a path-compressed binary radix tree,
+connections per ip are counted in open addressing hash table. Ban list is
+used only from main event loop thread (listener and admin socket).
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum admission_result {
+    ADMISSION_OK,
+    ADMISSION_BANNED,
+    ADMISSION_SERVER_FULL,
+    ADMISSION_IP_LIMIT
+};
+
+/**
+@param max_clients maximum connected clients
+@param max_per_ip maximum connections from one ip, 0 for unlimited
+@param ban_file banned networks file, may be NULL
+@return non-zero on success
+*/
+int admission_init(size_t max_clients, size_t max_per_ip, const char *ban_file);
+
+void admission_free(void);
+
+/**
+@brief replaces ban list with networks from given file
+
+File contains one ipv4 address or network in CIDR notation (a.b.c.d/len)
+per line, '#' starts comment.
+
+@return non-zero on success, on failure current ban list is kept
+*/
+int admission_load_bans(const char *path);
+
+/**
+@return banned networks count
+*/
+size_t admission_ban_count(void);
+
+/**
+@param ip address in network byte order
+@return non-zero if ip belongs to banned network
+*/
+int admission_is_banned(uint32_t ip);
+
+/**
+@brief checks new connection and counts it on success
+@param ip address in network byte order
+*/
+enum admission_result admission_accept(uint32_t ip);
+
+/**
+@brief forgets connection counted by admission_accept()
+@param ip address in network byte order
+*/
+void admission_release(uint32_t ip);
+
+#endif // ED2KD_ADMISSION_H
@@ -0,0 +1,80 @@
+#include "arena.h"
+#include <stdlib.h>
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static struct arena_block *arena_block_new(size_t size)
+{
+    struct arena_block *b = (struct arena_block *) malloc(sizeof(*b) + size);
+
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+
+    return b;
+}
+
+int arena_init(struct arena *a, size_t block_size)
+{
+    a->block_size = block_size;
+    a->head = a->cur = arena_block_new(block_size);
+
+    return NULL != a->head;
+}
+
+void arena_destroy(struct arena *a)
+{
+    struct arena_block *b = a->head;
+
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    a->head = a->cur = NULL;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *b = a->cur;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    for (; ;) {
+        if (b->size - b->used >= size) {
+            void *ptr = b->data + b->used;
+            b->used += size;
+            return ptr;
+        }
+
+        // blocks after current one are empty, reuse next if it is big enough
+        if (!b->next || (b->next->size < size)) {
+            struct arena_block *nb = arena_block_new(size > a->block_size ? size : a->block_size);
+            if (!nb)
+                return NULL;
+            nb->next = b->next;
+            b->next = nb;
+        }
+
+        b = a->cur = b->next;
+    }
+}
+
+void arena_reset(struct arena *a)
+{
+    struct arena_block *b;
+
+    for (b = a->head; b && b->used; b = b->next) {
+        b->used = 0;
+    }
+
+    a->cur = a->head;
+}
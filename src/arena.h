@@ -0,0 +1,56 @@
+#ifndef ED2KD_ARENA_H
+#define ED2KD_ARENA_H
+
+/**
+@file arena.h bump allocator for short-living per-job data
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_block;
+
+struct arena {
+    /* first block */
+    struct arena_block *head;
+    /* block used for allocations */
+    struct arena_block *cur;
+    /* minimal size of new block */
+    size_t block_size;
+};
+
+/**
+@brief initializes arena and allocates first block
+@param a            target arena
+@param block_size   minimal size of each block
+@return non-zero on success
+*/
+int arena_init(struct arena *a, size_t block_size);
+
+/**
+@brief frees all memory owned by arena
+*/
+void arena_destroy(struct arena *a);
+
+/**
+@brief allocates memory valid until next arena_reset(), grows arena when current block exhausted
+@return pointer aligned to ARENA_ALIGN or NULL on failure
+*/
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+@brief releases all allocations at once, allocated blocks are kept for reuse
+*/
+void arena_reset(struct arena *a);
+
+static inline void *arena_zalloc(struct arena *a, size_t size)
+{
+    void *ptr = arena_alloc(a, size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+#endif // ED2KD_ARENA_H
@@ -1,4 +1,6 @@
 #include "client.h"
+#include <stdlib.h>
+#include <stddef.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -10,13 +12,17 @@
 #include "packet.h"
 #include "log.h"
 #include "db.h"
+#include "admission.h"
+#include "idmap.h"
+#include "arena.h"
 
-struct shared_file_entry {
-    /* key */
-    unsigned char hash[ED2K_HASH_SIZE];
-    /* makes this structure hashable */
-    UT_hash_handle hh;
-};
+static void client_free(struct rcu_head *head)
+{
+    struct client *clnt = (struct client *) ((char *) head - offsetof(struct client, rcu));
+
+    free(clnt->nick);
+    free(clnt);
+}
 
 static uint32_t get_next_lowid(void)
 {
@@ -51,29 +57,20 @@ void client_delete(struct client *clnt)
     uint32_t old_val = 0;
 
     if (atomic_compare_exchange_strong(&clnt->deleted, &old_val, 1)) {
+        if (clnt->indexed)
+            idmap_remove(clnt);
+
         // disable all events
         if (clnt->bev)
             bufferevent_disable(clnt->bev, EV_READ | EV_WRITE);
-        if (clnt->bev_pc)
-            bufferevent_disable(clnt->bev_pc, EV_READ | EV_WRITE);
         if (clnt->evtimer_status_notify)
             event_del(clnt->evtimer_status_notify);
-        if (clnt->evtimer_portcheck)
-            event_del(clnt->evtimer_portcheck);
 
         // delete all events
         if (clnt->evtimer_status_notify) {
             event_free(clnt->evtimer_status_notify);
             clnt->evtimer_status_notify = NULL;
         }
-        if (clnt->evtimer_portcheck) {
-            event_free(clnt->evtimer_portcheck);
-            clnt->evtimer_portcheck = NULL;
-        }
-        if (clnt->bev_pc) {
-            bufferevent_free(clnt->bev_pc);
-            clnt->bev_pc = NULL;
-        }
         if (clnt->bev) {
             bufferevent_free(clnt->bev);
             clnt->bev = NULL;
@@ -87,11 +84,9 @@ void client_delete(struct client *clnt)
             clnt->file_count = 0;
         }
 
-        struct shared_file_entry *she, *she_tmp;
-        HASH_ITER(hh, clnt->shared_files, she, she_tmp) {
-            HASH_DEL(clnt->shared_files, she);
-            free(she);
-        }
+        hashset_free(&clnt->shared_files);
+
+        admission_release(clnt->ip);
 
         if (atomic_fetch_sub(&g_srv.user_count, 1) - 1 < g_srv.cfg->max_clients) {
             evconnlistener_enable(g_srv.tcp_listener);
@@ -99,7 +94,11 @@ void client_delete(struct client *clnt)
     }
 
     if (0 == atomic_load(&clnt->ref_cnt)) {
-        free(clnt);
+        uint32_t not_retired = 0;
+
+        // client_tryref() may take and drop reference after it reached zero
+        if (atomic_compare_exchange_strong(&clnt->retired, &not_retired, 1))
+            rcu_retire(&clnt->rcu, client_free);
     }
 }
 
@@ -115,7 +114,7 @@ void client_search_files(struct client *clnt, struct search_node *search_tree)
     //data.files_count = 0;
     evbuffer_add(buf, &data, sizeof(data));
 
-    if (db_search_files(search_tree, buf, &count)) {
+    if (db_search_files(search_tree, buf, &count, NULL)) {
         struct packet_search_result *ph = (struct packet_search_result *) evbuffer_pullup(buf, sizeof(*ph));
         ph->hdr.length = evbuffer_get_length(buf) - sizeof(ph->hdr);
         ph->files_count = count;
@@ -126,48 +125,47 @@ void client_search_files(struct client *clnt, struct search_node *search_tree)
     evbuffer_free(buf);
 }
 
-void client_get_sources(struct client *clnt, const unsigned char *hash)
-{
-    struct file_source sources[MAX_FOUND_SOURCES];
-    uint8_t src_count = ARRAY_SIZE(sources);
-
-    if (db_get_sources(hash, sources, &src_count))
-        send_found_sources(clnt->bev, hash, sources, src_count);
-}
-
-void client_portcheck_start(struct client *clnt)
+void client_get_sources(struct client *clnt, struct arena *arena, const unsigned char *hashes, const uint8_t *obfu,
+        size_t count)
 {
-    struct sockaddr_in client_sa;
+    struct file_source sources[MAX_GETSOURCES_BATCH][MAX_FOUND_SOURCES];
+    struct source_query queries[MAX_GETSOURCES_BATCH];
+    struct evbuffer *buf;
+    size_t i;
 
-    memset(&client_sa, 0, sizeof(client_sa));
-    client_sa.sin_family = AF_INET;
-    client_sa.sin_addr.s_addr = clnt->ip;
-    client_sa.sin_port = htons(clnt->port);
+    for (i = 0; i < count; ++i) {
+        queries[i].hash = hashes + i * ED2K_HASH_SIZE;
+        queries[i].count = MAX_FOUND_SOURCES;
+        queries[i].obfu = obfu[i];
+        // obfuscated sources are several times larger, allocated only when requested
+        queries[i].sources = obfu[i] ? arena_alloc(arena, MAX_FOUND_SOURCES * sizeof(struct file_source_obfu))
+                : sources[i];
+        if (!queries[i].sources)
+            return;
+    }
 
-    clnt->bev_pc = bufferevent_socket_new(g_srv.evbase_tcp, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
-    bufferevent_setcb(clnt->bev_pc, portcheck_read_cb, NULL, portcheck_event_cb, clnt);
+    if (!db_get_sources_batch(queries, count))
+        return;
 
-    if (bufferevent_socket_connect(clnt->bev_pc, (struct sockaddr *) &client_sa, sizeof(client_sa)) < 0) {
-        bufferevent_free(clnt->bev_pc);
-        clnt->bev_pc = NULL;
-        client_portcheck_finish(clnt, PORTCHECK_FAILED);
-    } else {
-        clnt->evtimer_portcheck = evtimer_new(g_srv.evbase_tcp, portcheck_timeout_cb, clnt);
-        evtimer_add(clnt->evtimer_portcheck, g_srv.portcheck_timeout_tv);
+    buf = evbuffer_new();
+    for (i = 0; i < count; ++i) {
+        if (queries[i].obfu)
+            write_found_sources_obfu(buf, queries[i].hash, queries[i].sources, queries[i].count);
+        else
+            write_found_sources(buf, queries[i].hash, queries[i].sources, queries[i].count);
     }
+    bufferevent_write_buffer(clnt->bev, buf);
+    evbuffer_free(buf);
 }
 
 void client_portcheck_finish(struct client *clnt, enum portcheck_result result)
 {
-    if (clnt->bev_pc) {
-        bufferevent_free(clnt->bev_pc);
-        clnt->bev_pc = NULL;
-    }
-    if (clnt->evtimer_portcheck) {
-        event_free(clnt->evtimer_portcheck);
-        clnt->evtimer_portcheck = NULL;
-    }
+    // repeated login doesn't restart status notify
+    if (clnt->portcheck_finished)
+        return;
+
     clnt->portcheck_finished = 1;
+    clnt->portcheck_posted = 0;
     clnt->lowid = (PORTCHECK_SUCCESS != result);
 
     if (clnt->lowid) {
@@ -189,6 +187,7 @@ void client_portcheck_finish(struct client *clnt, enum portcheck_result result)
     }
 
     send_id_change(clnt->bev, clnt->id);
+    idmap_add(clnt);
 
     clnt->evtimer_status_notify = evtimer_new(g_srv.evbase_tcp, server_status_notify_cb, clnt);
     event_add(clnt->evtimer_status_notify, g_srv.status_notify_tv);
@@ -212,12 +211,7 @@ void client_share_files(struct client *clnt, struct pub_file *files, size_t coun
     }
 
     for (i = 0; i < count; ++i) {
-        struct shared_file_entry *she = NULL;
-        HASH_FIND(hh, clnt->shared_files, f->hash, sizeof(f->hash), she);
-        if (!she) {
-            she = (struct shared_file_entry *) malloc(sizeof(*she));
-            memcpy(she->hash, f->hash, sizeof(she->hash));
-            HASH_ADD(hh, clnt->shared_files, hash, sizeof(she->hash), she);
+        if (hashset_add(&clnt->shared_files, f->hash) > 0) {
             real_count++;
         } else {
             /* mark as invalid */
@@ -228,7 +222,7 @@ void client_share_files(struct client *clnt, struct pub_file *files, size_t coun
     }
 
     if (db_share_files(files, count, clnt)) {
-        ED2KD_LOGDBG("client %u: published %u files, %u duplicates", clnt->id, count, count - real_count);
+        ED2KD_LOGDBG("client %u: published %zu files, %zu duplicates", clnt->id, count, count - real_count);
         clnt->file_count += real_count;
         atomic_fetch_add(&g_srv.file_count, real_count);
     }
@@ -3,17 +3,20 @@
 
 #include <stdint.h>
 #include <pthread.h>
-#include "uthash/uthash.h"
 #include "atomic.h"
 #include "util.h"
+#include "hashset.h"
+#include "rcu.h"
 
 struct search_node;
-struct shared_file_entry;
 struct pub_file;
+struct arena;
 
 #define MAX_NICK_LEN        255
 #define MAX_FOUND_SOURCES   200 // todo: move to config
 #define MAX_FOUND_FILES     200 // todo: move to config
+/* OP_GETSOURCES answered together */
+#define MAX_GETSOURCES_BATCH    32
 
 enum portcheck_result {
     PORTCHECK_FAILED,
@@ -29,8 +32,8 @@ struct client {
     uint16_t port;
     /* ed2k id */
     uint32_t id;
-    /* nick */
-    char nick[MAX_NICK_LEN + 1];
+    /* nick (null-terminated, allocated on login) */
+    char *nick;
     /* nick length */
     uint16_t nick_len;
     /* tcp flags */
@@ -39,17 +42,17 @@ struct client {
     uint32_t file_count;
     /* remote port check status flag */
     unsigned portcheck_finished:1;
+    /* port check is queued or running flag */
+    unsigned portcheck_posted:1;
     /* lowid flag */
     unsigned lowid:1;
+    /* added to id index flag */
+    unsigned indexed:1;
     /* set of already shared files hashes */
-    struct shared_file_entry *shared_files;
+    struct hashset shared_files;
 
     /* connection bufferevent */
     struct bufferevent *bev;
-    /* portcheck bufferevent */
-    struct bufferevent *bev_pc;
-    /* portcheck timeout timer */
-    struct event *evtimer_portcheck;
     /* status notify timer */
     struct event *evtimer_status_notify;
 
@@ -60,6 +63,15 @@ struct client {
     /* marked for remove flag */
     atomic_uint32_t deleted;
 
+    /* freed or waiting for grace period flag */
+    atomic_uint32_t retired;
+
+    /* next client in id index bucket */
+    _Atomic(struct client *) idmap_next;
+
+    /* id index readers may use client until grace period ends */
+    struct rcu_head rcu;
+
     /* offer limit */
     struct token_bucket limit_offer;
 
@@ -94,13 +106,32 @@ static __inline void client_decref(struct client *clnt)
         client_delete(clnt);
 }
 
-void client_portcheck_start(struct client *client);
+/**
+@brief takes reference of client found without lock (see idmap.h)
+@return non-zero if client was not deleted
+*/
+static __inline int client_tryref(struct client *clnt)
+{
+    client_addref(clnt);
+    if (!atomic_load(&clnt->deleted))
+        return 1;
+    client_decref(clnt);
+    return 0;
+}
 
 void client_portcheck_finish(struct client *clnt, enum portcheck_result result);
 
 void client_search_files(struct client *clnt, struct search_node *search_tree);
 
-void client_get_sources(struct client *clnt, const unsigned char *hash);
+/**
+@brief answers several OP_GETSOURCES(_OBFU) with one db lookup and one output write
+@param arena job arena, holds obfuscated source lists until reset
+@param hashes count file hashes, 16 bytes each
+@param obfu count flags, non-zero for OP_GETSOURCES_OBFU
+@param count at most MAX_GETSOURCES_BATCH
+*/
+void client_get_sources(struct client *clnt, struct arena *arena, const unsigned char *hashes, const uint8_t *obfu,
+        size_t count);
 
 void client_share_files(struct client *clnt, struct pub_file *files, size_t count);
 
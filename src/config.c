@@ -1,12 +1,23 @@
 #include "server.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <libconfig.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <event2/buffer.h>
 
 #include "log.h"
 #include "ed2k_proto.h"
 #include "version.h"
 #include "util.h"
+#include "packet.h"
+#include "portcheck.h"
+#include "udp.h"
+#include "serverlist.h"
+#include "snapshot.h"
 
 #define CFG_DEFAULT_PATH "ed2kd.conf"
 
@@ -19,14 +30,73 @@
 #define CFG_SERVER_DESCR                "server_descr"
 #define CFG_ALLOW_LOWID                 "allow_lowid"
 #define CFG_PORTCHECK_TIMEOUT           "portcheck_timeout"
+#define CFG_PORTCHECK_MAX_INFLIGHT      "portcheck_max_inflight"
+#define CFG_PORTCHECK_MAX_PER_SUBNET    "portcheck_max_per_subnet"
+#define CFG_PORTCHECK_CACHE_SIZE        "portcheck_cache_size"
+#define CFG_PORTCHECK_CACHE_TTL         "portcheck_cache_ttl"
 #define CFG_STATUS_NOTIFY_INTERVAL      "status_notify_interval"
 #define CFG_MAX_CLIENTS                 "max_clients"
 #define CFG_MAX_FILES                   "max_files"
 #define CFG_MAX_FILES_PER_CLIENT        "max_files_per_client"
 #define CFG_MAX_OFFERS_LIMIT            "max_offers_limit"
 #define CFG_MAX_SEARCHES_LIMIT          "max_searches_limit"
+#define CFG_MAX_CLIENTS_PER_IP          "max_clients_per_ip"
+#define CFG_BAN_FILE                    "ban_file"
+#define CFG_ADMIN_SOCKET                "admin_socket"
+#define CFG_JOB_TRACE_SIZE              "job_trace_size"
+#define CFG_SLOW_QUERY_THRESHOLD        "slow_query_threshold"
+#define CFG_UDP_ENABLED                 "udp_enabled"
+#define CFG_UDP_RATE_LIMIT              "udp_rate_limit"
+#define CFG_PEER_SERVERS                "peer_servers"
+#define CFG_PEER_PING_INTERVAL          "peer_ping_interval"
+#define CFG_SNAPSHOT_FILE               "snapshot_file"
+#define CFG_SNAPSHOT_INTERVAL           "snapshot_interval"
+#define CFG_SNAPSHOT_GRACE              "snapshot_grace"
 
-int server_load_config(const char *path)
+/* configuration file path, read again on reload */
+static char *s_path;
+
+static unsigned char *buffer_detach(struct evbuffer *buf, size_t *len)
+{
+    unsigned char *data;
+
+    *len = evbuffer_get_length(buf);
+    data = (unsigned char *) malloc(*len);
+    evbuffer_remove(buf, data, *len);
+
+    return data;
+}
+
+/* serialize packets which are the same for all clients */
+static void build_static_packets(struct server_config *cfg)
+{
+    static const char msg_highid[] = "WARNING: Only HighID clients!";
+    struct evbuffer *buf = evbuffer_new();
+
+    write_server_message(buf, cfg->welcome_msg, cfg->welcome_msg_len);
+    if (!cfg->allow_lowid)
+        write_server_message(buf, msg_highid, sizeof(msg_highid) - 1);
+    cfg->login_pkt = buffer_detach(buf, &cfg->login_pkt_len);
+
+    write_server_ident(buf, cfg);
+    cfg->ident_pkt = buffer_detach(buf, &cfg->ident_pkt_len);
+
+    evbuffer_free(buf);
+}
+
+static void free_config(struct server_config *cfg)
+{
+    free(cfg->listen_addr);
+    free(cfg->ban_file);
+    free(cfg->admin_socket);
+    free(cfg->login_pkt);
+    free(cfg->ident_pkt);
+    free(cfg->peer_servers);
+    free(cfg->snapshot_file);
+    free(cfg);
+}
+
+static struct server_config *parse_config(const char *path)
 {
     static const char srv_ver[] = "server version" ED2KD_VER_STR " (ed2kd)";
     config_t config;
@@ -36,12 +106,8 @@ int server_load_config(const char *path)
     config_init(&config);
     memset(server_cfg, 0, sizeof(*server_cfg));
 
-    if (NULL == path) {
-        path = CFG_DEFAULT_PATH;
-    }
-
     if (config_read_file(&config, path)) {
-        config_setting_t *root;
+        config_setting_t *root, *setting;
         const char *str_val;
         int int_val;
 
@@ -131,6 +197,26 @@ int server_load_config(const char *path)
             ret = 0;
         }
 
+        /* port checks in flight limits (optional) */
+        server_cfg->portcheck_max_inflight = PORTCHECK_MAX_INFLIGHT;
+        if (config_setting_lookup_int(root, CFG_PORTCHECK_MAX_INFLIGHT, &int_val) && int_val > 0) {
+            server_cfg->portcheck_max_inflight = int_val;
+        }
+        server_cfg->portcheck_max_per_subnet = PORTCHECK_MAX_PER_SUBNET;
+        if (config_setting_lookup_int(root, CFG_PORTCHECK_MAX_PER_SUBNET, &int_val) && int_val > 0) {
+            server_cfg->portcheck_max_per_subnet = int_val;
+        }
+
+        /* port check cache (optional) */
+        server_cfg->portcheck_cache_size = PORTCHECK_CACHE_SIZE;
+        if (config_setting_lookup_int(root, CFG_PORTCHECK_CACHE_SIZE, &int_val) && int_val >= 0) {
+            server_cfg->portcheck_cache_size = int_val;
+        }
+        server_cfg->portcheck_cache_ttl = PORTCHECK_CACHE_TTL;
+        if (config_setting_lookup_int(root, CFG_PORTCHECK_CACHE_TTL, &int_val) && int_val > 0) {
+            server_cfg->portcheck_cache_ttl = int_val;
+        }
+
         /* status notify interval */
         if (config_setting_lookup_int(root, CFG_STATUS_NOTIFY_INTERVAL, &int_val)) {
             server_cfg->status_notify_tv.tv_sec = int_val / 1000;
@@ -191,6 +277,84 @@ int server_load_config(const char *path)
                     " missing");
             ret = 0;
         }
+
+        /* max clients per ip (optional) */
+        if (config_setting_lookup_int(root, CFG_MAX_CLIENTS_PER_IP, &int_val) && int_val > 0) {
+            server_cfg->max_clients_per_ip = int_val;
+        }
+
+        /* banned networks file (optional) */
+        if (config_setting_lookup_string(root, CFG_BAN_FILE, &str_val)) {
+            server_cfg->ban_file = strdup(str_val);
+        }
+
+        /* admin control socket (optional) */
+        if (config_setting_lookup_string(root, CFG_ADMIN_SOCKET, &str_val)) {
+            server_cfg->admin_socket = strdup(str_val);
+        }
+
+        /* job trace size (optional) */
+        if (config_setting_lookup_int(root, CFG_JOB_TRACE_SIZE, &int_val) && int_val > 0) {
+            server_cfg->job_trace_size = int_val;
+        }
+
+        /* slow query log threshold (optional) */
+        if (config_setting_lookup_int(root, CFG_SLOW_QUERY_THRESHOLD, &int_val) && int_val > 0) {
+            server_cfg->slow_query_threshold = int_val;
+        }
+
+        /* udp protocol (optional) */
+        server_cfg->udp_enabled = 1;
+        if (config_setting_lookup_int(root, CFG_UDP_ENABLED, &int_val)) {
+            server_cfg->udp_enabled = int_val != 0;
+        }
+        server_cfg->udp_rate_limit = UDP_RATE_LIMIT;
+        if (config_setting_lookup_int(root, CFG_UDP_RATE_LIMIT, &int_val) && int_val > 0) {
+            server_cfg->udp_rate_limit = int_val;
+        }
+
+        /* peer servers, "host:port" list (optional) */
+        if ((setting = config_setting_get_member(root, CFG_PEER_SERVERS))) {
+            int i, count = config_setting_length(setting);
+
+            if (count > SERVERLIST_MAX_PEERS) {
+                ED2KD_LOGWRN("config: only first %d of " CFG_PEER_SERVERS " are used", SERVERLIST_MAX_PEERS);
+                count = SERVERLIST_MAX_PEERS;
+            }
+            server_cfg->peer_servers = (struct server_entry *) calloc(count, sizeof(struct server_entry));
+            for (i = 0; i < count; ++i) {
+                const char *addr = config_setting_get_string(config_setting_get_elem(setting, i));
+                struct sockaddr_in sa;
+                int sa_len = sizeof(sa);
+
+                if (!addr || evutil_parse_sockaddr_port(addr, (struct sockaddr *) &sa, &sa_len) < 0
+                        || AF_INET != sa.sin_family || !sa.sin_port) {
+                    ED2KD_LOGERR("config: bad " CFG_PEER_SERVERS " entry %s", addr ? addr : "");
+                    ret = 0;
+                    break;
+                }
+                server_cfg->peer_servers[i].ip = sa.sin_addr.s_addr;
+                server_cfg->peer_servers[i].port = ntohs(sa.sin_port);
+                server_cfg->peer_server_count++;
+            }
+        }
+        server_cfg->peer_ping_interval = SERVERLIST_PING_INTERVAL;
+        if (config_setting_lookup_int(root, CFG_PEER_PING_INTERVAL, &int_val) && int_val > 0) {
+            server_cfg->peer_ping_interval = int_val;
+        }
+
+        /* files index snapshot (optional) */
+        if (config_setting_lookup_string(root, CFG_SNAPSHOT_FILE, &str_val)) {
+            server_cfg->snapshot_file = strdup(str_val);
+        }
+        server_cfg->snapshot_interval = SNAPSHOT_INTERVAL;
+        if (config_setting_lookup_int(root, CFG_SNAPSHOT_INTERVAL, &int_val) && int_val > 0) {
+            server_cfg->snapshot_interval = int_val;
+        }
+        server_cfg->snapshot_grace = SNAPSHOT_GRACE;
+        if (config_setting_lookup_int(root, CFG_SNAPSHOT_GRACE, &int_val) && int_val > 0) {
+            server_cfg->snapshot_grace = int_val;
+        }
     } else {
         ED2KD_LOGWRN("config: failed to parse %s(error:%s at %d line)", path,
                 config_error_text(&config), config_error_line(&config));
@@ -200,20 +364,158 @@ int server_load_config(const char *path)
     config_destroy(&config);
 
     if (!ret) {
-        free(server_cfg);
-    } else {
-        server_cfg->srv_tcp_flags = SRV_TCPFLG_COMPRESSION | SRV_TCPFLG_TYPETAGINTEGER | SRV_TCPFLG_LARGEFILES;
-        evutil_inet_pton(AF_INET, server_cfg->listen_addr, &server_cfg->listen_addr_inaddr);
-        g_srv.cfg = server_cfg;
+        free_config(server_cfg);
+        return NULL;
+    }
+
+    return server_cfg;
+}
+
+/* fills derived fields, called when all settings are final */
+static void finish_config(struct server_config *cfg)
+{
+    atomic_init(&cfg->ref_cnt, 1);
+    cfg->srv_tcp_flags = SRV_TCPFLG_COMPRESSION | SRV_TCPFLG_TYPETAGINTEGER | SRV_TCPFLG_LARGEFILES
+            | SRV_TCPFLG_TCPOBFUSCATION;
+    evutil_inet_pton(AF_INET, cfg->listen_addr, &cfg->listen_addr_inaddr);
+    build_static_packets(cfg);
+}
+
+int server_load_config(const char *path)
+{
+    struct server_config *cfg;
+
+    if (NULL == path) {
+        path = CFG_DEFAULT_PATH;
+    }
+
+    cfg = parse_config(path);
+    if (!cfg)
+        return 0;
+
+    finish_config(cfg);
+    s_path = strdup(path);
+    atomic_store(&g_srv.cfg, cfg);
+
+    return 1;
+}
+
+static void keep_string(char **val, const char *old, const char *name)
+{
+    if ((!*val && !old) || (*val && old && !strcmp(*val, old)))
+        return;
+
+    ED2KD_LOGWRN("config: %s change requires restart", name);
+    free(*val);
+    *val = old ? strdup(old) : NULL;
+}
+
+#define KEEP_VALUE(cfg, old, field, name) \
+    if ((cfg)->field != (old)->field) { \
+        ED2KD_LOGWRN("config: " name " change requires restart"); \
+        (cfg)->field = (old)->field; \
+    }
+
+/* settings applied only on startup keep running values */
+static void keep_startup_settings(struct server_config *cfg, const struct server_config *old)
+{
+    keep_string(&cfg->listen_addr, old->listen_addr, CFG_LISTEN_ADDR);
+    KEEP_VALUE(cfg, old, listen_port, CFG_LISTEN_PORT);
+    KEEP_VALUE(cfg, old, listen_backlog, CFG_LISTEN_BACKLOG);
+    if (memcmp(cfg->hash, old->hash, sizeof(cfg->hash)) != 0) {
+        ED2KD_LOGWRN("config: " CFG_SERVER_HASH " change requires restart");
+        memcpy(cfg->hash, old->hash, sizeof(cfg->hash));
+    }
+    KEEP_VALUE(cfg, old, portcheck_max_inflight, CFG_PORTCHECK_MAX_INFLIGHT);
+    KEEP_VALUE(cfg, old, portcheck_max_per_subnet, CFG_PORTCHECK_MAX_PER_SUBNET);
+    KEEP_VALUE(cfg, old, portcheck_cache_size, CFG_PORTCHECK_CACHE_SIZE);
+    KEEP_VALUE(cfg, old, portcheck_cache_ttl, CFG_PORTCHECK_CACHE_TTL);
+    KEEP_VALUE(cfg, old, max_clients, CFG_MAX_CLIENTS);
+    KEEP_VALUE(cfg, old, max_clients_per_ip, CFG_MAX_CLIENTS_PER_IP);
+    keep_string(&cfg->admin_socket, old->admin_socket, CFG_ADMIN_SOCKET);
+    KEEP_VALUE(cfg, old, job_trace_size, CFG_JOB_TRACE_SIZE);
+    KEEP_VALUE(cfg, old, slow_query_threshold, CFG_SLOW_QUERY_THRESHOLD);
+    KEEP_VALUE(cfg, old, udp_enabled, CFG_UDP_ENABLED);
+    KEEP_VALUE(cfg, old, udp_rate_limit, CFG_UDP_RATE_LIMIT);
+    if (cfg->peer_server_count != old->peer_server_count
+            || (old->peer_server_count && memcmp(cfg->peer_servers, old->peer_servers, old->peer_server_count * sizeof(struct server_entry)))) {
+        ED2KD_LOGWRN("config: " CFG_PEER_SERVERS " change requires restart");
+        free(cfg->peer_servers);
+        cfg->peer_servers = NULL;
+        if (old->peer_server_count) {
+            size_t size = old->peer_server_count * sizeof(struct server_entry);
+            cfg->peer_servers = (struct server_entry *) malloc(size);
+            memcpy(cfg->peer_servers, old->peer_servers, size);
+        }
+        cfg->peer_server_count = old->peer_server_count;
+    }
+    KEEP_VALUE(cfg, old, peer_ping_interval, CFG_PEER_PING_INTERVAL);
+    keep_string(&cfg->snapshot_file, old->snapshot_file, CFG_SNAPSHOT_FILE);
+    KEEP_VALUE(cfg, old, snapshot_interval, CFG_SNAPSHOT_INTERVAL);
+    KEEP_VALUE(cfg, old, snapshot_grace, CFG_SNAPSHOT_GRACE);
+}
+
+static void retire_config(struct rcu_head *head)
+{
+    server_config_unref((struct server_config *) ((char *) head - offsetof(struct server_config, rcu)));
+}
+
+int server_reload_config(void)
+{
+    const struct server_config *old = atomic_load(&g_srv.cfg);
+    struct server_config *cfg = parse_config(s_path);
+
+    if (!cfg) {
+        ED2KD_LOGERR("config: failed to reload %s, running configuration kept", s_path);
+        return 0;
+    }
+
+    keep_startup_settings(cfg, old);
+    finish_config(cfg);
+
+    // added timers fire with previous interval once
+    if (evutil_timercmp(&cfg->status_notify_tv, &old->status_notify_tv, !=)) {
+        const struct timeval *tv = event_base_init_common_timeout(g_srv.evbase_tcp, &cfg->status_notify_tv);
+        if (tv) {
+            atomic_store(&g_srv.status_notify_tv, tv);
+        } else {
+            ED2KD_LOGWRN("config: failed to change " CFG_STATUS_NOTIFY_INTERVAL);
+            cfg->status_notify_tv = old->status_notify_tv;
+        }
     }
 
-    return ret;
+    if (evutil_timercmp(&cfg->portcheck_timeout_tv, &old->portcheck_timeout_tv, !=)
+            && !portcheck_set_timeout(&cfg->portcheck_timeout_tv)) {
+        ED2KD_LOGWRN("config: failed to change " CFG_PORTCHECK_TIMEOUT);
+        cfg->portcheck_timeout_tv = old->portcheck_timeout_tv;
+    }
+
+    // readers see either whole old or whole new configuration
+    atomic_store_explicit(&g_srv.cfg, cfg, memory_order_release);
+    rcu_retire(&((struct server_config *) old)->rcu, retire_config);
+
+    ED2KD_LOGNFO("config: reloaded %s", s_path);
+
+    return 1;
 }
 
 void server_free_config(void)
 {
-    struct server_config *cfg = (struct server_config *) g_srv.cfg;
-    g_srv.cfg = NULL;
-    free(cfg->listen_addr);
-    free(cfg);
+    const struct server_config *cfg = atomic_load(&g_srv.cfg);
+
+    atomic_store(&g_srv.cfg, NULL);
+    server_config_unref(cfg);
+    free(s_path);
+    s_path = NULL;
+}
+
+void server_config_ref(const struct server_config *cfg)
+{
+    atomic_fetch_add(&((struct server_config *) cfg)->ref_cnt, 1);
+}
+
+void server_config_unref(const struct server_config *cfg)
+{
+    if (1 == atomic_fetch_sub(&((struct server_config *) cfg)->ref_cnt, 1))
+        free_config((struct server_config *) cfg);
 }
@@ -15,21 +15,35 @@ struct file_source;
 #define MAX_FILENAME_LEN    255
 #define MAX_MCODEC_LEN      64
 #define MAX_FILEEXT_LEN     16
+/* keys per batched sources lookup statement */
+#define DB_SOURCES_BATCH    16
 
+/* offered file, strings are not null-terminated and point into the packet */
 struct pub_file {
     unsigned char hash[16];
     uint16_t name_len;
-    char name[MAX_FILENAME_LEN + 1];
+    uint16_t media_codec_len;
+    const char *name;
+    const char *media_codec;
     uint64_t size;
     uint32_t rating;
     uint32_t type;
     uint32_t media_length;
     uint32_t media_bitrate;
-    uint16_t media_codec_len;
-    char media_codec[MAX_MCODEC_LEN + 1];
     unsigned char complete;
 };
 
+/* one key of batched sources lookup */
+struct source_query {
+    const unsigned char *hash;
+    /* array of file_source, or file_source_obfu if obfu is set */
+    void *sources;
+    /* maximum sources on input, found sources on output */
+    uint8_t count;
+    /* fill crypt options and user hash */
+    uint8_t obfu;
+};
+
 enum search_node_type {
     ST_EMPTY,
     // logical nodes
@@ -100,13 +114,51 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
 int db_remove_source(const struct client *owner);
 
 /**
+@param count maximum results on input, found results on output
+@param entry_ends buffer length after every written result (count entries), may be NULL
 @return non-zero on success
 */
-int db_search_files(struct search_node *root, struct evbuffer *buf, size_t *count);
+int db_search_files(struct search_node *root, struct evbuffer *buf, size_t *count, size_t *entry_ends);
 
 /**
 @return non-zero on success
 */
 int db_get_sources(const unsigned char *hash, struct file_source *out_sources, uint8_t *size);
 
+/**
+@brief looks up sources of several files, DB_SOURCES_BATCH keys per statement execution
+@return non-zero on success
+*/
+int db_get_sources_batch(struct source_query *queries, size_t count);
+
+/**
+@brief merges full-text index segments in small steps, queries run between steps; releases unused memory
+@return non-zero on success
+*/
+int db_optimize(void);
+
+/**
+@brief writes files and HighID sources to snapshot file, file is replaced only when fully written
+@return non-zero on success
+*/
+int db_snapshot_save(const char *path, size_t *file_count, size_t *source_count);
+
+/**
+@brief loads snapshot into just created database, sources are unconfirmed until offered again
+@return non-zero on success
+*/
+int db_snapshot_load(const char *path, size_t *file_count, size_t *source_count);
+
+/**
+@brief removes sources loaded from snapshot which were not offered again
+@param count removed sources
+@return non-zero on success
+*/
+int db_expire_unconfirmed(size_t *count);
+
+/**
+@return memory currently allocated by database engine (bytes)
+*/
+uint64_t db_memory_used(void);
+
 #endif // ED2KD_DB_H
@@ -1,22 +1,27 @@
 #include "db.h"
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <event2/util.h>
+#include <event2/buffer.h>
 
 #include "sqlite3/sqlite3.h"
 #include "ed2k_proto.h"
 #include "packet.h"
 #include "log.h"
 #include "client.h"
-
-static uint64_t sdbm(const unsigned char *str, size_t length)
-{
-    uint64_t hash = 0;
-    size_t i;
-
-    for (i = 0; i < length; ++i)
-        hash = (*str++) + (hash << 6) + (hash << 16) - hash;
-
-    return hash;
-}
+#include "metrics.h"
+#include "slowlog.h"
 
 #define DB_NAME                 "file:memdb?mode=memory&cache=shared"
 #define DB_OPEN_FLAGS           SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_SHAREDCACHE|SQLITE_OPEN_URI
@@ -24,17 +29,76 @@ static uint64_t sdbm(const unsigned char *str, size_t length)
 #define MAX_NAME_TERM_LEN       1024
 
 #define DB_CHECK(x)         if (!(x)) goto failed;
-#define MAKE_FID(x)         sdbm((x), 16)
-#define MAKE_SID(x)         ( ((uint64_t)(x)->id<<32) | (uint64_t)(x)->port )
+#define MAKE_FID(x)         (sqlite3_int64)hash_key64(x)
+// source id packs ed2k id, crypt options and port
+#define MAKE_SID(x)         ( ((uint64_t)(x)->id<<32) | ((uint64_t)SRC_CRYPT_FROM_CAPS((x)->tcp_flags)<<16) \
+                            | (uint64_t)(x)->port )
 #define GET_SID_ID(sid)     (uint32_t)((sid)>>32)
+#define GET_SID_CRYPT(sid)  (uint8_t)((sid)>>16)
 #define GET_SID_PORT(sid)   (uint16_t)(sid)
 
+#define SNAPSHOT_MAGIC      "ED2KSNAP"
+#define SNAPSHOT_VERSION    1
+/* rows per snapshot select, keeps table locks short */
+#define SNAPSHOT_CHUNK      4096
+#define IO_CHECK(x)         if (!(x)) goto io_failed;
+
+/*
+Snapshot file, host byte order:
+    snapshot_header
+    file_count of snapshot_file, each followed by name and media codec and padded to 8 bytes
+    source_count of snapshot_source
+crc is crc32 of everything after header. Rows are read in chunks while
+server is running, so snapshot is not point-in-time consistent.
+*/
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t crc;
+    /* unix time */
+    uint64_t created;
+    uint64_t file_count;
+    /* file records size */
+    uint64_t files_len;
+    uint64_t source_count;
+};
+
+struct snapshot_file {
+    unsigned char hash[ED2K_HASH_SIZE];
+    uint64_t size;
+    uint32_t type;
+    uint32_t media_length;
+    uint32_t media_bitrate;
+    uint16_t name_len;
+    uint16_t media_codec_len;
+};
+
+struct snapshot_source {
+    int64_t fid;
+    uint64_t sid;
+    unsigned char uhash[ED2K_HASH_SIZE];
+    uint8_t complete;
+    uint8_t rating;
+    uint8_t reserved[6];
+};
+
+_Static_assert(sizeof(struct snapshot_header) % 8 == 0 && sizeof(struct snapshot_file) % 8 == 0
+        && sizeof(struct snapshot_source) % 8 == 0, "snapshot records must keep 8 bytes alignment");
+
+struct snapshot_writer {
+    FILE *fp;
+    uLong crc;
+    uint64_t len;
+};
+
 enum query_statements {
     SHARE_UPD,
     SHARE_INS,
     SHARE_SRC,
     REMOVE_SRC,
     GET_SRC,
+    GET_SRC_BATCH,
+    CONFIRM_SRC,
     STMT_COUNT
 };
 
@@ -44,6 +108,22 @@ s_db;
 static THREAD_LOCAL sqlite3_stmt
 *s_stmt[STMT_COUNT];
 
+/* snapshot sources are waiting for confirmation */
+static atomic_uint32_t s_unconfirmed;
+
+_Static_assert(MH_DB_CONFIRM_SRC - MH_DB_SHARE_UPD + 1 == STMT_COUNT, "statement histograms mismatch");
+
+/* executes prepared statement which returns no rows */
+static int db_step(enum query_statements st)
+{
+    uint64_t start = metrics_now();
+    int err = sqlite3_step(s_stmt[st]);
+
+    metrics_record_since(MH_DB_SHARE_UPD + st, start);
+
+    return err;
+}
+
 int db_create(void)
 {
     static const char query[] =
@@ -73,8 +153,11 @@ int db_create(void)
                     "CREATE TABLE IF NOT EXISTS sources ("
                     "   fid INTEGER NOT NULL,"
                     "   sid INTEGER NOT NULL,"
+                    "   uhash BLOB NOT NULL,"
                     "   complete INTEGER,"
-                    "   rating INTEGER"
+                    "   rating INTEGER,"
+                    // loaded from snapshot and not offered again yet
+                    "   confirmed INTEGER DEFAULT 1"
                     ");"
                     "CREATE INDEX IF NOT EXISTS sources_fid_i"
                     "   ON sources(fid);"
@@ -149,16 +232,25 @@ int db_open(void)
     const char *tail;
 
     static const char query_share_upd[] =
-            "UPDATE files SET name=?,ext=?,size=?,type=?,mlength=?,mbitrate=?,mcodec=? WHERE fid=?";
+            "UPDATE files SET name=?,ext=?,size=?,type=?,mlength=?,mbitrate=?,mcodec=? WHERE fid=? AND hash=?";
     static const char query_share_ins[] =
-            "INSERT OR REPLACE INTO files(fid,hash,name,ext,size,type,mlength,mbitrate,mcodec) "
+            "INSERT OR IGNORE INTO files(fid,hash,name,ext,size,type,mlength,mbitrate,mcodec) "
                     "   VALUES(?,?,?,?,?,?,?,?,?)";
     static const char query_share_src[] =
-            "INSERT INTO sources(fid,sid,complete,rating) VALUES(?,?,?,?)";
+            "INSERT INTO sources(fid,sid,uhash,complete,rating) VALUES(?,?,?,?,?)";
     static const char query_remove_src[] =
             "DELETE FROM sources WHERE sid=?";
     static const char query_get_src[] =
-            "SELECT sid FROM sources WHERE fid=? LIMIT ?";
+            "SELECT sid FROM sources WHERE fid=(SELECT fid FROM files WHERE fid=? AND hash=?) LIMIT ?";
+    // sources per file are limited by correlated subquery, so popular files are not scanned
+    static const char query_get_src_batch[] =
+            "SELECT f.fid,f.hash,s.sid,s.uhash FROM files f CROSS JOIN sources s"
+                    "   WHERE f.fid IN (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)"
+                    "   AND s.rowid IN (SELECT rowid FROM sources WHERE fid=f.fid LIMIT ?)";
+    static const char query_confirm_src[] =
+            "UPDATE sources SET confirmed=1 WHERE sid=? AND fid=? AND confirmed=0";
+
+    _Static_assert(DB_SOURCES_BATCH == 16, "query_get_src_batch placeholders mismatch");
 
     err = sqlite3_open_v2(DB_NAME, &s_db, DB_OPEN_FLAGS, NULL);
     if (SQLITE_OK != err) {
@@ -171,6 +263,10 @@ int db_open(void)
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_share_src, sizeof(query_share_src), &s_stmt[SHARE_SRC], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_remove_src, sizeof(query_remove_src), &s_stmt[REMOVE_SRC], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_src, sizeof(query_get_src), &s_stmt[GET_SRC], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_src_batch, sizeof(query_get_src_batch),
+            &s_stmt[GET_SRC_BATCH], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_confirm_src, sizeof(query_confirm_src), &s_stmt[CONFIRM_SRC],
+            &tail));
 
     return 1;
 
@@ -198,6 +294,9 @@ int db_close(void)
 
 int db_share_files(const struct pub_file *files, size_t count, const struct client *owner)
 {
+    uint64_t start = metrics_now(), elapsed;
+    size_t total = count;
+
     /* todo: do it in transaction */
 
     while (count-- > 0) {
@@ -232,7 +331,8 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
         DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->media_bitrate));
         DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, i++, files->media_codec, files->media_codec_len, SQLITE_STATIC));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, fid));
-        DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_blob(stmt, i++, files->hash, sizeof(files->hash), SQLITE_STATIC));
+        DB_CHECK(SQLITE_DONE == db_step(SHARE_UPD));
 
         if (!sqlite3_changes(s_db)) {
             i = 1;
@@ -247,7 +347,27 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
             DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->media_length));
             DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->media_bitrate));
             DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, i++, files->media_codec, files->media_codec_len, SQLITE_STATIC));
-            DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+            DB_CHECK(SQLITE_DONE == db_step(SHARE_INS));
+
+            // same fid, but different hash
+            if (!sqlite3_changes(s_db)) {
+                ED2KD_LOGWRN("file id collision, file ignored (fid:%" PRIx64 ")", fid);
+                files++;
+                continue;
+            }
+        }
+
+        // source loaded from snapshot is kept instead of added again
+        if (atomic_load_explicit(&s_unconfirmed, memory_order_relaxed)) {
+            stmt = s_stmt[CONFIRM_SRC];
+            DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+            DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_SID(owner)));
+            DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 2, fid));
+            DB_CHECK(SQLITE_DONE == db_step(CONFIRM_SRC));
+            if (sqlite3_changes(s_db)) {
+                files++;
+                continue;
+            }
         }
 
         i = 1;
@@ -255,13 +375,22 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
         DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, fid));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, MAKE_SID(owner)));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_blob(stmt, i++, owner->hash, sizeof(owner->hash), SQLITE_STATIC));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->complete));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->rating));
-        DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+        DB_CHECK(SQLITE_DONE == db_step(SHARE_SRC));
 
         files++;
     }
 
+    elapsed = metrics_now() - start;
+    if (slowlog_is_slow(elapsed)) {
+        char ip_str[INET_ADDRSTRLEN];
+        evutil_inet_ntop(AF_INET, &owner->ip, ip_str, sizeof(ip_str));
+        slowlog_write("share %" PRIu64 "ms files %zu client id %u addr %s:%u nick \"%s\"", elapsed / 1000000,
+                total, owner->id, ip_str, owner->port, owner->nick ? owner->nick : "");
+    }
+
     return 1;
 
     failed:
@@ -275,7 +404,7 @@ int db_remove_source(const struct client *clnt)
 
     DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
     DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_SID(clnt)));
-    DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+    DB_CHECK(SQLITE_DONE == db_step(REMOVE_SRC));
     return 1;
 
     failed:
@@ -283,9 +412,9 @@ int db_remove_source(const struct client *clnt)
     return 0;
 }
 
-int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *count)
+int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *count, size_t *entry_ends)
 {
-    int err;
+    int err, truncated = 0;
     const char *tail;
     sqlite3_stmt *stmt = 0;
     size_t i;
@@ -302,6 +431,7 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
         struct search_node *codec_node;
         struct search_node *type_node;
     } params;
+    uint64_t start = metrics_now(), prepared, end;
     char query[MAX_SEARCH_QUERY_LEN + 1] =
             " SELECT f.hash,f.name,f.size,f.type,f.ext,f.srcavail,f.srccomplete,f.rating,f.rated_count,"
                     "  (SELECT sid FROM sources WHERE fid=f.fid LIMIT 1) AS sid,"
@@ -463,6 +593,8 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
 
     DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, *count));
 
+    prepared = metrics_now();
+
     i = 0;
     while (((err = sqlite3_step(stmt)) == SQLITE_ROW) && (i < *count)) {
         struct search_file sfile;
@@ -500,12 +632,64 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
         sfile.media_codec_len = sfile.media_codec_len > MAX_FILEEXT_LEN ? MAX_FILEEXT_LEN : sfile.media_codec_len;
         sfile.media_codec = (const char *) sqlite3_column_text(stmt, col++);
 
-        write_search_file(buf, &sfile);
+        // out of buffer space: return what is already encoded, count must match entries
+        if (!write_search_file(buf, &sfile)) {
+            truncated = 1;
+            break;
+        }
+        if (entry_ends)
+            entry_ends[i] = evbuffer_get_length(buf);
 
         ++i;
     }
 
-    DB_CHECK((i == *count) || (SQLITE_DONE == err));
+    DB_CHECK(truncated || (i == *count) || (SQLITE_DONE == err));
+
+    end = metrics_now();
+    metrics_record(MH_DB_SEARCH, end - start);
+
+    if (slowlog_is_slow(end - start)) {
+        const struct {
+            const char *name;
+            uint64_t val;
+        } nums[] = {
+                {"minsize", params.minsize},
+                {"maxsize", params.maxsize},
+                {"srcavail", params.srcavail},
+                {"srccomplete", params.srccomplete},
+                {"minbitrate", params.minbitrate},
+                {"minlength", params.minlength}
+        };
+        const struct {
+            const char *name;
+            const struct search_node *node;
+        } strs[] = {
+                {"ext", params.ext_node},
+                {"codec", params.codec_node},
+                {"type", params.type_node}
+        };
+        char filters[256];
+        size_t len = 0, n;
+
+        filters[0] = '\0';
+        for (n = 0; n < ARRAY_SIZE(strs) && len < sizeof(filters); ++n) {
+            if (strs[n].node)
+                len += evutil_snprintf(filters + len, sizeof(filters) - len, " %s=%.*s", strs[n].name,
+                        (int) strs[n].node->str_len, strs[n].node->str_val);
+        }
+        for (n = 0; n < ARRAY_SIZE(nums) && len < sizeof(filters); ++n) {
+            if (nums[n].val)
+                len += evutil_snprintf(filters + len, sizeof(filters) - len, " %s=%" PRIu64, nums[n].name,
+                        nums[n].val);
+        }
+
+        slowlog_write("search %" PRIu64 "ms (prepare %" PRIu64 "us, step %" PRIu64 "us) rows %zu vm_steps %d "
+                "fullscan_steps %d term \"%s\"%s", (end - start) / 1000000, (prepared - start) / 1000,
+                (end - prepared) / 1000, i, sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0),
+                sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0), params.name_term, filters);
+    }
+
+    sqlite3_finalize(stmt);
 
     *count = i;
     return 1;
@@ -520,12 +704,14 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
 int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8_t *count)
 {
     sqlite3_stmt *stmt = s_stmt[GET_SRC];
+    uint64_t start = metrics_now();
     uint8_t i;
     int err;
 
     DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
     DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_FID(hash)));
-    DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, *count));
+    DB_CHECK(SQLITE_OK == sqlite3_bind_blob(stmt, 2, hash, ED2K_HASH_SIZE, SQLITE_STATIC));
+    DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 3, *count));
 
     i = 0;
     while (((err = sqlite3_step(stmt)) == SQLITE_ROW) && (i < *count)) {
@@ -537,6 +723,8 @@ int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8
 
     DB_CHECK((i == *count) || (SQLITE_DONE == err));
 
+    metrics_record_since(MH_DB_GET_SRC, start);
+
     *count = i;
     return 1;
 
@@ -544,3 +732,442 @@ int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8
     ED2KD_LOGERR("failed to get sources from db (%s)", sqlite3_errmsg(s_db));
     return 0;
 }
+
+int db_get_sources_batch(struct source_query *queries, size_t count)
+{
+    sqlite3_stmt *stmt = s_stmt[GET_SRC_BATCH];
+
+    while (count) {
+        size_t i, n = count < DB_SOURCES_BATCH ? count : DB_SOURCES_BATCH;
+        sqlite3_int64 fids[DB_SOURCES_BATCH];
+        uint8_t found[DB_SOURCES_BATCH] = {0};
+        uint8_t limit = 0;
+        uint64_t start = metrics_now();
+        int err;
+
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        for (i = 0; i < DB_SOURCES_BATCH; ++i) {
+            if (i < n) {
+                fids[i] = MAKE_FID(queries[i].hash);
+                if (queries[i].count > limit)
+                    limit = queries[i].count;
+                DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i + 1, fids[i]));
+            } else {
+                // NULL never matches
+                DB_CHECK(SQLITE_OK == sqlite3_bind_null(stmt, i + 1));
+            }
+        }
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, DB_SOURCES_BATCH + 1, limit));
+
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+            sqlite3_int64 fid = sqlite3_column_int64(stmt, 0);
+            const void *hash = sqlite3_column_blob(stmt, 1);
+            uint64_t sid = sqlite3_column_int64(stmt, 2);
+
+            // same file may be requested more than once
+            for (i = 0; i < n; ++i) {
+                struct source_query *q = &queries[i];
+                if (fids[i] != fid || found[i] >= q->count || memcmp(hash, q->hash, ED2K_HASH_SIZE) != 0)
+                    continue;
+                if (q->obfu) {
+                    struct file_source_obfu *src = (struct file_source_obfu *) q->sources + found[i];
+                    src->ip = GET_SID_ID(sid);
+                    src->port = GET_SID_PORT(sid);
+                    src->crypt_opts = GET_SID_CRYPT(sid);
+                    // peer needs user hash to open obfuscated connection
+                    if (src->crypt_opts & SRC_CRYPT_SUPPORTED) {
+                        src->crypt_opts |= SRC_CRYPT_HASH;
+                        memcpy(src->hash, sqlite3_column_blob(stmt, 3), sizeof(src->hash));
+                    }
+                } else {
+                    struct file_source *src = (struct file_source *) q->sources + found[i];
+                    src->ip = GET_SID_ID(sid);
+                    src->port = GET_SID_PORT(sid);
+                }
+                found[i]++;
+            }
+        }
+        DB_CHECK(SQLITE_DONE == err);
+
+        metrics_record_since(MH_DB_GET_SRC_BATCH, start);
+
+        for (i = 0; i < n; ++i) {
+            queries[i].count = found[i];
+        }
+
+        queries += n;
+        count -= n;
+    }
+
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed to get sources from db (%s)", sqlite3_errmsg(s_db));
+    return 0;
+}
+
+int db_optimize(void)
+{
+    // fts4 incremental merge: each step writes at most 64 pages and releases table locks,
+    // single 'optimize' would stall every worker query until whole index is rewritten
+    static const char query[] =
+            "INSERT INTO fnames(fnames) VALUES('merge=64,2');";
+    sqlite3_stmt *stmt = 0;
+    const char *tail;
+    size_t steps = 0;
+    int err, changes;
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query, sizeof(query), &stmt, &tail));
+
+    for (; ;) {
+        changes = sqlite3_total_changes(s_db);
+        err = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        // shared cache table is read by worker, step is retried
+        if (SQLITE_LOCKED != err) {
+            DB_CHECK(SQLITE_DONE == err);
+            ++steps;
+            // less than two changes: nothing left to merge
+            if (sqlite3_total_changes(s_db) - changes < 2)
+                break;
+        }
+
+        // let workers waiting on fnames/files run between steps
+        sched_yield();
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_db_release_memory(s_db);
+    ED2KD_LOGDBG("db optimized in %zu merge steps", steps);
+    return 1;
+
+    failed:
+    if (stmt) sqlite3_finalize(stmt);
+    ED2KD_LOGERR("failed to optimize db (%s)", sqlite3_errmsg(s_db));
+    return 0;
+}
+
+static int snapshot_write(struct snapshot_writer *w, const void *data, size_t len)
+{
+    if (!len)
+        return 1;
+
+    w->crc = crc32(w->crc, (const Bytef *) data, len);
+    w->len += len;
+
+    return fwrite(data, 1, len, w->fp) == len;
+}
+
+int db_snapshot_save(const char *path, size_t *file_count, size_t *source_count)
+{
+    static const char query_files[] =
+            "SELECT fid,hash,name,size,type,mlength,mbitrate,mcodec FROM files WHERE fid>=? ORDER BY fid LIMIT ?";
+    static const char query_sources[] =
+            "SELECT rowid,fid,sid,uhash,complete,rating FROM sources WHERE rowid>? ORDER BY rowid LIMIT ?";
+    static const unsigned char pad[8];
+    char tmp_path[PATH_MAX];
+    struct snapshot_header hdr;
+    struct snapshot_writer w;
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 next = INT64_MIN;
+    size_t rows;
+    int err;
+
+    evutil_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    w.fp = fopen(tmp_path, "wb");
+    if (!w.fp) {
+        ED2KD_LOGERR("failed to create snapshot %s (%s)", tmp_path, strerror(errno));
+        return 0;
+    }
+    w.crc = crc32(0, NULL, 0);
+    w.len = 0;
+
+    // header is written when counts are known
+    memset(&hdr, 0, sizeof(hdr));
+    IO_CHECK(fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1);
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_files, sizeof(query_files), &stmt, NULL));
+    do {
+        rows = 0;
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, next));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, SNAPSHOT_CHUNK));
+
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+            struct snapshot_file file;
+            sqlite3_int64 fid = sqlite3_column_int64(stmt, 0);
+            const unsigned char *name = sqlite3_column_text(stmt, 2);
+            const unsigned char *codec = sqlite3_column_text(stmt, 7);
+            size_t len;
+
+            rows++;
+            next = fid + 1;
+            if (sqlite3_column_bytes(stmt, 1) != ED2K_HASH_SIZE)
+                continue;
+
+            memset(&file, 0, sizeof(file));
+            memcpy(file.hash, sqlite3_column_blob(stmt, 1), sizeof(file.hash));
+            file.size = sqlite3_column_int64(stmt, 3);
+            file.type = sqlite3_column_int(stmt, 4);
+            file.media_length = sqlite3_column_int(stmt, 5);
+            file.media_bitrate = sqlite3_column_int(stmt, 6);
+            file.name_len = sqlite3_column_bytes(stmt, 2);
+            file.media_codec_len = sqlite3_column_bytes(stmt, 7);
+            len = sizeof(file) + file.name_len + file.media_codec_len;
+
+            IO_CHECK(snapshot_write(&w, &file, sizeof(file)) && snapshot_write(&w, name, file.name_len)
+                    && snapshot_write(&w, codec, file.media_codec_len) && snapshot_write(&w, pad, -len & 7));
+            hdr.file_count++;
+
+            // INT64_MAX + 1 would wrap to the first chunk
+            if (INT64_MAX == fid)
+                rows = 0;
+        }
+        DB_CHECK(SQLITE_DONE == err);
+    } while (SNAPSHOT_CHUNK == rows);
+    sqlite3_finalize(stmt);
+    hdr.files_len = w.len;
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_sources, sizeof(query_sources), &stmt, NULL));
+    next = 0;
+    do {
+        rows = 0;
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, next));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, SNAPSHOT_CHUNK));
+
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+            struct snapshot_source src;
+            uint64_t sid = sqlite3_column_int64(stmt, 2);
+
+            rows++;
+            next = sqlite3_column_int64(stmt, 0);
+            // lowids are given out again after restart
+            if (GET_SID_ID(sid) < MAX_LOWID || sqlite3_column_bytes(stmt, 3) != ED2K_HASH_SIZE)
+                continue;
+
+            memset(&src, 0, sizeof(src));
+            src.fid = sqlite3_column_int64(stmt, 1);
+            src.sid = sid;
+            memcpy(src.uhash, sqlite3_column_blob(stmt, 3), sizeof(src.uhash));
+            src.complete = sqlite3_column_int(stmt, 4);
+            src.rating = sqlite3_column_int(stmt, 5);
+
+            IO_CHECK(snapshot_write(&w, &src, sizeof(src)));
+            hdr.source_count++;
+        }
+        DB_CHECK(SQLITE_DONE == err);
+    } while (SNAPSHOT_CHUNK == rows);
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.crc = w.crc;
+    hdr.created = time(NULL);
+    IO_CHECK(0 == fseek(w.fp, 0, SEEK_SET));
+    IO_CHECK(fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1);
+    IO_CHECK(0 == fflush(w.fp) && 0 == fsync(fileno(w.fp)));
+    IO_CHECK(0 == fclose(w.fp));
+    w.fp = NULL;
+    IO_CHECK(0 == rename(tmp_path, path));
+
+    *file_count = hdr.file_count;
+    *source_count = hdr.source_count;
+
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed to read db for snapshot (%s)", sqlite3_errmsg(s_db));
+    goto cleanup;
+
+    io_failed:
+    ED2KD_LOGERR("failed to write snapshot %s (%s)", tmp_path, strerror(errno));
+
+    cleanup:
+    if (stmt)
+        sqlite3_finalize(stmt);
+    if (w.fp)
+        fclose(w.fp);
+    unlink(tmp_path);
+    return 0;
+}
+
+/* validates snapshot header and checksum */
+static int snapshot_check(const unsigned char *data, size_t len)
+{
+    const struct snapshot_header *hdr = (const struct snapshot_header *) data;
+    uLong crc = crc32(0, NULL, 0);
+    size_t off;
+
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0
+            || SNAPSHOT_VERSION != hdr->version || hdr->files_len > len - sizeof(*hdr)
+            || hdr->source_count != (len - sizeof(*hdr) - hdr->files_len) / sizeof(struct snapshot_source)
+            || (len - sizeof(*hdr) - hdr->files_len) % sizeof(struct snapshot_source))
+        return 0;
+
+    // crc32() takes 32-bit lengths
+    for (off = sizeof(*hdr); off < len; off += 1u << 30) {
+        size_t chunk = len - off < (1u << 30) ? len - off : (1u << 30);
+        crc = crc32(crc, data + off, chunk);
+    }
+
+    return hdr->crc == crc;
+}
+
+/* journal is off and ROLLBACK can't undo inserts, so loaded rows are deleted */
+static void snapshot_discard(void)
+{
+    static const char query[] =
+            "DELETE FROM sources;"
+                    "DELETE FROM files;"
+                    "DELETE FROM fnames;";
+
+    if (SQLITE_OK != sqlite3_exec(s_db, query, NULL, NULL, NULL))
+        ED2KD_LOGERR("failed to discard partially loaded snapshot (%s)", sqlite3_errmsg(s_db));
+    if (!sqlite3_get_autocommit(s_db))
+        sqlite3_exec(s_db, "COMMIT", NULL, NULL, NULL);
+}
+
+int db_snapshot_load(const char *path, size_t *file_count, size_t *source_count)
+{
+    static const char query_file[] =
+            "INSERT OR IGNORE INTO files(fid,hash,name,ext,size,type,mlength,mbitrate,mcodec) "
+                    "   VALUES(?,?,?,?,?,?,?,?,?)";
+    static const char query_source[] =
+            "INSERT INTO sources(fid,sid,uhash,complete,rating,confirmed) VALUES(?,?,?,?,?,0)";
+    // files and sources are read at different moments, each may miss the other
+    static const char query_cleanup[] =
+            "DELETE FROM sources WHERE fid NOT IN (SELECT fid FROM files);"
+                    "DELETE FROM files WHERE srcavail=0;"
+                    "COMMIT;";
+    const struct snapshot_header *hdr;
+    const struct snapshot_source *src;
+    const unsigned char *data, *p, *files_end;
+    sqlite3_stmt *stmt = NULL;
+    struct stat st;
+    size_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (ENOENT != errno)
+            ED2KD_LOGERR("failed to open snapshot %s (%s)", path, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || !st.st_size
+            || MAP_FAILED == (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+        ED2KD_LOGERR("failed to map snapshot %s (%s)", path, st.st_size ? strerror(errno) : "empty");
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+
+    if (!snapshot_check(data, st.st_size)) {
+        ED2KD_LOGERR("snapshot %s is corrupted", path);
+        munmap((void *) data, st.st_size);
+        return 0;
+    }
+
+    hdr = (const struct snapshot_header *) data;
+    p = data + sizeof(*hdr);
+    files_end = p + hdr->files_len;
+
+    DB_CHECK(SQLITE_OK == sqlite3_exec(s_db, "BEGIN", NULL, NULL, NULL));
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_file, sizeof(query_file), &stmt, NULL));
+    for (i = 0; i < hdr->file_count; ++i) {
+        const struct snapshot_file *file = (const struct snapshot_file *) p;
+        const char *name, *ext;
+        size_t len;
+
+        if ((size_t) (files_end - p) < sizeof(*file))
+            break;
+        len = (sizeof(*file) + file->name_len + file->media_codec_len + 7) & ~(size_t) 7;
+        if ((size_t) (files_end - p) < len)
+            break;
+
+        name = (const char *) (file + 1);
+        ext = file_extension(name, file->name_len);
+
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_FID(file->hash)));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_blob(stmt, 2, file->hash, sizeof(file->hash), SQLITE_STATIC));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, 3, name, file->name_len, SQLITE_STATIC));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, 4, ext, ext ? name + file->name_len - ext : 0, SQLITE_STATIC));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 5, file->size));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 6, file->type));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 7, file->media_length));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 8, file->media_bitrate));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, 9, name + file->name_len, file->media_codec_len, SQLITE_STATIC));
+        DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+
+        p += len;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (i != hdr->file_count || p != files_end) {
+        ED2KD_LOGERR("snapshot %s has malformed file records", path);
+        snapshot_discard();
+        munmap((void *) data, st.st_size);
+        return 0;
+    }
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_source, sizeof(query_source), &stmt, NULL));
+    src = (const struct snapshot_source *) files_end;
+    for (i = 0; i < hdr->source_count; ++i, ++src) {
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, src->fid));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 2, src->sid));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_blob(stmt, 3, src->uhash, sizeof(src->uhash), SQLITE_STATIC));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 4, src->complete));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 5, src->rating));
+        DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    DB_CHECK(SQLITE_OK == sqlite3_exec(s_db, query_cleanup, NULL, NULL, NULL));
+
+    atomic_store(&s_unconfirmed, hdr->source_count > 0);
+    *file_count = hdr->file_count;
+    *source_count = hdr->source_count;
+    munmap((void *) data, st.st_size);
+
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed to load snapshot %s (%s)", path, sqlite3_errmsg(s_db));
+    if (stmt)
+        sqlite3_finalize(stmt);
+    snapshot_discard();
+    munmap((void *) data, st.st_size);
+    return 0;
+}
+
+int db_expire_unconfirmed(size_t *count)
+{
+    static const char query[] =
+            "DELETE FROM sources WHERE confirmed=0";
+
+    *count = 0;
+    if (!atomic_load(&s_unconfirmed))
+        return 1;
+
+    DB_CHECK(SQLITE_OK == sqlite3_exec(s_db, query, NULL, NULL, NULL));
+    *count = sqlite3_changes(s_db);
+    atomic_store(&s_unconfirmed, 0);
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed to expire snapshot sources (%s)", sqlite3_errmsg(s_db));
+    return 0;
+}
+
+uint64_t db_memory_used(void)
+{
+    return (uint64_t) sqlite3_memory_used();
+}
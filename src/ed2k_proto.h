@@ -20,6 +20,11 @@
 #define SRV_TCPFLG_LARGEFILES        0x00000100
 #define SRV_TCPFLG_TCPOBFUSCATION    0x00000400
 
+// server UDP flags
+#define SRV_UDPFLG_EXT_GETSOURCES   0x00000001
+#define SRV_UDPFLG_EXT_GETSOURCES2  0x00000020
+#define SRV_UDPFLG_LARGEFILES       0x00000100
+
 // capabilities, values for TN_SERVER_FLAGS
 enum client_caps {
     CLI_CAP_ZLIB = 0x0001,
@@ -55,17 +60,17 @@ enum packet_opcode {
     // //v2 <HASH 16><SIZE_4> (17.3) (mandatory on 17.8)
     // //v2large <HASH 16><FILESIZE 4(0)><FILESIZE 8> (17.9) (large files only)
     //OP_SEARCH_USER			= 0x1A,	//
-            OP_CALLBACKREQUEST = 0x1C,    //
+            OP_CALLBACKREQUEST = 0x1C,    // <id4>
     //OP_QUERY_CHATS                = 0x1D,	//
     //OP_CHAT_MESSAGE               = 0x1E,	//
     //OP_JOIN_ROOM                  = 0x1F,	//
             OP_QUERY_MORE_RESULT = 0x21,    // empty
-    OP_GETSOURCES_OBFU = 0x23, //
-    //OP_SERVERLIST                 = 0x32,	//
+    OP_GETSOURCES_OBFU = 0x23, // same as OP_GETSOURCES
+    OP_SERVERLIST = 0x32, // <count1>(<ip4><port2>)[count]
             OP_SEARCHRESULT = 0x33,    // <count4>[<hash16><id4><port2><tag_count4>[tags...]...]
     OP_SERVERSTATUS = 0x34, // <users_count4><files_count4>
-    //OP_CALLBACKREQUESTED		= 0x35,	//
-            OP_CALLBACK_FAIL = 0x36,    //
+    OP_CALLBACKREQUESTED = 0x35, // <ip4><port2>
+    OP_CALLBACK_FAIL = 0x36,    //
     OP_SERVERMESSAGE = 0x38, // <msg_len2><message>
     //OP_CHAT_ROOM_REQUEST		= 0x39,	//
     //OP_CHAT_BROADCAST             = 0x3A,	//
@@ -74,9 +79,31 @@ enum packet_opcode {
     //OP_CHAT_USER                  = 0x3D,	//
             OP_IDCHANGE = 0x40, // <id4>
     OP_SERVERIDENT = 0x41, // <hash16><ip4><port2><tag_count4>[tags...]
-    OP_FOUNDSOURCES = 0x42  // <HASH 16><count 1>(<ID 4><PORT 2>)[count]
+    OP_FOUNDSOURCES = 0x42,  // <HASH 16><count 1>(<ID 4><PORT 2>)[count]
     //OP_USERS_LIST                 = 0x43,
-    //OP_FOUNDSOURCES_OBFU          = 0x44
+    OP_FOUNDSOURCES_OBFU = 0x44 // <HASH 16><count 1>(<ID 4><PORT 2><crypt_opts 1>[<user_hash 16>])[count]
+};
+
+// OP_FOUNDSOURCES_OBFU source crypt options
+#define SRC_CRYPT_SUPPORTED 0x01
+#define SRC_CRYPT_REQUESTED 0x02
+#define SRC_CRYPT_REQUIRED  0x04
+// user hash follows
+#define SRC_CRYPT_HASH      0x80
+
+// client_caps crypt bits to crypt options
+#define SRC_CRYPT_FROM_CAPS(caps) \
+        (((caps) & (CLI_CAP_SUPPORTCRYPT | CLI_CAP_REQUESTCRYPT | CLI_CAP_REQUIRECRYPT)) >> 9)
+
+enum packet_udp_opcode {
+    OP_GLOBSEARCHREQ2 = 0x92, // <query_tree>
+    OP_GLOBGETSOURCES2 = 0x94, // (<hash16><size4>)[...], large files: (<hash16><0 4><size8>)
+    OP_GLOBSERVSTATREQ = 0x96, // <challenge4>
+    OP_GLOBSERVSTATRES = 0x97, // <challenge4><users4><files4><max_users4><soft_files4><hard_files4><udp_flags4><lowid_users4>
+    OP_GLOBSEARCHREQ = 0x98, // <query_tree>
+    OP_GLOBSEARCHRES = 0x99, // <hash16><id4><port2><tag_count4>[tags...]
+    OP_GLOBGETSOURCES = 0x9A, // <hash16>[...]
+    OP_GLOBFOUNDSOURCES = 0x9B // <hash16><count1>(<ID 4><PORT 2>)[count]
 };
 
 struct file_source {
@@ -84,6 +111,14 @@ struct file_source {
     uint16_t port;
 } __attribute__((__packed__));
 
+/* OP_FOUNDSOURCES_OBFU source, hash is sent only with SRC_CRYPT_HASH */
+struct file_source_obfu {
+    uint32_t ip;
+    uint16_t port;
+    uint8_t crypt_opts;
+    unsigned char hash[ED2K_HASH_SIZE];
+} __attribute__((__packed__));
+
 struct packet_header {
     uint8_t proto;
     uint32_t length;
@@ -118,6 +153,13 @@ struct packet_server_ident {
     uint32_t tag_count;
 } __attribute__((__packed__));
 
+struct packet_callback_requested {
+    struct packet_header hdr;
+    uint8_t opcode;
+    uint32_t ip;
+    uint16_t port;
+} __attribute__((__packed__));
+
 struct packet_search_result {
     struct packet_header hdr;
     uint8_t opcode;
@@ -138,6 +180,47 @@ struct packet_found_sources {
     uint8_t count;
 } __attribute__((__packed__));
 
+/* OP_SERVERLIST entry */
+struct server_entry {
+    uint32_t ip;
+    uint16_t port;
+} __attribute__((__packed__));
+
+struct packet_server_list {
+    struct packet_header hdr;
+    uint8_t opcode;
+    uint8_t count;
+} __attribute__((__packed__));
+
+/* udp packets have no length field */
+struct udp_header {
+    uint8_t proto;
+    uint8_t opcode;
+} __attribute__((__packed__));
+
+struct udp_found_sources {
+    struct udp_header hdr;
+    unsigned char hash[ED2K_HASH_SIZE];
+    uint8_t count;
+} __attribute__((__packed__));
+
+struct udp_server_status_req {
+    struct udp_header hdr;
+    uint32_t challenge;
+} __attribute__((__packed__));
+
+struct udp_server_status {
+    struct udp_header hdr;
+    uint32_t challenge;
+    uint32_t user_count;
+    uint32_t file_count;
+    uint32_t max_users;
+    uint32_t soft_files;
+    uint32_t hard_files;
+    uint32_t udp_flags;
+    uint32_t lowid_users;
+} __attribute__((__packed__));
+
 struct packet_hello {
     struct packet_header hdr;
     uint8_t opcode;
@@ -182,13 +265,13 @@ enum tag_type {
     TT_STRING = 0x02,
     TT_UINT32 = 0x03,
     TT_FLOAT32 = 0x04,
-    //TAGTYPE_BOOL		= 0x05,
+    TT_BOOL = 0x05,
     //TAGTYPE_BOOLARRAY	= 0x06,
-    //TAGTYPE_BLOB		= 0x07,
-            TT_UINT16 = 0x08,
+    TT_BLOB = 0x07,
+    TT_UINT16 = 0x08,
     TT_UINT8 = 0x09,
-    //TAGTYPE_BSOB		= 0x0A,
-            TT_UINT64 = 0x0B,
+    TT_BSOB = 0x0A,
+    TT_UINT64 = 0x0B,
 
     // Compressed string types
             TT_STR1 = 0x11,
@@ -226,13 +309,19 @@ enum tag_name {
     TN_COMPLETE_SOURCES = 0x30,
     TN_FILESIZE_HI = 0x3A,
     TN_FILERATING = 0xF7,
+    TN_MEDIA_LENGTH = 0xD3,
+    TN_MEDIA_BITRATE = 0xD4,
+    TN_MEDIA_CODEC = 0xD5,
 
     // OP_SERVERIDENT
             TN_SERVERNAME = 0x01,
     TN_DESCRIPTION = 0x0B
 };
 
-// string tag names
+// new-style tags flag (tag type), followed by 1-byte integer name
+#define TT_NEWTAG_FLAG 0x80
+
+// string tag names (old clients), aliases of TN_MEDIA_*
 #define    TNS_MEDIA_LENGTH    "length"
 #define    TNS_MEDIA_BITRATE    "bitrate"
 #define    TNS_MEDIA_CODEC        "codec"
@@ -0,0 +1,96 @@
+#include "hashset.h"
+#include <stdlib.h>
+
+#include "ed2k_proto.h"
+#include "util.h"
+
+#define HASHSET_MIN_CAPACITY 16
+
+static const unsigned char s_zero_hash[ED2K_HASH_SIZE];
+
+static inline int is_zero_hash(const unsigned char *hash)
+{
+    return hash_equal(hash, s_zero_hash);
+}
+
+/* linear probing, returns slot with given hash or first empty one */
+static unsigned char *find_slot(unsigned char *slots, uint32_t capacity, const unsigned char *hash)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t) hash_key64(hash) & mask;
+
+    for (; ;) {
+        unsigned char *slot = slots + (size_t) i * ED2K_HASH_SIZE;
+        if (hash_equal(slot, hash) || is_zero_hash(slot))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static int grow(struct hashset *set)
+{
+    uint32_t i, capacity = set->capacity ? set->capacity * 2 : HASHSET_MIN_CAPACITY;
+    unsigned char *slots = (unsigned char *) calloc(capacity, ED2K_HASH_SIZE);
+
+    if (!slots)
+        return 0;
+
+    for (i = 0; i < set->capacity; ++i) {
+        const unsigned char *old = set->slots + (size_t) i * ED2K_HASH_SIZE;
+        if (!is_zero_hash(old))
+            memcpy(find_slot(slots, capacity, old), old, ED2K_HASH_SIZE);
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+
+    return 1;
+}
+
+int hashset_add(struct hashset *set, const unsigned char *hash)
+{
+    unsigned char *slot;
+
+    if (is_zero_hash(hash)) {
+        if (set->has_zero)
+            return 0;
+        set->has_zero = 1;
+        return 1;
+    }
+
+    // keep load factor below 3/4
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+        if (!grow(set))
+            return -1;
+    }
+
+    slot = find_slot(set->slots, set->capacity, hash);
+    if (!is_zero_hash(slot))
+        return 0;
+
+    memcpy(slot, hash, ED2K_HASH_SIZE);
+    set->count++;
+
+    return 1;
+}
+
+int hashset_contains(const struct hashset *set, const unsigned char *hash)
+{
+    if (is_zero_hash(hash))
+        return set->has_zero;
+
+    if (!set->capacity)
+        return 0;
+
+    return !is_zero_hash(find_slot(set->slots, set->capacity, hash));
+}
+
+void hashset_free(struct hashset *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    set->has_zero = 0;
+}
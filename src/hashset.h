@@ -0,0 +1,47 @@
+#ifndef ED2KD_HASHSET_H
+#define ED2KD_HASHSET_H
+
+/**
+@file hashset.h open addressing set of ed2k hashes
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ed2k_proto.h"
+
+struct hashset {
+    /* slots array, capacity * ED2K_HASH_SIZE bytes, zero hash marks empty slot */
+    unsigned char *slots;
+    /* slots count, power of 2 */
+    uint32_t capacity;
+    /* stored hashes count (except zero hash) */
+    uint32_t count;
+    /* zero hash stored flag */
+    unsigned has_zero:1;
+};
+
+/**
+@brief adds hash to set, set must be zero-initialized before first use
+@return 1 if hash added, 0 if already present, -1 on allocation failure
+*/
+int hashset_add(struct hashset *set, const unsigned char *hash);
+
+/**
+@return non-zero if hash is in the set
+*/
+int hashset_contains(const struct hashset *set, const unsigned char *hash);
+
+/**
+@brief frees set memory
+*/
+void hashset_free(struct hashset *set);
+
+/**
+@return bytes allocated by set
+*/
+static inline size_t hashset_mem_usage(const struct hashset *set)
+{
+    return (size_t) set->capacity * ED2K_HASH_SIZE;
+}
+
+#endif // ED2KD_HASHSET_H
@@ -0,0 +1,123 @@
+#include "idmap.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "client.h"
+#include "log.h"
+
+static struct {
+    /* client chains linked by idmap_next */
+    _Atomic(struct client *) *buckets;
+    /* buckets count - 1 */
+    uint32_t mask;
+    /* hash shift for buckets count */
+    unsigned shift;
+    /* bucket i is guarded by mutexes[i % IDMAP_SHARDS] */
+    pthread_mutex_t mutexes[IDMAP_SHARDS];
+} s_map;
+
+static inline uint32_t id_hash(uint32_t id)
+{
+    return (id * 0x9E3779B1u) >> s_map.shift;
+}
+
+int idmap_init(size_t max_clients)
+{
+    uint32_t size = IDMAP_SHARDS;
+    unsigned bits = __builtin_ctz(IDMAP_SHARDS);
+    size_t i;
+
+    while (size < max_clients) {
+        size <<= 1;
+        bits++;
+    }
+
+    s_map.buckets = (_Atomic(struct client *) *) calloc(size, sizeof(*s_map.buckets));
+    if (!s_map.buckets) {
+        ED2KD_LOGERR("failed to allocate client id index");
+        return 0;
+    }
+    s_map.mask = size - 1;
+    s_map.shift = 32 - bits;
+
+    for (i = 0; i < IDMAP_SHARDS; ++i) {
+        pthread_mutex_init(&s_map.mutexes[i], NULL);
+    }
+
+    return 1;
+}
+
+void idmap_free(void)
+{
+    size_t i;
+
+    if (!s_map.buckets)
+        return;
+
+    for (i = 0; i < IDMAP_SHARDS; ++i) {
+        pthread_mutex_destroy(&s_map.mutexes[i]);
+    }
+    free(s_map.buckets);
+    s_map.buckets = NULL;
+}
+
+void idmap_add(struct client *clnt)
+{
+    uint32_t b = id_hash(clnt->id);
+    pthread_mutex_t *mutex = &s_map.mutexes[b % IDMAP_SHARDS];
+
+    pthread_mutex_lock(mutex);
+    atomic_store_explicit(&clnt->idmap_next, atomic_load_explicit(&s_map.buckets[b], memory_order_relaxed),
+            memory_order_relaxed);
+    // publishes client fields written before
+    atomic_store_explicit(&s_map.buckets[b], clnt, memory_order_release);
+    clnt->indexed = 1;
+    pthread_mutex_unlock(mutex);
+}
+
+void idmap_remove(struct client *clnt)
+{
+    uint32_t b = id_hash(clnt->id);
+    pthread_mutex_t *mutex = &s_map.mutexes[b % IDMAP_SHARDS];
+    _Atomic(struct client *) *link = &s_map.buckets[b];
+    struct client *cur;
+
+    pthread_mutex_lock(mutex);
+    while ((cur = atomic_load_explicit(link, memory_order_relaxed))) {
+        if (cur == clnt) {
+            // readers standing on removed client still follow its link
+            atomic_store_explicit(link, atomic_load_explicit(&clnt->idmap_next, memory_order_relaxed),
+                    memory_order_release);
+            break;
+        }
+        link = &cur->idmap_next;
+    }
+    clnt->indexed = 0;
+    pthread_mutex_unlock(mutex);
+}
+
+struct client *idmap_find(uint32_t id, uint16_t port)
+{
+    struct client *clnt = atomic_load_explicit(&s_map.buckets[id_hash(id)], memory_order_acquire);
+
+    for (; clnt; clnt = atomic_load_explicit(&clnt->idmap_next, memory_order_acquire)) {
+        if (clnt->id == id && (!port || clnt->port == port) && client_tryref(clnt))
+            return clnt;
+    }
+
+    return NULL;
+}
+
+void idmap_foreach(int (*fn)(struct client *clnt, void *ctx), void *ctx)
+{
+    uint32_t b;
+
+    for (b = 0; b <= s_map.mask; ++b) {
+        struct client *clnt = atomic_load_explicit(&s_map.buckets[b], memory_order_acquire);
+
+        for (; clnt; clnt = atomic_load_explicit(&clnt->idmap_next, memory_order_acquire)) {
+            if (!fn(clnt, ctx))
+                return;
+        }
+    }
+}
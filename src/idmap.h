@@ -0,0 +1,52 @@
+#ifndef ED2KD_IDMAP_H
+#define ED2KD_IDMAP_H
+
+/**
+@file idmap.h connected clients index by ed2k id
+
+Lookups and walks take no locks and may be done only by online rcu readers
+(job workers, admin), found clients stay allocated until reader goes
+offline (see rcu.h). Inserts and
+removals lock one of IDMAP_SHARDS bucket groups. HighID clients behind
+one ip have the same id, so ids are not unique.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IDMAP_SHARDS    64
+
+struct client;
+
+/**
+@param max_clients maximum connected clients, index is sized for them
+@return non-zero on success
+*/
+int idmap_init(size_t max_clients);
+
+void idmap_free(void);
+
+/**
+@brief adds client with assigned id
+*/
+void idmap_add(struct client *clnt);
+
+/**
+@brief removes client added by idmap_add(), client memory must be retired (rcu_retire())
+*/
+void idmap_remove(struct client *clnt);
+
+/**
+@brief finds not deleted client and takes its reference
+@param port client port, 0 matches any
+@return client (release with client_decref()) or NULL
+*/
+struct client *idmap_find(uint32_t id, uint16_t port);
+
+/**
+@brief calls fn for every indexed client, deleted ones included
+@param fn returns zero to stop walk
+*/
+void idmap_foreach(int (*fn)(struct client *clnt, void *ctx), void *ctx);
+
+#endif // ED2KD_IDMAP_H
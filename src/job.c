@@ -4,6 +4,19 @@
 #include "server.h"
 #include "client.h"
 
+const char *job_type_name(enum job_type type)
+{
+    static const char *names[JOB_TYPE_COUNT] = {
+            "server_event",
+            "server_read",
+            "server_status_notify",
+            "portcheck_result",
+            "callback_requested"
+    };
+
+    return names[type];
+}
+
 void server_read_cb(struct bufferevent *bev, void *ctx)
 {
     struct job *job = (struct job *) calloc(1, sizeof *job);
@@ -38,38 +51,3 @@ void server_status_notify_cb(evutil_socket_t fd, short events, void *ctx)
 
     server_add_job(job);
 }
-
-void portcheck_read_cb(struct bufferevent *bev, void *ctx)
-{
-    struct job *job = (struct job *) calloc(1, sizeof(*job));
-    (void) bev;
-
-    job->type = JOB_PORTCHECK_READ;
-    job->clnt = (struct client *) ctx;
-
-    server_add_job((struct job *) job);
-}
-
-void portcheck_timeout_cb(evutil_socket_t fd, short events, void *ctx)
-{
-    struct job *job = (struct job *) calloc(1, sizeof(*job));
-    (void) fd;
-    (void) events;
-
-    job->type = JOB_PORTCHECK_TIMEOUT;
-    job->clnt = (struct client *) ctx;
-
-    server_add_job(job);
-}
-
-void portcheck_event_cb(struct bufferevent *bev, short events, void *ctx)
-{
-    struct job_event *job = (struct job_event *) calloc(1, sizeof(*job));
-    (void) bev;
-
-    job->hdr.type = JOB_PORTCHECK_EVENT;
-    job->hdr.clnt = (struct client *) ctx;
-    job->events = events;
-
-    server_add_job((struct job *) job);
-}
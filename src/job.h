@@ -2,6 +2,7 @@
 #define ED2KD_JOB_H
 
 #include "queue.h"
+#include <stdint.h>
 #include <event2/util.h>
 
 struct sockaddr;
@@ -13,14 +14,18 @@ enum job_type {
     JOB_SERVER_EVENT,
     JOB_SERVER_READ,
     JOB_SERVER_STATUS_NOTIFY,
-    JOB_PORTCHECK_EVENT,
-    JOB_PORTCHECK_READ,
-    JOB_PORTCHECK_TIMEOUT
+    JOB_PORTCHECK_RESULT,
+    JOB_CALLBACK_REQUESTED,
+    JOB_TYPE_COUNT
 };
 
 struct job {
     enum job_type type;
     struct client *clnt;
+    /* time of server_add_job() call (nsecs, monotonic) */
+    uint64_t enqueue_time;
+    /* time job was taken by worker (nsecs, monotonic) */
+    uint64_t start_time;
     TAILQ_ENTRY(job) qentry;
 };
 
@@ -29,18 +34,27 @@ struct job_event {
     short events;
 };
 
+struct job_portcheck {
+    struct job hdr;
+    /* portcheck_result value */
+    int result;
+};
+
+struct job_callback {
+    struct job hdr;
+    /* requesting client address (network order) */
+    uint32_t ip;
+    uint16_t port;
+};
+
 TAILQ_HEAD(job_queue, job);
 
+const char *job_type_name(enum job_type type);
+
 void server_read_cb(struct bufferevent *bev, void *ctx);
 
 void server_event_cb(struct bufferevent *bev, short events, void *ctx);
 
 void server_status_notify_cb(evutil_socket_t fd, short events, void *ctx);
 
-void portcheck_read_cb(struct bufferevent *bev, void *ctx);
-
-void portcheck_event_cb(struct bufferevent *bev, short events, void *ctx);
-
-void portcheck_timeout_cb(evutil_socket_t fd, short events, void *ctx);
-
 #endif // ED2KD_JOB_H
@@ -0,0 +1,153 @@
+#include "jobtrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "job.h"
+#include "client.h"
+#include "atomic.h"
+#include "util.h"
+#include "log.h"
+
+struct jobtrace_entry {
+    uint64_t enqueue_time;
+    uint64_t start_time;
+    uint64_t end_time;
+    uint32_t client_id;
+    uint8_t type;
+};
+
+struct jobtrace_ring {
+    /* total recorded entries count */
+    atomic_uint64_t head;
+    /* worker number (trace thread id) */
+    uint32_t worker;
+    /* next registered ring */
+    struct jobtrace_ring *next;
+    struct jobtrace_entry entries[];
+};
+
+static THREAD_LOCAL struct jobtrace_ring *s_ring;
+
+static size_t s_size;
+static uint32_t s_worker_count;
+static struct jobtrace_ring *s_rings;
+static pthread_mutex_t s_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int jobtrace_init(size_t size)
+{
+    size_t pow2 = 1;
+
+    while (pow2 < size)
+        pow2 <<= 1;
+    s_size = size ? pow2 : 0;
+
+    return 1;
+}
+
+void jobtrace_free(void)
+{
+    pthread_mutex_lock(&s_rings_mutex);
+    while (s_rings) {
+        struct jobtrace_ring *next = s_rings->next;
+        free(s_rings);
+        s_rings = next;
+    }
+    s_size = 0;
+    pthread_mutex_unlock(&s_rings_mutex);
+}
+
+int jobtrace_enabled(void)
+{
+    return s_size != 0;
+}
+
+static struct jobtrace_ring *register_ring(void)
+{
+    struct jobtrace_ring *ring = (struct jobtrace_ring *) calloc(1, sizeof(*ring) + s_size * sizeof(ring->entries[0]));
+
+    if (!ring) {
+        ED2KD_LOGERR("failed to allocate job trace ring");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s_rings_mutex);
+    ring->worker = s_worker_count++;
+    ring->next = s_rings;
+    s_rings = ring;
+    pthread_mutex_unlock(&s_rings_mutex);
+
+    return ring;
+}
+
+void jobtrace_record(const struct job *job, uint64_t end)
+{
+    struct jobtrace_entry *e;
+    uint64_t head;
+
+    if (!s_size)
+        return;
+
+    if (__builtin_expect(!s_ring, 0) && !(s_ring = register_ring()))
+        return;
+
+    head = atomic_load_explicit(&s_ring->head, memory_order_relaxed);
+    e = &s_ring->entries[head & (s_size - 1)];
+    e->enqueue_time = job->enqueue_time;
+    e->start_time = job->start_time;
+    e->end_time = end;
+    e->client_id = job->clnt->id;
+    e->type = job->type;
+
+    // entry is complete before it becomes visible to dump
+    atomic_store_explicit(&s_ring->head, head + 1, memory_order_release);
+}
+
+static void dump_ring(struct evbuffer *out, const struct jobtrace_ring *ring, struct jobtrace_entry *copy, int *first)
+{
+    uint64_t head, head_after, from, i;
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    memcpy(copy, ring->entries, s_size * sizeof(*copy));
+    atomic_thread_fence(memory_order_acquire);
+    head_after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // entries overwritten during copy are skipped
+    from = head_after >= s_size ? head_after - s_size + 1 : 0;
+
+    evbuffer_add_printf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":\"worker %u\"}}", *first ? "" : ",", ring->worker, ring->worker);
+    *first = 0;
+
+    for (i = from; i < head; ++i) {
+        const struct jobtrace_entry *e = &copy[i & (s_size - 1)];
+        evbuffer_add_printf(out, ",\n{\"name\":\"%s\",\"cat\":\"job\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"wait_us\":%.3f,\"client\":%u}}",
+                job_type_name(e->type), ring->worker, e->start_time / 1e3,
+                (e->end_time - e->start_time) / 1e3, (e->start_time - e->enqueue_time) / 1e3, e->client_id);
+    }
+}
+
+void jobtrace_dump(struct evbuffer *out)
+{
+    struct jobtrace_ring *ring;
+    struct jobtrace_entry *copy;
+    int first = 1;
+
+    evbuffer_add_printf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&s_rings_mutex);
+    copy = s_size ? (struct jobtrace_entry *) malloc(s_size * sizeof(*copy)) : NULL;
+    if (copy) {
+        for (ring = s_rings; ring; ring = ring->next) {
+            dump_ring(out, ring, copy, &first);
+        }
+        free(copy);
+    }
+    pthread_mutex_unlock(&s_rings_mutex);
+
+    evbuffer_add_printf(out, "\n]}\n");
+}
@@ -0,0 +1,47 @@
+#ifndef ED2KD_JOBTRACE_H
+#define ED2KD_JOBTRACE_H
+
+/**
+@file jobtrace.h trace of last processed jobs
+
+Every job worker keeps ring buffer of its last jobs timings, disabled
+unless jobtrace_init() is called with non-zero size. Rings are written
+only by owner thread and may be dumped at any time as Chrome trace
+event JSON (chrome://tracing, Perfetto).
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct job;
+struct evbuffer;
+
+/**
+@brief enables tracing
+@param size last jobs count kept per worker, rounded up to power of 2
+@return non-zero on success
+*/
+int jobtrace_init(size_t size);
+
+/**
+@brief frees all rings, no jobs may be recorded after this call
+*/
+void jobtrace_free(void);
+
+/**
+@return non-zero if tracing is enabled
+*/
+int jobtrace_enabled(void);
+
+/**
+@brief records finished job to calling thread's ring
+@param end job finish time (nsecs, monotonic)
+*/
+void jobtrace_record(const struct job *job, uint64_t end);
+
+/**
+@brief writes all rings contents in Chrome trace event format
+*/
+void jobtrace_dump(struct evbuffer *out);
+
+#endif // ED2KD_JOBTRACE_H
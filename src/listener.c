@@ -5,10 +5,22 @@
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
 
 #include "log.h"
 #include "client.h"
 #include "packet.h"
+#include "metrics.h"
+#include "admission.h"
+
+static void output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *ctx)
+{
+    (void) buf;
+    (void) ctx;
+
+    if (info->n_added)
+        metrics_add(MC_BYTES_OUT, info->n_added);
+}
 
 static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *ctx)
 {
@@ -23,9 +35,24 @@ static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struc
     assert(AF_INET == sa->sa_family);
     sa_in = (struct sockaddr_in *) sa;
 
-    // todo: limit total client count
-    // todo: limit connections from same ip
-    // todo: block banned ips
+    // reject before any client state is allocated
+    switch (admission_accept(sa_in->sin_addr.s_addr)) {
+        case ADMISSION_OK:
+            break;
+        case ADMISSION_BANNED:
+            metrics_add(MC_CONN_REJECTED_BANNED, 1);
+            evutil_closesocket(fd);
+            return;
+        case ADMISSION_SERVER_FULL:
+            metrics_add(MC_CONN_REJECTED_FULL, 1);
+            evutil_closesocket(fd);
+            return;
+        case ADMISSION_IP_LIMIT:
+            metrics_add(MC_CONN_REJECTED_IP_LIMIT, 1);
+            evutil_closesocket(fd);
+            return;
+    }
+    metrics_add(MC_CONN_ACCEPTED, 1);
 
     clnt = client_new();
 
@@ -39,6 +66,7 @@ static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struc
 #endif
 
     bufferevent_setcb(clnt->bev, server_read_cb, NULL, server_event_cb, clnt);
+    evbuffer_add_cb(bufferevent_get_output(clnt->bev), output_cb, NULL);
     bufferevent_enable(clnt->bev, EV_READ | EV_WRITE);
 
     // todo: set timeout for op_login
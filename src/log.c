@@ -1,39 +1,229 @@
 #include "log.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include <event2/util.h>
 
-void _ed2kd_log(enum log_severity svrt, const char *fmt, ...)
-{
-    char buf[1024];
-    const char *severity_str;
-    va_list ap;
-    va_start(ap, fmt);
+#include "atomic.h"
+#include "util.h"
+
+struct log_record {
+    /* log_severity value */
+    uint8_t severity;
+    /* formatted message */
+    char msg[LOG_MAX_MSG];
+};
 
-    // todo: add loggin mutex
+/* single producer, single consumer ring */
+struct log_ring {
+    /* records written by owner thread */
+    atomic_uint64_t head;
+    /* records written out by flusher */
+    atomic_uint64_t tail;
+    /* messages dropped because ring was full */
+    atomic_uint64_t dropped;
+    /* dropped messages already reported by flusher */
+    uint64_t reported;
+    /* owner thread exit flag */
+    atomic_uint32_t exited;
+    /* next registered ring */
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
 
+static THREAD_LOCAL struct log_ring *s_ring;
+
+static struct {
+    pthread_t thread;
+    /* thread exit notification */
+    pthread_key_t key;
+    /* registered rings list mutex */
+    pthread_mutex_t mutex;
+    /* registered rings */
+    struct log_ring *rings;
+    /* dropped messages of freed rings */
+    uint64_t freed_dropped;
+    atomic_uint32_t running;
+    atomic_uint32_t terminate;
+} s_log = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *severity_str(unsigned svrt)
+{
     switch (svrt) {
 #ifdef USE_DEBUG
         case LOG_DBG:
-                severity_str = "dbg";
-                break;
+                return "dbg";
 #endif
         case LOG_NFO:
-            severity_str = "nfo";
-            break;
+            return "nfo";
         case LOG_WRN:
-            severity_str = "wrn";
-            break;
+            return "wrn";
         case LOG_ERR:
-            severity_str = "err";
-            break;
+            return "err";
         default:
-            severity_str = "???";
-            break;
+            return "???";
+    }
+}
+
+static void ring_exit(void *ctx)
+{
+    struct log_ring *ring = (struct log_ring *) ctx;
+    atomic_store_explicit(&ring->exited, 1, memory_order_release);
+}
+
+static struct log_ring *register_ring(void)
+{
+    struct log_ring *ring = (struct log_ring *) calloc(1, sizeof(*ring));
+
+    if (!ring)
+        return NULL;
+
+    pthread_setspecific(s_log.key, ring);
+
+    pthread_mutex_lock(&s_log.mutex);
+    ring->next = s_log.rings;
+    s_log.rings = ring;
+    pthread_mutex_unlock(&s_log.mutex);
+
+    return ring;
+}
+
+static void flush_rings(void)
+{
+    struct log_ring *ring, **prev;
+
+    pthread_mutex_lock(&s_log.mutex);
+    prev = &s_log.rings;
+    while ((ring = *prev)) {
+        uint32_t exited = atomic_load_explicit(&ring->exited, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+        for (; tail < head; ++tail) {
+            const struct log_record *rec = &ring->records[tail % LOG_RING_SIZE];
+            fprintf(stderr, "[%s] %s\n", severity_str(rec->severity), rec->msg);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (dropped != ring->reported) {
+            fprintf(stderr, "[wrn] log: %llu messages dropped\n", (unsigned long long) (dropped - ring->reported));
+            ring->reported = dropped;
+        }
+
+        // nothing will be written to ring of finished thread
+        if (exited) {
+            *prev = ring->next;
+            s_log.freed_dropped += dropped;
+            free(ring);
+            continue;
+        }
+
+        prev = &ring->next;
+    }
+    pthread_mutex_unlock(&s_log.mutex);
+
+    fflush(stderr);
+}
+
+static void *log_flusher(void *arg)
+{
+    (void) arg;
+
+    while (!atomic_load(&s_log.terminate)) {
+        struct timespec ts = {0, LOG_FLUSH_INTERVAL * 1000000};
+        flush_rings();
+        nanosleep(&ts, NULL);
     }
 
-    evutil_snprintf(buf, sizeof(buf), "[%s] %s\n", severity_str, fmt);
-    vfprintf(stderr, buf, ap);
+    flush_rings();
 
+    return NULL;
+}
+
+int log_init(void)
+{
+    if (pthread_key_create(&s_log.key, ring_exit))
+        return 0;
+
+    if (pthread_create(&s_log.thread, NULL, log_flusher, NULL)) {
+        pthread_key_delete(s_log.key);
+        return 0;
+    }
+
+    atomic_store(&s_log.running, 1);
+    atexit(log_free);
+
+    return 1;
+}
+
+void log_free(void)
+{
+    if (!atomic_load(&s_log.running))
+        return;
+
+    // next messages are written synchronously
+    atomic_store(&s_log.running, 0);
+    atomic_store(&s_log.terminate, 1);
+    pthread_join(s_log.thread, NULL);
+
+    // rings of running threads are kept, they may still be referenced
+}
+
+uint64_t log_dropped(void)
+{
+    struct log_ring *ring;
+    uint64_t dropped;
+
+    pthread_mutex_lock(&s_log.mutex);
+    dropped = s_log.freed_dropped;
+    for (ring = s_log.rings; ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&s_log.mutex);
+
+    return dropped;
+}
+
+void _ed2kd_log(enum log_severity svrt, const char *fmt, ...)
+{
+    struct log_ring *ring = s_ring;
+    struct log_record *rec;
+    uint64_t head;
+    va_list ap;
+
+    if (!atomic_load_explicit(&s_log.running, memory_order_relaxed)) {
+        char buf[LOG_MAX_MSG];
+
+        va_start(ap, fmt);
+        evutil_vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+
+        fprintf(stderr, "[%s] %s\n", severity_str(svrt), buf);
+        return;
+    }
+
+    if (__builtin_expect(!ring, 0)) {
+        if (!(ring = s_ring = register_ring()))
+            return;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        // only owner thread writes counter
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    // message is formatted in place, flusher only adds severity prefix
+    rec = &ring->records[head % LOG_RING_SIZE];
+    rec->severity = (uint8_t) svrt;
+    va_start(ap, fmt);
+    evutil_vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
     va_end(ap);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
@@ -1,6 +1,21 @@
 #ifndef ED2KD_LOG_H
 #define ED2KD_LOG_H
 
+/**
+@file log.h logging
+
+After log_init() messages are formatted into calling thread's ring buffer
+and written to stderr by flusher thread, so logging never waits on I/O or
+on other threads. Messages which don't fit into full ring are dropped and
+counted. Before log_init() messages are written synchronously.
+*/
+
+#include <stdint.h>
+
+#define LOG_RING_SIZE       256
+#define LOG_MAX_MSG         1024
+#define LOG_FLUSH_INTERVAL  10 // msecs
+
 enum log_severity {
 #ifdef USE_DEBUG
         LOG_DBG,
@@ -10,7 +25,23 @@ enum log_severity {
     LOG_ERR
 };
 
-void _ed2kd_log(enum log_severity svrt, const char *fmt, ...);
+/**
+@brief starts flusher thread, remaining messages are flushed at exit
+@return non-zero on success
+*/
+int log_init(void);
+
+/**
+@brief flushes all rings and stops flusher thread
+*/
+void log_free(void);
+
+/**
+@return total count of dropped messages
+*/
+uint64_t log_dropped(void);
+
+void _ed2kd_log(enum log_severity svrt, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
 #define ED2KD_LOGNFO(msg, args...) _ed2kd_log(LOG_NFO, msg, ##args)
 #define ED2KD_LOGWRN(msg, args...) _ed2kd_log(LOG_WRN, msg, ##args)
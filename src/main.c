@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
@@ -14,6 +15,17 @@
 #include "ed2k_proto.h"
 #include "server.h"
 #include "db.h"
+#include "metrics.h"
+#include "admin.h"
+#include "admission.h"
+#include "portcheck.h"
+#include "jobtrace.h"
+#include "slowlog.h"
+#include "udp.h"
+#include "idmap.h"
+#include "serverlist.h"
+#include "snapshot.h"
+#include "rcu.h"
 
 struct server_instance g_srv;
 
@@ -53,6 +65,15 @@ static void sigint_cb(evutil_socket_t fd, short what, void *ctx)
     server_stop();
 }
 
+static void sighup_cb(evutil_socket_t fd, short what, void *ctx)
+{
+    (void) fd;
+    (void) what;
+    (void) ctx;
+    ED2KD_LOGNFO("caught SIGHUP, reloading configuration...");
+    server_reload_config();
+}
+
 static void display_libevent_info(void)
 {
     int i;
@@ -71,9 +92,14 @@ int main(int argc, char *argv[])
 {
     size_t i;
     int ret, opt, longIndex = 0;
-    struct event *evsig_int;
+    struct event *evsig_int, *evsig_hup;
     pthread_t tcp_thread, *job_threads;
 
+    if (!log_init()) {
+        fputs("failed to start log thread\n", stderr);
+        return EXIT_FAILURE;
+    }
+
     if (evutil_secure_rng_init() < 0) {
         ED2KD_LOGERR("failed to seed random number generator");
         return EXIT_FAILURE;
@@ -132,22 +158,65 @@ int main(int argc, char *argv[])
 
     evsig_int = evsignal_new(g_srv.evbase_main, SIGINT, sigint_cb, NULL);
     evsignal_add(evsig_int, NULL);
+    evsig_hup = evsignal_new(g_srv.evbase_main, SIGHUP, sighup_cb, NULL);
+    evsignal_add(evsig_hup, NULL);
 
     // common timers timevals
-    g_srv.portcheck_timeout_tv = event_base_init_common_timeout(g_srv.evbase_tcp, &g_srv.cfg->portcheck_timeout_tv);
-    g_srv.status_notify_tv = event_base_init_common_timeout(g_srv.evbase_tcp, &g_srv.cfg->status_notify_tv);
+    atomic_init(&g_srv.status_notify_tv,
+            event_base_init_common_timeout(g_srv.evbase_tcp, &g_srv.cfg->status_notify_tv));
 
     if (!db_create()) {
         ED2KD_LOGERR("failed to create database");
         return EXIT_FAILURE;
     }
 
+    // broken snapshot is not fatal, clients offer their files again
+    if (g_srv.cfg->snapshot_file)
+        snapshot_load(g_srv.cfg->snapshot_file, g_srv.cfg->snapshot_grace);
+
+    if (!admission_init(g_srv.cfg->max_clients, g_srv.cfg->max_clients_per_ip, g_srv.cfg->ban_file)) {
+        ED2KD_LOGERR("failed to init admission control");
+        return EXIT_FAILURE;
+    }
+
+    if (!idmap_init(g_srv.cfg->max_clients)) {
+        ED2KD_LOGERR("failed to init client id index");
+        return EXIT_FAILURE;
+    }
+
+    // peers are pinged by udp thread
+    if (!serverlist_init(g_srv.cfg->peer_servers, g_srv.cfg->peer_server_count,
+            g_srv.cfg->udp_enabled ? g_srv.cfg->peer_ping_interval : 0)) {
+        ED2KD_LOGERR("failed to init server list");
+        return EXIT_FAILURE;
+    }
+
+    if (!portcheck_cache_init(g_srv.cfg->portcheck_cache_size, g_srv.cfg->portcheck_cache_ttl)) {
+        ED2KD_LOGERR("failed to init portcheck cache");
+        return EXIT_FAILURE;
+    }
+
+    if (g_srv.cfg->job_trace_size)
+        jobtrace_init(g_srv.cfg->job_trace_size);
+
+    if (!slowlog_init(g_srv.cfg->slow_query_threshold)) {
+        ED2KD_LOGERR("failed to start slow query log");
+        return EXIT_FAILURE;
+    }
+
     g_srv.thread_count = omp_get_num_procs() + 1;
 
     pthread_cond_init(&g_srv.job_cond, NULL);
     pthread_mutex_init(&g_srv.job_mutex, NULL);
     TAILQ_INIT(&g_srv.jqueue);
 
+    // start port check thread
+    if (!portcheck_init(g_srv.cfg->portcheck_max_inflight, g_srv.cfg->portcheck_max_per_subnet,
+            &g_srv.cfg->portcheck_timeout_tv)) {
+        ED2KD_LOGERR("failed to start port check thread");
+        return EXIT_FAILURE;
+    }
+
     job_threads = (pthread_t *) malloc(g_srv.thread_count * sizeof(*job_threads));
 
     // start tcp worker threads
@@ -158,6 +227,19 @@ int main(int argc, char *argv[])
     // start tcp dispatch thread
     pthread_create(&tcp_thread, NULL, server_base_worker, g_srv.evbase_tcp);
 
+    // start udp thread
+    if (g_srv.cfg->udp_enabled && !udp_start(g_srv.cfg->udp_rate_limit)) {
+        ED2KD_LOGERR("failed to start udp server");
+    }
+
+    if (g_srv.cfg->snapshot_file && !snapshot_start(g_srv.cfg->snapshot_file, g_srv.cfg->snapshot_interval)) {
+        ED2KD_LOGERR("failed to start snapshot thread");
+    }
+
+    if (g_srv.cfg->admin_socket && !admin_start(g_srv.cfg->admin_socket)) {
+        ED2KD_LOGERR("failed to start admin socket");
+    }
+
     // start tcp listen loop
     if (!server_listen()) {
         ED2KD_LOGERR("failed to start server listener");
@@ -165,24 +247,34 @@ int main(int argc, char *argv[])
     }
 
     pthread_join(tcp_thread, NULL);
+    udp_stop();
 
-    while (EBUSY == pthread_cond_destroy(&g_srv.job_cond)) {
-        pthread_cond_broadcast(&g_srv.job_cond);
-        //pthread_yield();
-    }
+    // no results are posted to job workers after this
+    portcheck_free();
 
-    pthread_mutex_destroy(&g_srv.job_mutex);
+    // wake up idle workers, they check terminate flag under job_mutex
+    pthread_mutex_lock(&g_srv.job_mutex);
+    pthread_cond_broadcast(&g_srv.job_cond);
+    pthread_mutex_unlock(&g_srv.job_mutex);
 
     for (i = 0; i < g_srv.thread_count; ++i) {
         pthread_join(job_threads[i], NULL);
     }
 
+    // sources of still connected clients are saved too
+    snapshot_stop();
+
+    pthread_cond_destroy(&g_srv.job_cond);
+    pthread_mutex_destroy(&g_srv.job_mutex);
+
     free(job_threads);
 
     // todo: free job queue items
 
+    admin_stop();
     evconnlistener_free(g_srv.tcp_listener);
     event_free(evsig_int);
+    event_free(evsig_hup);
     event_base_free(g_srv.evbase_tcp);
     event_base_free(g_srv.evbase_main);
 
@@ -190,6 +282,16 @@ int main(int argc, char *argv[])
         ED2KD_LOGERR("failed to destroy database");
     }
 
+    metrics_log();
+    metrics_free();
+    jobtrace_free();
+    slowlog_free();
+    admission_free();
+    portcheck_cache_free();
+    idmap_free();
+    rcu_free();
+    serverlist_free();
+
     server_free_config();
 
     return EXIT_SUCCESS;
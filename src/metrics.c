@@ -0,0 +1,250 @@
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ed2k_proto.h"
+#include "log.h"
+
+THREAD_LOCAL struct metrics_shard *g_metrics_shard;
+
+static struct metrics_shard *s_shards;
+static pthread_mutex_t s_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *s_counter_names[MC_COUNT] = {
+        "bytes_in",
+        "bytes_out",
+        "packets_in",
+        "packets_malformed",
+        "jobs_enqueued",
+        "jobs_dequeued",
+        "zlib_bytes_in",
+        "zlib_bytes_out",
+        "conn_accepted",
+        "conn_rejected_banned",
+        "conn_rejected_full",
+        "conn_rejected_ip_limit",
+        "portcheck_cache_hit",
+        "portcheck_cache_miss",
+        "udp_packets_in",
+        "udp_packets_out",
+        "udp_bytes_in",
+        "udp_bytes_out",
+        "udp_malformed",
+        "udp_rate_limited",
+        "callback_forwarded",
+        "callback_failed"
+};
+
+static const char *s_hist_names[MH_COUNT] = {
+        "op_loginrequest",
+        "op_getserverlist",
+        "op_searchrequest",
+        "op_query_more_result",
+        "op_disconnect",
+        "op_getsources",
+        "op_offerfiles",
+        "op_callbackrequest",
+        "op_getsources_obfu",
+        "op_reject",
+        "op_other",
+        "job_wait_server_event",
+        "job_wait_server_read",
+        "job_wait_server_status_notify",
+        "job_wait_portcheck_result",
+        "job_wait_callback_requested",
+        "job_service_server_event",
+        "job_service_server_read",
+        "job_service_server_status_notify",
+        "job_service_portcheck_result",
+        "job_service_callback_requested",
+        "db_share_upd",
+        "db_share_ins",
+        "db_share_src",
+        "db_remove_src",
+        "db_get_src",
+        "db_get_src_batch",
+        "db_confirm_src",
+        "db_search",
+        "zlib_unpack",
+        "portcheck_queue",
+        "portcheck",
+        "udp_getsources",
+        "udp_search",
+        "udp_other"
+};
+
+struct metrics_shard *metrics_register_thread(void)
+{
+    struct metrics_shard *shard = (struct metrics_shard *) calloc(1, sizeof(*shard));
+
+    if (!shard)
+        return NULL;
+
+    pthread_mutex_lock(&s_shards_mutex);
+    shard->next = s_shards;
+    s_shards = shard;
+    pthread_mutex_unlock(&s_shards_mutex);
+
+    g_metrics_shard = shard;
+
+    return shard;
+}
+
+void metrics_free(void)
+{
+    pthread_mutex_lock(&s_shards_mutex);
+    while (s_shards) {
+        struct metrics_shard *next = s_shards->next;
+        free(s_shards);
+        s_shards = next;
+    }
+    pthread_mutex_unlock(&s_shards_mutex);
+}
+
+void metrics_snapshot(struct metrics_snapshot *snap)
+{
+    struct metrics_shard *shard;
+    size_t i, j;
+
+    memset(snap, 0, sizeof(*snap));
+
+    pthread_mutex_lock(&s_shards_mutex);
+    for (shard = s_shards; shard; shard = shard->next) {
+        uint64_t busy = atomic_load_explicit(&shard->busy_ns, memory_order_relaxed);
+        uint64_t idle = atomic_load_explicit(&shard->idle_ns, memory_order_relaxed);
+
+        if ((busy || idle) && snap->worker_count < METRICS_MAX_WORKERS) {
+            snap->workers[snap->worker_count].busy_ns = busy;
+            snap->workers[snap->worker_count].idle_ns = idle;
+            snap->worker_count++;
+        }
+
+        for (i = 0; i < MC_COUNT; ++i) {
+            snap->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (i = 0; i < MH_COUNT; ++i) {
+            const struct metrics_hist *src = &shard->hists[i];
+            uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+
+            if (!atomic_load_explicit(&src->count, memory_order_relaxed))
+                continue;
+
+            snap->hists[i].count += atomic_load_explicit(&src->count, memory_order_relaxed);
+            snap->hists[i].sum += atomic_load_explicit(&src->sum, memory_order_relaxed);
+            if (max > snap->hists[i].max)
+                snap->hists[i].max = max;
+            for (j = 0; j < METRICS_BUCKETS; ++j) {
+                snap->hists[i].buckets[j] += atomic_load_explicit(&src->buckets[j], memory_order_relaxed);
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_shards_mutex);
+}
+
+/* middle of the values range counted by bucket */
+static uint64_t bucket_value(unsigned idx)
+{
+    unsigned shift;
+
+    if (idx < (1u << METRICS_SUB_BITS))
+        return idx;
+
+    shift = idx / METRICS_HALF - 1;
+
+    return ((uint64_t) (idx - shift * METRICS_HALF) << shift) + ((1ull << shift) >> 1);
+}
+
+uint64_t metrics_quantile(const struct metrics_snapshot *snap, enum metric_hist h, double q)
+{
+    unsigned i;
+    uint64_t rank, seen = 0, count = snap->hists[h].count;
+
+    if (!count)
+        return 0;
+
+    rank = (uint64_t) (q * (double) count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+
+    // buckets are read without locks, so count may be slightly ahead of them
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += snap->hists[h].buckets[i];
+        if (seen >= rank) {
+            uint64_t val = bucket_value(i);
+            return val > snap->hists[h].max ? snap->hists[h].max : val;
+        }
+    }
+
+    return snap->hists[h].max;
+}
+
+const char *metrics_counter_name(enum metric_counter c)
+{
+    return s_counter_names[c];
+}
+
+const char *metrics_hist_name(enum metric_hist h)
+{
+    return s_hist_names[h];
+}
+
+enum metric_hist metrics_opcode_hist(uint8_t opcode)
+{
+    switch (opcode) {
+        case OP_LOGINREQUEST:
+            return MH_OP_LOGINREQUEST;
+        case OP_GETSERVERLIST:
+            return MH_OP_GETSERVERLIST;
+        case OP_SEARCHREQUEST:
+            return MH_OP_SEARCHREQUEST;
+        case OP_QUERY_MORE_RESULT:
+            return MH_OP_QUERY_MORE_RESULT;
+        case OP_DISCONNECT:
+            return MH_OP_DISCONNECT;
+        case OP_GETSOURCES:
+            return MH_OP_GETSOURCES;
+        case OP_OFFERFILES:
+            return MH_OP_OFFERFILES;
+        case OP_CALLBACKREQUEST:
+            return MH_OP_CALLBACKREQUEST;
+        case OP_GETSOURCES_OBFU:
+            return MH_OP_GETSOURCES_OBFU;
+        case OP_REJECT:
+            return MH_OP_REJECT;
+        default:
+            return MH_OP_OTHER;
+    }
+}
+
+void metrics_log(void)
+{
+    struct metrics_snapshot *snap = (struct metrics_snapshot *) malloc(sizeof(*snap));
+    size_t i;
+
+    if (!snap)
+        return;
+
+    metrics_snapshot(snap);
+
+    for (i = 0; i < MC_COUNT; ++i) {
+        ED2KD_LOGNFO("metric %s: %llu", s_counter_names[i], (unsigned long long) snap->counters[i]);
+    }
+    for (i = 0; i < MH_COUNT; ++i) {
+        if (!snap->hists[i].count)
+            continue;
+        ED2KD_LOGNFO("metric %s: count %llu, p50 %lluus, p99 %lluus, max %lluus", s_hist_names[i],
+                (unsigned long long) snap->hists[i].count,
+                (unsigned long long) metrics_quantile(snap, i, 0.5) / 1000,
+                (unsigned long long) metrics_quantile(snap, i, 0.99) / 1000,
+                (unsigned long long) snap->hists[i].max / 1000);
+    }
+    for (i = 0; i < snap->worker_count; ++i) {
+        uint64_t total = snap->workers[i].busy_ns + snap->workers[i].idle_ns;
+        ED2KD_LOGNFO("metric worker %zu busy: %.1f%%", i, total ? 100.0 * snap->workers[i].busy_ns / total : 0.0);
+    }
+
+    free(snap);
+}
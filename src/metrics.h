@@ -0,0 +1,243 @@
+#ifndef ED2KD_METRICS_H
+#define ED2KD_METRICS_H
+
+/**
+@file metrics.h low-overhead server metrics
+
+Every thread updates its own shard, so the hot path has no shared atomics
+or locks. Shards are merged only when metrics are read. Latencies are kept
+in log-linear histograms of nanoseconds.
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include "atomic.h"
+#include "util.h"
+
+enum metric_counter {
+    MC_BYTES_IN,
+    MC_BYTES_OUT,
+    MC_PACKETS_IN,
+    MC_PACKETS_MALFORMED,
+    MC_JOBS_ENQUEUED,
+    MC_JOBS_DEQUEUED,
+    MC_ZLIB_BYTES_IN,
+    MC_ZLIB_BYTES_OUT,
+    MC_CONN_ACCEPTED,
+    MC_CONN_REJECTED_BANNED,
+    MC_CONN_REJECTED_FULL,
+    MC_CONN_REJECTED_IP_LIMIT,
+    MC_PORTCHECK_CACHE_HIT,
+    MC_PORTCHECK_CACHE_MISS,
+    MC_UDP_PACKETS_IN,
+    MC_UDP_PACKETS_OUT,
+    MC_UDP_BYTES_IN,
+    MC_UDP_BYTES_OUT,
+    MC_UDP_MALFORMED,
+    MC_UDP_RATE_LIMITED,
+    MC_CALLBACK_FORWARDED,
+    MC_CALLBACK_FAILED,
+    MC_COUNT
+};
+
+enum metric_hist {
+    // process_packet() time per opcode
+    MH_OP_LOGINREQUEST,
+    MH_OP_GETSERVERLIST,
+    MH_OP_SEARCHREQUEST,
+    MH_OP_QUERY_MORE_RESULT,
+    MH_OP_DISCONNECT,
+    MH_OP_GETSOURCES,
+    MH_OP_OFFERFILES,
+    MH_OP_CALLBACKREQUEST,
+    MH_OP_GETSOURCES_OBFU,
+    MH_OP_REJECT,
+    MH_OP_OTHER,
+    // time between server_add_job() and job pickup, same order as job_type
+    MH_JOB_WAIT_SERVER_EVENT,
+    MH_JOB_WAIT_SERVER_READ,
+    MH_JOB_WAIT_SERVER_STATUS_NOTIFY,
+    MH_JOB_WAIT_PORTCHECK_RESULT,
+    MH_JOB_WAIT_CALLBACK_REQUESTED,
+    // job processing time, same order as job_type
+    MH_JOB_SERVICE_SERVER_EVENT,
+    MH_JOB_SERVICE_SERVER_READ,
+    MH_JOB_SERVICE_SERVER_STATUS_NOTIFY,
+    MH_JOB_SERVICE_PORTCHECK_RESULT,
+    MH_JOB_SERVICE_CALLBACK_REQUESTED,
+    // prepared statements execution, same order as query_statements in db_sqlite.c
+    MH_DB_SHARE_UPD,
+    MH_DB_SHARE_INS,
+    MH_DB_SHARE_SRC,
+    MH_DB_REMOVE_SRC,
+    MH_DB_GET_SRC,
+    MH_DB_GET_SRC_BATCH,
+    MH_DB_CONFIRM_SRC,
+    // search query prepare and execution
+    MH_DB_SEARCH,
+    // compressed packet unpack
+    MH_ZLIB_UNPACK,
+    // time portcheck waited for free slot in scheduler queue
+    MH_PORTCHECK_QUEUE,
+    // portcheck connect and hello round trip
+    MH_PORTCHECK,
+    // udp request processing, including db lookups
+    MH_UDP_GETSOURCES,
+    MH_UDP_SEARCH,
+    MH_UDP_OTHER,
+    MH_COUNT
+};
+
+#define METRICS_SUB_BITS 4
+#define METRICS_HALF (1u << (METRICS_SUB_BITS - 1))
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 2) * METRICS_HALF)
+#define METRICS_MAX_WORKERS 256
+
+struct metrics_hist {
+    /* recorded values count */
+    atomic_uint64_t count;
+    /* recorded values sum */
+    atomic_uint64_t sum;
+    /* maximal recorded value */
+    atomic_uint64_t max;
+    /* values count per bucket */
+    atomic_uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_shard {
+    atomic_uint64_t counters[MC_COUNT];
+    struct metrics_hist hists[MH_COUNT];
+    /* time spent processing jobs (job workers only) */
+    atomic_uint64_t busy_ns;
+    /* time spent waiting for jobs (job workers only) */
+    atomic_uint64_t idle_ns;
+    /* next registered shard */
+    struct metrics_shard *next;
+};
+
+/* merged metrics */
+struct metrics_snapshot {
+    uint64_t counters[MC_COUNT];
+    struct {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[METRICS_BUCKETS];
+    } hists[MH_COUNT];
+    /* job workers count */
+    size_t worker_count;
+    /* per job worker busy and idle time, not merged */
+    struct {
+        uint64_t busy_ns;
+        uint64_t idle_ns;
+    } workers[METRICS_MAX_WORKERS];
+};
+
+extern THREAD_LOCAL struct metrics_shard *g_metrics_shard;
+
+/**
+@brief allocates and registers calling thread's shard
+@return shard or NULL on failure
+*/
+struct metrics_shard *metrics_register_thread(void);
+
+/**
+@brief frees all shards, no metrics may be updated after this call
+*/
+void metrics_free(void);
+
+/**
+@brief merges all shards
+*/
+void metrics_snapshot(struct metrics_snapshot *snap);
+
+/**
+@return value below which given fraction of recorded values lies
+*/
+uint64_t metrics_quantile(const struct metrics_snapshot *snap, enum metric_hist h, double q);
+
+const char *metrics_counter_name(enum metric_counter c);
+
+const char *metrics_hist_name(enum metric_hist h);
+
+/**
+@return histogram of process_packet() time for given opcode
+*/
+enum metric_hist metrics_opcode_hist(uint8_t opcode);
+
+/**
+@brief logs merged metrics summary
+*/
+void metrics_log(void);
+
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline struct metrics_shard *metrics_shard(void)
+{
+    if (__builtin_expect(!g_metrics_shard, 0))
+        return metrics_register_thread();
+    return g_metrics_shard;
+}
+
+// shard is written only by its owner thread, relaxed load+store compiles to plain add
+#define METRICS_INC(var, val) \
+    atomic_store_explicit(&(var), atomic_load_explicit(&(var), memory_order_relaxed) + (val), memory_order_relaxed)
+
+static inline void metrics_add(enum metric_counter c, uint64_t val)
+{
+    struct metrics_shard *shard = metrics_shard();
+    if (shard)
+        METRICS_INC(shard->counters[c], val);
+}
+
+static inline unsigned metrics_bucket(uint64_t value)
+{
+    unsigned shift;
+
+    if (value < (1u << METRICS_SUB_BITS))
+        return (unsigned) value;
+
+    shift = 63 - __builtin_clzll(value) - METRICS_SUB_BITS + 1;
+
+    return shift * METRICS_HALF + (unsigned) (value >> shift);
+}
+
+static inline void metrics_record(enum metric_hist h, uint64_t nsecs)
+{
+    struct metrics_shard *shard = metrics_shard();
+    struct metrics_hist *hist;
+
+    if (!shard)
+        return;
+
+    hist = &shard->hists[h];
+    METRICS_INC(hist->buckets[metrics_bucket(nsecs)], 1);
+    METRICS_INC(hist->count, 1);
+    METRICS_INC(hist->sum, nsecs);
+    if (nsecs > atomic_load_explicit(&hist->max, memory_order_relaxed))
+        atomic_store_explicit(&hist->max, nsecs, memory_order_relaxed);
+}
+
+/* accounts job worker time */
+static inline void metrics_worker_time(uint64_t busy_ns, uint64_t idle_ns)
+{
+    struct metrics_shard *shard = metrics_shard();
+
+    if (shard) {
+        METRICS_INC(shard->busy_ns, busy_ns);
+        METRICS_INC(shard->idle_ns, idle_ns);
+    }
+}
+
+/* records time elapsed since start */
+static inline void metrics_record_since(enum metric_hist h, uint64_t start)
+{
+    metrics_record(h, metrics_now() - start);
+}
+
+#endif // ED2KD_METRICS_H
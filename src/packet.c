@@ -2,14 +2,15 @@
 
 #include <math.h>       /* floor */
 #include <string.h>     /* memcpy */
-#include <malloc.h>     /* alloca */
-#include <alloca.h>     /* alloca */
+#include <stddef.h>     /* offsetof */
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 
 #include "ed2k_proto.h"
 #include "server.h"
+#include "util.h"
+#include "serverlist.h"
 
 void send_id_change(struct bufferevent *bev, uint32_t id)
 {
@@ -25,6 +26,11 @@ void send_id_change(struct bufferevent *bev, uint32_t id)
 }
 
 void send_server_message(struct bufferevent *bev, const char *msg, uint16_t len)
+{
+    write_server_message(bufferevent_get_output(bev), msg, len);
+}
+
+void write_server_message(struct evbuffer *buf, const char *msg, uint16_t len)
 {
     struct packet_server_message data;
 
@@ -33,8 +39,8 @@ void send_server_message(struct bufferevent *bev, const char *msg, uint16_t len)
     data.opcode = OP_SERVERMESSAGE;
     data.msg_len = len;
 
-    bufferevent_write(bev, &data, sizeof(data));
-    bufferevent_write(bev, msg, len);
+    evbuffer_add(buf, &data, sizeof(data));
+    evbuffer_add(buf, msg, len);
 }
 
 void send_server_status(struct bufferevent *bev)
@@ -51,69 +57,84 @@ void send_server_status(struct bufferevent *bev)
 }
 
 void send_server_ident(struct bufferevent *bev)
+{
+    const struct server_config *cfg = g_srv.cfg;
+    send_static(bev, cfg, cfg->ident_pkt, cfg->ident_pkt_len);
+}
+
+static void write_string_tag(struct evbuffer *buf, uint8_t name, const char *str, uint16_t len)
+{
+    struct tag_header th;
+
+    th.type = TT_STRING;
+    th.name_len = 1;
+    *th.name = name;
+
+    evbuffer_add(buf, &th, sizeof(th));
+    evbuffer_add(buf, &len, sizeof(len));
+    evbuffer_add(buf, str, len);
+}
+
+void write_server_ident(struct evbuffer *buf, const struct server_config *cfg)
 {
     struct packet_server_ident data;
 
     data.hdr.proto = PROTO_EDONKEY;
     data.hdr.length = sizeof(data) - sizeof(data.hdr);
-    data.opcode = OP_SERVERSTATUS;
-    memcpy(data.hash, g_srv.cfg->hash, sizeof(data.hash));
-    data.ip = g_srv.cfg->listen_addr_inaddr;
-    data.port = g_srv.cfg->listen_port;
-    data.tag_count = (g_srv.cfg->server_name_len > 0) + (g_srv.cfg->server_descr_len > 0);
-
-    if (data.tag_count > 0) {
-        struct evbuffer *buf = evbuffer_new();
-        evbuffer_add(buf, &data, sizeof(data));
-
-        if (g_srv.cfg->server_name_len > 0) {
-            struct tag_header th;
-            struct tag_strval *tv;
-            size_t data_len = sizeof(*tv) + g_srv.cfg->server_name_len - 1;
-            tv = (struct tag_strval *) alloca(data_len);
-
-            th.type = TT_STRING;
-            th.name_len = 1;
-            *th.name = TN_SERVERNAME;
-            tv->len = g_srv.cfg->server_name_len;
-            memcpy(tv->str, g_srv.cfg->server_name, g_srv.cfg->server_name_len);
-
-            evbuffer_add(buf, &th, sizeof(th));
-            evbuffer_add(buf, tv, data_len);
-        }
-
-        if (g_srv.cfg->server_descr_len > 0) {
-            struct tag_header th;
-            struct tag_strval *tv;
-            size_t data_len = sizeof(*tv) + g_srv.cfg->server_descr_len - 1;
-            tv = (struct tag_strval *) alloca(data_len);
-
-            th.type = TT_STRING;
-            th.name_len = 1;
-            *th.name = TN_DESCRIPTION;
-            tv->len = g_srv.cfg->server_descr_len;
-            memcpy(tv->str, g_srv.cfg->server_descr, g_srv.cfg->server_descr_len);
-
-            evbuffer_add(buf, &th, sizeof(th));
-            evbuffer_add(buf, tv, data_len);
-        }
-
-        {
-            struct packet_header *ph = (struct packet_header *) evbuffer_pullup(buf, sizeof(*ph));
-            ph->length = evbuffer_get_length(buf) - sizeof(*ph);
-        }
-
-        bufferevent_write_buffer(bev, buf);
-        evbuffer_free(buf);
-    } else {
-        bufferevent_write(bev, &data, sizeof(data));
-    }
+    data.opcode = OP_SERVERIDENT;
+    memcpy(data.hash, cfg->hash, sizeof(data.hash));
+    data.ip = cfg->listen_addr_inaddr;
+    data.port = cfg->listen_port;
+    data.tag_count = (cfg->server_name_len > 0) + (cfg->server_descr_len > 0);
+
+    if (cfg->server_name_len > 0)
+        data.hdr.length += sizeof(struct tag_header) + sizeof(uint16_t) + cfg->server_name_len;
+    if (cfg->server_descr_len > 0)
+        data.hdr.length += sizeof(struct tag_header) + sizeof(uint16_t) + cfg->server_descr_len;
+
+    evbuffer_add(buf, &data, sizeof(data));
+
+    if (cfg->server_name_len > 0)
+        write_string_tag(buf, TN_SERVERNAME, cfg->server_name, cfg->server_name_len);
+
+    if (cfg->server_descr_len > 0)
+        write_string_tag(buf, TN_DESCRIPTION, cfg->server_descr, cfg->server_descr_len);
+}
+
+static void static_cleanup(const void *data, size_t len, void *cfg)
+{
+    (void) data;
+    (void) len;
+    server_config_unref((const struct server_config *) cfg);
+}
+
+void send_static(struct bufferevent *bev, const struct server_config *cfg, const unsigned char *data, size_t len)
+{
+    // reloaded configuration is freed after packets are sent
+    server_config_ref(cfg);
+    if (evbuffer_add_reference(bufferevent_get_output(bev), data, len, static_cleanup, (void *) cfg) < 0)
+        server_config_unref(cfg);
 }
 
 void send_server_list(struct bufferevent *bev)
 {
-    (void) bev;
-    // TODO: implement me :)
+    const struct serverlist_packet *pkt = serverlist_packet();
+
+    if (pkt)
+        bufferevent_write(bev, pkt->data, pkt->len);
+}
+
+void write_server_list(struct evbuffer *buf, const struct server_entry *servers, size_t count)
+{
+    struct packet_server_list data;
+    size_t srvs_len = count * sizeof(*servers);
+
+    data.hdr.proto = PROTO_EDONKEY;
+    data.hdr.length = sizeof(data) - sizeof(data.hdr) + srvs_len;
+    data.opcode = OP_SERVERLIST;
+    data.count = count;
+    evbuffer_add(buf, &data, sizeof(data));
+    evbuffer_add(buf, servers, srvs_len);
 }
 
 void send_reject(struct bufferevent *bev)
@@ -122,13 +143,25 @@ void send_reject(struct bufferevent *bev)
     bufferevent_write(bev, &data, sizeof(data));
 }
 
+void send_callback_requested(struct bufferevent *bev, uint32_t ip, uint16_t port)
+{
+    struct packet_callback_requested data;
+
+    data.hdr.proto = PROTO_EDONKEY;
+    data.hdr.length = sizeof(data) - sizeof(data.hdr);
+    data.opcode = OP_CALLBACKREQUESTED;
+    data.ip = ip;
+    data.port = port;
+    bufferevent_write(bev, &data, sizeof(data));
+}
+
 void send_callback_fail(struct bufferevent *bev)
 {
     static const char data[] = {PROTO_EDONKEY, 1, 0, 0, 0, OP_CALLBACK_FAIL};
     bufferevent_write(bev, &data, sizeof(data));
 }
 
-void send_found_sources(struct bufferevent *bev, const unsigned char *hash, struct file_source *sources, size_t count)
+void write_found_sources(struct evbuffer *buf, const unsigned char *hash, const struct file_source *sources, size_t count)
 {
     struct packet_found_sources data;
     size_t srcs_len = count * sizeof(*sources);
@@ -138,9 +171,36 @@ void send_found_sources(struct bufferevent *bev, const unsigned char *hash, stru
     data.hdr.length = sizeof(data) - sizeof(data.hdr) + srcs_len;
     data.opcode = OP_FOUNDSOURCES;
     data.count = count;
-    bufferevent_write(bev, &data, sizeof(data));
+    evbuffer_add(buf, &data, sizeof(data));
     if (count)
-        bufferevent_write(bev, sources, srcs_len);
+        evbuffer_add(buf, sources, srcs_len);
+}
+
+static inline size_t obfu_source_len(const struct file_source_obfu *src)
+{
+    // user hash is sent only with SRC_CRYPT_HASH
+    return (src->crypt_opts & SRC_CRYPT_HASH) ? sizeof(*src) : offsetof(struct file_source_obfu, hash);
+}
+
+void write_found_sources_obfu(struct evbuffer *buf, const unsigned char *hash, const struct file_source_obfu *sources,
+        size_t count)
+{
+    struct packet_found_sources data;
+    size_t i, srcs_len = 0;
+
+    for (i = 0; i < count; ++i) {
+        srcs_len += obfu_source_len(&sources[i]);
+    }
+
+    data.hdr.proto = PROTO_EDONKEY;
+    memcpy(data.hash, hash, sizeof(data.hash));
+    data.hdr.length = sizeof(data) - sizeof(data.hdr) + srcs_len;
+    data.opcode = OP_FOUNDSOURCES_OBFU;
+    data.count = count;
+    evbuffer_add(buf, &data, sizeof(data));
+    for (i = 0; i < count; ++i) {
+        evbuffer_add(buf, &sources[i], obfu_source_len(&sources[i]));
+    }
 }
 
 void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t count)
@@ -156,147 +216,244 @@ void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t
     bufferevent_write_buffer(bev, result);
 }
 
-void write_search_file(struct evbuffer *buf, const struct search_file *file)
+static unsigned char *put_tag_header(unsigned char *p, uint8_t type, uint8_t name)
 {
-    struct search_file_entry sfe;
-
-    memcpy(sfe.hash, file->hash, sizeof sfe.hash);
-    sfe.id = file->client_id;
-    sfe.port = file->client_port;
-    sfe.tag_count = 1 + 1 + /*(0!=file->type)+*/ (file->ext_len > 0) + 1 + 1 + (file->rated_count > 0) + (file->media_length > 0) + (file->media_length > 0) + (file->media_codec_len > 0);
-    evbuffer_add(buf, &sfe, sizeof sfe);
-
-    {
-        struct tag_header th;
-        struct tag_strval *tv;
-        size_t data_len = sizeof *tv + file->name_len - 1;
-        tv = (struct tag_strval *) alloca(data_len);
-
-        th.type = TT_STRING;
-        th.name_len = 1;
-        *th.name = TN_FILENAME;
-        tv->len = file->name_len;
-        memcpy(tv->str, file->name, file->name_len);
-
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, tv, data_len);
-    }
+    struct tag_header *th = (struct tag_header *) p;
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT64;
-        th.name_len = 1;
-        *th.name = TN_FILESIZE;
+    th->type = type;
+    th->name_len = 1;
+    *th->name = name;
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->size, sizeof file->size);
-    }
+    return p + sizeof(*th);
+}
 
-    /*if ( files[i].type ) {
-    struct tag_header th;
-    th.type = TT_STRING;
-    th.name_len = 1;
-    *th.name = TN_FILETYPE;
-    //len
-    //type
-    }*/
+static unsigned char *put_named_tag_header(unsigned char *p, uint8_t type, const char *name, uint16_t name_len)
+{
+    struct tag_header *th = (struct tag_header *) p;
 
-    if (file->ext_len) {
-        struct tag_header th;
-        struct tag_strval *tv;
-        size_t data_len = sizeof *tv + file->ext_len - 1;
-        tv = (struct tag_strval *) alloca(data_len);
-
-        th.type = TT_STRING;
-        th.name_len = 1;
-        *th.name = TN_FILEFORMAT;
-        tv->len = file->ext_len;
-        memcpy(tv->str, file->ext, file->ext_len);
-
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, tv, data_len);
-    }
+    th->type = type;
+    th->name_len = name_len;
+    memcpy(th->name, name, name_len);
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT32;
-        th.name_len = 1;
-        *th.name = TN_SOURCES;
+    return p + sizeof(*th) - sizeof(th->name) + name_len;
+}
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->srcavail, sizeof file->srcavail);
-    }
+static unsigned char *put_string(unsigned char *p, const char *str, uint16_t len)
+{
+    *(uint16_t *) p = len;
+    memcpy(p + sizeof(uint16_t), str, len);
+
+    return p + sizeof(uint16_t) + len;
+}
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT32;
-        th.name_len = 1;
-        *th.name = TN_COMPLETE_SOURCES;
+#define PUT_VALUE(p, val) \
+        (memcpy((p), &(val), sizeof(val)), (p) + sizeof(val))
+
+/* upper bound of encoded tags size except variable length strings */
+#define SEARCH_FILE_TAGS_LEN    (10 * (sizeof(struct tag_header) + sizeof(uint16_t) + sizeof(uint64_t)) + \
+                                sizeof(TNS_MEDIA_LENGTH) + sizeof(TNS_MEDIA_BITRATE) + sizeof(TNS_MEDIA_CODEC))
+
+int write_search_file(struct evbuffer *buf, const struct search_file *file)
+{
+    struct evbuffer_iovec vec;
+    struct search_file_entry *sfe;
+    unsigned char *p;
+    size_t max_len = sizeof(*sfe) + SEARCH_FILE_TAGS_LEN + file->name_len + file->ext_len + file->media_codec_len;
+
+    // encode in place, without intermediate buffers
+    if (evbuffer_reserve_space(buf, max_len, &vec, 1) < 1)
+        return 0;
+
+    sfe = (struct search_file_entry *) vec.iov_base;
+    memcpy(sfe->hash, file->hash, sizeof(sfe->hash));
+    sfe->id = file->client_id;
+    sfe->port = file->client_port;
+    sfe->tag_count = 0;
+    p = (unsigned char *) (sfe + 1);
+
+    p = put_tag_header(p, TT_STRING, TN_FILENAME);
+    p = put_string(p, file->name, file->name_len);
+    sfe->tag_count++;
+
+    p = put_tag_header(p, TT_UINT64, TN_FILESIZE);
+    p = PUT_VALUE(p, file->size);
+    sfe->tag_count++;
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->srccomplete, sizeof file->srccomplete);
+    if (file->ext_len) {
+        p = put_tag_header(p, TT_STRING, TN_FILEFORMAT);
+        p = put_string(p, file->ext, file->ext_len);
+        sfe->tag_count++;
     }
 
+    p = put_tag_header(p, TT_UINT32, TN_SOURCES);
+    p = PUT_VALUE(p, file->srcavail);
+    sfe->tag_count++;
+
+    p = put_tag_header(p, TT_UINT32, TN_COMPLETE_SOURCES);
+    p = PUT_VALUE(p, file->srccomplete);
+    sfe->tag_count++;
+
     if (file->rated_count > 0) {
         uint16_t data;
-        struct tag_header th;
-        th.type = TT_UINT16;
-        th.name_len = 1;
-        *th.name = TN_FILERATING;
 
         // lo-byte: percentage rated this file
         data = (100 * (uint8_t) ((float) file->srcavail / (float) file->rated_count)) << 8;
         // hi-byte: average rating
         data += ((uint16_t) floor((double) file->rating / (double) file->rated_count + 0.5f) * 51) & 0xFF;
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &data, sizeof data);
+        p = put_tag_header(p, TT_UINT16, TN_FILERATING);
+        p = PUT_VALUE(p, data);
+        sfe->tag_count++;
     }
 
     if (file->media_length) {
-        struct tag_header *th;
-        uint16_t name_len = sizeof(TNS_MEDIA_LENGTH) - 1;
-
-        size_t th_len = sizeof *th + name_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_LENGTH, name_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, &file->media_length, sizeof file->media_length);
+        p = put_named_tag_header(p, TT_UINT32, TNS_MEDIA_LENGTH, sizeof(TNS_MEDIA_LENGTH) - 1);
+        p = PUT_VALUE(p, file->media_length);
+        sfe->tag_count++;
     }
 
     if (file->media_bitrate) {
-        uint16_t name_len = sizeof(TNS_MEDIA_BITRATE) - 1;
-        struct tag_header *th;
-        size_t th_len = sizeof *th + name_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_BITRATE, name_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, &file->media_bitrate, sizeof(file->media_bitrate));
+        p = put_named_tag_header(p, TT_UINT32, TNS_MEDIA_BITRATE, sizeof(TNS_MEDIA_BITRATE) - 1);
+        p = PUT_VALUE(p, file->media_bitrate);
+        sfe->tag_count++;
     }
 
     if (file->media_codec_len) {
-        struct tag_header *th;
-        struct tag_strval *tv;
-        uint16_t name_len = sizeof(TNS_MEDIA_CODEC) - 1;
-        size_t th_len = sizeof(*th) + name_len - 1;
-        size_t tv_len = sizeof(*tv) + file->media_codec_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        tv = (struct tag_strval *) alloca(tv_len);
-
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_CODEC, name_len);
-
-        tv->len = file->media_codec_len;
-        memcpy(tv->str, file->media_codec, file->media_codec_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, tv, tv_len);
+        p = put_named_tag_header(p, TT_STRING, TNS_MEDIA_CODEC, sizeof(TNS_MEDIA_CODEC) - 1);
+        p = put_string(p, file->media_codec, file->media_codec_len);
+        sfe->tag_count++;
     }
+
+    vec.iov_len = p - (unsigned char *) vec.iov_base;
+    return 0 == evbuffer_commit_space(buf, &vec, 1);
+}
+
+static const struct {
+    const char *str;
+    uint16_t len;
+    uint8_t name;
+} s_string_tag_names[] = {
+        {TNS_MEDIA_LENGTH, sizeof(TNS_MEDIA_LENGTH) - 1, TN_MEDIA_LENGTH},
+        {TNS_MEDIA_BITRATE, sizeof(TNS_MEDIA_BITRATE) - 1, TN_MEDIA_BITRATE},
+        {TNS_MEDIA_CODEC, sizeof(TNS_MEDIA_CODEC) - 1, TN_MEDIA_CODEC}
+};
+
+/* value sizes for fixed-length tag types, 0 for variable length or unsupported */
+static const uint8_t s_tag_value_size[TT_STR16 + 1] = {
+        [TT_HASH16] = ED2K_HASH_SIZE,
+        [TT_UINT32] = sizeof(uint32_t),
+        [TT_FLOAT32] = sizeof(float),
+        [TT_BOOL] = sizeof(uint8_t),
+        [TT_UINT16] = sizeof(uint16_t),
+        [TT_UINT8] = sizeof(uint8_t),
+        [TT_UINT64] = sizeof(uint64_t),
+        [TT_STR1] = 1, [TT_STR2] = 2, [TT_STR3] = 3, [TT_STR4] = 4,
+        [TT_STR5] = 5, [TT_STR6] = 6, [TT_STR7] = 7, [TT_STR8] = 8,
+        [TT_STR9] = 9, [TT_STR10] = 10, [TT_STR11] = 11, [TT_STR12] = 12,
+        [TT_STR13] = 13, [TT_STR14] = 14, [TT_STR15] = 15, [TT_STR16] = 16
+};
+
+static uint8_t get_string_tag_name(const unsigned char *str, uint16_t len)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(s_string_tag_names); ++i) {
+        if ((s_string_tag_names[i].len == len) && (memcmp(s_string_tag_names[i].str, str, len) == 0))
+            return s_string_tag_names[i].name;
+    }
+
+    return 0;
+}
+
+int pb_read_tag(struct packet_buffer *pb, struct tag *tag)
+{
+    const unsigned char *p = pb->ptr;
+    size_t left = PB_LEFT(pb);
+    size_t len, val_len;
+
+    PB_CHECK(left >= 2 * sizeof(uint8_t));
+    tag->type = p[0];
+
+    if (tag->type & TT_NEWTAG_FLAG) {
+        tag->type &= ~TT_NEWTAG_FLAG;
+        tag->name = p[1];
+        len = 2 * sizeof(uint8_t);
+    } else {
+        uint16_t name_len;
+        PB_CHECK(left >= sizeof(uint8_t) + sizeof(uint16_t));
+        name_len = *(uint16_t *) (p + 1);
+        len = sizeof(uint8_t) + sizeof(uint16_t) + name_len;
+        PB_CHECK((name_len > 0) && (left >= len));
+        if (1 == name_len)
+            tag->name = p[3];
+        else
+            tag->name = get_string_tag_name(p + 3, name_len);
+    }
+
+    p += len;
+    left -= len;
+
+    // variable length values carry their length prefix
+    switch (tag->type) {
+        case TT_STRING:
+            PB_CHECK(left >= sizeof(uint16_t));
+            val_len = *(uint16_t *) p;
+            p += sizeof(uint16_t);
+            left -= sizeof(uint16_t);
+            break;
+
+        case TT_BSOB:
+            PB_CHECK(left >= sizeof(uint8_t));
+            val_len = *p;
+            p += sizeof(uint8_t);
+            left -= sizeof(uint8_t);
+            break;
+
+        case TT_BLOB:
+            PB_CHECK(left >= sizeof(uint32_t));
+            val_len = *(uint32_t *) p;
+            p += sizeof(uint32_t);
+            left -= sizeof(uint32_t);
+            break;
+
+        default:
+            PB_CHECK(tag->type < ARRAY_SIZE(s_tag_value_size));
+            val_len = s_tag_value_size[tag->type];
+            PB_CHECK(val_len > 0);
+            break;
+    }
+
+    // single bounds check for the whole value
+    PB_CHECK(left >= val_len);
+
+    switch (tag->type) {
+        case TT_UINT8:
+        case TT_BOOL:
+            tag->int_val = *p;
+            break;
+        case TT_UINT16:
+            tag->int_val = *(uint16_t *) p;
+            break;
+        case TT_UINT32:
+            tag->int_val = *(uint32_t *) p;
+            break;
+        case TT_UINT64:
+            tag->int_val = *(uint64_t *) p;
+            break;
+        case TT_FLOAT32:
+            tag->float_val = *(float *) p;
+            break;
+        default:
+            if ((TT_STR1 <= tag->type) && (TT_STR16 >= tag->type))
+                tag->type = TT_STRING;
+            tag->data_len = val_len;
+            tag->data = p;
+            break;
+    }
+
+    pb->ptr = p + val_len;
+    return 1;
+
+    malformed:
+    return 0;
 }
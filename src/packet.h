@@ -7,6 +7,9 @@
 struct bufferevent;
 struct evbuffer;
 struct file_source;
+struct file_source_obfu;
+struct server_entry;
+struct server_config;
 
 struct search_file {
     const unsigned char *hash;
@@ -36,17 +39,43 @@ void send_server_status(struct bufferevent *bev);
 
 void send_server_ident(struct bufferevent *bev);
 
+/**
+@brief appends preallocated packet(s) to output without copying
+@param cfg   configuration owning data, referenced until data is written to socket
+@param data  packet data
+@param len   data length
+*/
+void send_static(struct bufferevent *bev, const struct server_config *cfg, const unsigned char *data, size_t len);
+
+/**
+@brief sends shared OP_SERVERLIST (see serverlist.h), job workers only
+*/
 void send_server_list(struct bufferevent *bev);
 
+void write_server_list(struct evbuffer *buf, const struct server_entry *servers, size_t count);
+
 void send_reject(struct bufferevent *bev);
 
 void send_callback_fail(struct bufferevent *bev);
 
-void send_found_sources(struct bufferevent *bev, const unsigned char *hash, struct file_source *sources, size_t count);
+void send_callback_requested(struct bufferevent *bev, uint32_t ip, uint16_t port);
 
 void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t count);
 
-void write_search_file(struct evbuffer *buf, const struct search_file *file);
+/**
+@brief encodes one search result entry into buffer
+@return non-zero on success, nothing is written on failure
+*/
+int write_search_file(struct evbuffer *buf, const struct search_file *file);
+
+void write_found_sources(struct evbuffer *buf, const unsigned char *hash, const struct file_source *sources, size_t count);
+
+void write_found_sources_obfu(struct evbuffer *buf, const unsigned char *hash, const struct file_source_obfu *sources,
+        size_t count);
+
+void write_server_message(struct evbuffer *buf, const char *msg, uint16_t len);
+
+void write_server_ident(struct evbuffer *buf, const struct server_config *cfg);
 
 struct packet_buffer {
     const unsigned char *ptr;
@@ -111,4 +140,34 @@ struct packet_buffer {
 #define PB_SKIP_TAGHDR(pb, hdr) \
         PB_SEEK((pb), sizeof(uint8_t)+sizeof(uint16_t)+(hdr)->name_len)
 
+struct tag {
+    /* value type, TT_STR1..TT_STR16 are reported as TT_STRING */
+    uint8_t type;
+    /* integer name, string names are mapped to integer aliases, 0 if unknown */
+    uint8_t name;
+    union {
+        /* TT_UINT8, TT_UINT16, TT_UINT32, TT_UINT64, TT_BOOL */
+        uint64_t int_val;
+        /* TT_FLOAT32 */
+        float float_val;
+        /* TT_STRING, TT_BLOB, TT_BSOB, TT_HASH16 */
+        struct {
+            uint32_t data_len;
+            const unsigned char *data;
+        };
+    };
+};
+
+#define TAG_IS_INT(tag) \
+        ((TT_UINT32 == (tag)->type) || (TT_UINT16 == (tag)->type) || \
+         (TT_UINT8 == (tag)->type) || (TT_UINT64 == (tag)->type))
+
+/**
+@brief decodes old- or new-style tag and moves pb past it
+@param pb   source buffer
+@param tag  decoded tag, data pointers reference pb memory
+@return non-zero on success
+*/
+int pb_read_tag(struct packet_buffer *pb, struct tag *tag);
+
 #endif // ED2KD_PACKET_H
@@ -1,6 +1,9 @@
 #include "portcheck.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -12,8 +15,282 @@
 #include "log.h"
 #include "packet.h"
 #include "ed2k_proto.h"
+#include "metrics.h"
+#include "job.h"
 
-static void send_hello(struct client *clnt)
+/* port check, owned by portcheck thread after it is posted */
+struct portcheck {
+    /* checked client, referenced until check is finished */
+    struct client *clnt;
+    /* copy of client's address and hash */
+    uint32_t ip;
+    uint16_t port;
+    unsigned char hash[ED2K_HASH_SIZE];
+    /* queue or start time (nsecs, monotonic) */
+    uint64_t time;
+    struct bufferevent *bev;
+    struct event *evtimer;
+    /* inbox, queue or running list entry */
+    TAILQ_ENTRY(portcheck) qentry;
+};
+
+TAILQ_HEAD(portcheck_list, portcheck);
+
+static struct {
+    struct event_base *evbase;
+    pthread_t thread;
+    /* activated by job workers when inbox is not empty */
+    struct event *ev_wakeup;
+    /* common timeout, replaced on config reload */
+    _Atomic(const struct timeval *) timeout_tv;
+    /* server hash sent in OP_HELLO */
+    unsigned char hash[ED2K_HASH_SIZE];
+
+    /* guards inbox and stopping flag */
+    pthread_mutex_t inbox_mutex;
+    /* checks posted by job workers */
+    struct portcheck_list inbox;
+    /* thread is stopped or stopping, checks are not posted anymore */
+    unsigned stopping:1;
+
+    /* fields below are used only by portcheck thread */
+    size_t max_inflight;
+    size_t max_per_subnet;
+    /* checks waiting for slot */
+    struct portcheck_list queue;
+    /* checks holding slot */
+    struct portcheck_list running;
+    /* checks in flight per subnet hash */
+    uint32_t subnet_load[1 << PORTCHECK_SUBNET_BITS];
+
+    /* checks holding slot count */
+    atomic_uint32_t inflight;
+    /* posted and queued checks count */
+    atomic_uint32_t pending;
+} s_pc = {
+        .inbox_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .inbox = TAILQ_HEAD_INITIALIZER(s_pc.inbox),
+        .queue = TAILQ_HEAD_INITIALIZER(s_pc.queue),
+        .running = TAILQ_HEAD_INITIALIZER(s_pc.running)
+};
+
+struct pc_cache_entry {
+    uint32_t ip;
+    uint16_t port;
+    unsigned char hash[ED2K_HASH_SIZE];
+    /* expiration time (nsecs, monotonic) */
+    uint64_t expire;
+    /* next entry in bucket */
+    struct pc_cache_entry *next;
+    /* lru list entry, free entries are kept in same list */
+    TAILQ_ENTRY(pc_cache_entry) lru;
+};
+
+TAILQ_HEAD(pc_cache_list, pc_cache_entry);
+
+static struct {
+    pthread_mutex_t mutex;
+    struct pc_cache_entry *entries;
+    struct pc_cache_entry **buckets;
+    /* buckets count - 1 */
+    size_t mask;
+    /* entries in hash, most recently used first */
+    struct pc_cache_list lru;
+    /* unused entries */
+    struct pc_cache_list free;
+    size_t count;
+    uint64_t ttl;
+} s_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static inline size_t cache_bucket(uint32_t ip, uint16_t port, const unsigned char *hash)
+{
+    uint32_t h;
+
+    memcpy(&h, hash, sizeof(h));
+    h ^= ip ^ ((uint32_t) port << 16);
+
+    return (h * 0x9E3779B1u) & s_cache.mask;
+}
+
+/* finds entry and its link in bucket, called under cache lock */
+static struct pc_cache_entry **cache_find(uint32_t ip, uint16_t port, const unsigned char *hash)
+{
+    struct pc_cache_entry **link = &s_cache.buckets[cache_bucket(ip, port, hash)];
+
+    while (*link && !((*link)->ip == ip && (*link)->port == port && hash_equal((*link)->hash, hash)))
+        link = &(*link)->next;
+
+    return link;
+}
+
+static void cache_remove(struct pc_cache_entry **link)
+{
+    struct pc_cache_entry *e = *link;
+
+    *link = e->next;
+    TAILQ_REMOVE(&s_cache.lru, e, lru);
+    TAILQ_INSERT_HEAD(&s_cache.free, e, lru);
+    s_cache.count--;
+}
+
+int portcheck_cache_init(size_t size, unsigned ttl_sec)
+{
+    size_t i, buckets = 1;
+
+    TAILQ_INIT(&s_cache.lru);
+    TAILQ_INIT(&s_cache.free);
+
+    if (!size)
+        return 1;
+
+    while (buckets < size)
+        buckets <<= 1;
+
+    s_cache.entries = (struct pc_cache_entry *) calloc(size, sizeof(*s_cache.entries));
+    s_cache.buckets = (struct pc_cache_entry **) calloc(buckets, sizeof(*s_cache.buckets));
+    if (!s_cache.entries || !s_cache.buckets) {
+        ED2KD_LOGERR("failed to allocate portcheck cache");
+        portcheck_cache_free();
+        return 0;
+    }
+
+    for (i = 0; i < size; ++i) {
+        TAILQ_INSERT_TAIL(&s_cache.free, &s_cache.entries[i], lru);
+    }
+    s_cache.mask = buckets - 1;
+    s_cache.count = 0;
+    s_cache.ttl = (uint64_t) ttl_sec * 1000000000;
+
+    return 1;
+}
+
+void portcheck_cache_free(void)
+{
+    free(s_cache.entries);
+    free(s_cache.buckets);
+    s_cache.entries = NULL;
+    s_cache.buckets = NULL;
+    s_cache.count = 0;
+}
+
+size_t portcheck_cache_count(void)
+{
+    size_t count;
+
+    pthread_mutex_lock(&s_cache.mutex);
+    count = s_cache.count;
+    pthread_mutex_unlock(&s_cache.mutex);
+
+    return count;
+}
+
+/**
+@return non-zero if client passed check recently
+*/
+static int cache_lookup(const struct client *clnt, uint64_t now)
+{
+    struct pc_cache_entry **link;
+    int found = 0;
+
+    if (!s_cache.buckets)
+        return 0;
+
+    pthread_mutex_lock(&s_cache.mutex);
+    link = cache_find(clnt->ip, clnt->port, clnt->hash);
+    if (*link) {
+        if ((*link)->expire > now) {
+            TAILQ_REMOVE(&s_cache.lru, *link, lru);
+            TAILQ_INSERT_HEAD(&s_cache.lru, *link, lru);
+            found = 1;
+        } else {
+            cache_remove(link);
+        }
+    }
+    pthread_mutex_unlock(&s_cache.mutex);
+
+    return found;
+}
+
+static void cache_add(const struct portcheck *pc, uint64_t now)
+{
+    struct pc_cache_entry **link, *e;
+
+    if (!s_cache.buckets)
+        return;
+
+    pthread_mutex_lock(&s_cache.mutex);
+    link = cache_find(pc->ip, pc->port, pc->hash);
+    if (*link) {
+        e = *link;
+        TAILQ_REMOVE(&s_cache.lru, e, lru);
+    } else {
+        if (TAILQ_EMPTY(&s_cache.free)) {
+            // evict least recently used
+            const struct pc_cache_entry *last = TAILQ_LAST(&s_cache.lru, pc_cache_list);
+            struct pc_cache_entry **last_link = &s_cache.buckets[cache_bucket(last->ip, last->port, last->hash)];
+
+            while (*last_link != last)
+                last_link = &(*last_link)->next;
+            cache_remove(last_link);
+        }
+
+        e = TAILQ_FIRST(&s_cache.free);
+        TAILQ_REMOVE(&s_cache.free, e, lru);
+        e->ip = pc->ip;
+        e->port = pc->port;
+        memcpy(e->hash, pc->hash, sizeof(e->hash));
+        e->next = *link;
+        *link = e;
+        s_cache.count++;
+    }
+    e->expire = now + s_cache.ttl;
+    TAILQ_INSERT_HEAD(&s_cache.lru, e, lru);
+    pthread_mutex_unlock(&s_cache.mutex);
+}
+
+static inline uint32_t *subnet_load(const struct portcheck *pc)
+{
+    uint32_t subnet = ntohl(pc->ip) >> 8;
+    return &s_pc.subnet_load[(subnet * 0x9E3779B1u) >> (32 - PORTCHECK_SUBNET_BITS)];
+}
+
+static void portcheck_free_check(struct portcheck *pc)
+{
+    if (pc->bev)
+        bufferevent_free(pc->bev);
+    if (pc->evtimer)
+        event_free(pc->evtimer);
+    client_decref(pc->clnt);
+    free(pc);
+}
+
+/* releases slot and posts result to client's job worker */
+static void complete(struct portcheck *pc, enum portcheck_result result)
+{
+    uint64_t now = metrics_now();
+
+    TAILQ_REMOVE(&s_pc.running, pc, qentry);
+    atomic_fetch_sub(&s_pc.inflight, 1);
+    (*subnet_load(pc))--;
+    metrics_record(MH_PORTCHECK, now - pc->time);
+
+    if (PORTCHECK_SUCCESS == result)
+        cache_add(pc, now);
+
+    if (!atomic_load(&pc->clnt->deleted)) {
+        struct job_portcheck *job = (struct job_portcheck *) calloc(1, sizeof(*job));
+        if (job) {
+            job->hdr.type = JOB_PORTCHECK_RESULT;
+            job->hdr.clnt = pc->clnt;
+            job->result = result;
+            server_add_job((struct job *) job);
+        }
+    }
+
+    portcheck_free_check(pc);
+}
+
+static void send_hello(struct portcheck *pc)
 {
     static const char name[] = {'e', 'd', '2', 'k', 'd'};
     struct packet_hello data;
@@ -22,7 +299,7 @@ static void send_hello(struct client *clnt)
     socklen_t sa_len;
 
     // get local ip addr
-    fd = bufferevent_getfd(clnt->bev_pc);
+    fd = bufferevent_getfd(pc->bev);
     sa_len = sizeof(sa);
     getsockname(fd, (struct sockaddr *) &sa, &sa_len);
 
@@ -30,26 +307,26 @@ static void send_hello(struct client *clnt)
     data.hdr.length = sizeof(data) - sizeof(data.hdr);
     data.opcode = OP_HELLO;
     data.hash_size = 16;
-    memcpy(data.hash, g_srv.cfg->hash, sizeof data.hash);
+    memcpy(data.hash, s_pc.hash, sizeof data.hash);
     data.client_id = ntohl(sa.sin_addr.s_addr);
     data.client_port = 4662;
     data.tag_count = 2;
-    data.tag_name.type = TT_STR5 | 0x80;
+    data.tag_name.type = TT_STR5 | TT_NEWTAG_FLAG;
     data.tag_name.name = TN_NAME;
     memcpy(data.tag_name.value, name, sizeof(data.tag_name.value));
-    data.tag_version.type = TT_UINT8 | 0x80;
+    data.tag_version.type = TT_UINT8 | TT_NEWTAG_FLAG;
     data.tag_version.name = TN_VERSION;
     data.tag_version.value = EDONKEYVERSION;
     data.ip = 0;
     data.port = 0;
 
-    bufferevent_write(clnt->bev_pc, &data, sizeof data);
+    bufferevent_write(pc->bev, &data, sizeof data);
 }
 
-static int process_hello_answer(struct packet_buffer *pb, struct client *clnt)
+static int process_hello_answer(struct packet_buffer *pb, const struct portcheck *pc)
 {
     PB_CHECK(PB_LEFT(pb) > ED2K_HASH_SIZE);
-    PB_CHECK(memcmp(clnt->hash, pb->ptr, ED2K_HASH_SIZE) == 0);
+    PB_CHECK(hash_equal(pc->hash, pb->ptr));
 
     return 1;
 
@@ -57,34 +334,44 @@ static int process_hello_answer(struct packet_buffer *pb, struct client *clnt)
     return 0;
 }
 
-static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct client *clnt)
+/**
+@return -1 on malformed packet, 1 on hello answer, 0 otherwise
+*/
+static int process_packet(struct packet_buffer *pb, uint8_t opcode, const struct portcheck *pc)
 {
     switch (opcode) {
         case OP_HELLOANSWER:
-            PB_CHECK(process_hello_answer(pb, clnt));
-            client_portcheck_finish(clnt, PORTCHECK_SUCCESS);
-            break;
+            PB_CHECK(process_hello_answer(pb, pc));
+            return 1;
     }
 
-    return 1;
+    return 0;
 
     malformed:
     ED2KD_LOGDBG("malformed portcheck packet (opcode:%u)", opcode);
-    return 0;
+    return -1;
 }
 
-void portcheck_read(struct client *clnt)
+static void dispatch_pending(void);
+
+static void finish(struct portcheck *pc, enum portcheck_result result)
 {
-    struct evbuffer *input;
-    size_t src_len;
+    complete(pc, result);
+    dispatch_pending();
+}
 
-    if (clnt->portcheck_finished)
-        return;
+static void portcheck_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct portcheck *pc = (struct portcheck *) ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t src_len = evbuffer_get_length(input);
 
-    input = bufferevent_get_input(clnt->bev_pc);
-    src_len = evbuffer_get_length(input);
+    if (atomic_load(&pc->clnt->deleted)) {
+        finish(pc, PORTCHECK_FAILED);
+        return;
+    }
 
-    while (!clnt->deleted && src_len > sizeof(struct packet_header)) {
+    while (src_len > sizeof(struct packet_header)) {
         unsigned char *data;
         struct packet_buffer pb;
         size_t packet_len;
@@ -93,8 +380,8 @@ void portcheck_read(struct client *clnt)
                 (struct packet_header *) evbuffer_pullup(input, sizeof(struct packet_header));
 
         if ((PROTO_PACKED != header->proto) && (PROTO_EDONKEY != header->proto)) {
-            ED2KD_LOGDBG("unknown packet protocol from %s:%u", clnt->dbg.ip_str, clnt->port);
-            client_portcheck_finish(clnt, PORTCHECK_FAILED);
+            ED2KD_LOGDBG("unknown packet protocol from %s:%u", pc->clnt->dbg.ip_str, pc->port);
+            finish(pc, PORTCHECK_FAILED);
             return;
         }
 
@@ -114,48 +401,240 @@ void portcheck_read(struct client *clnt)
             ret = uncompress(unpacked, &unpacked_len, data + 1, header->length - 1);
             if (Z_OK == ret) {
                 PB_INIT(&pb, unpacked, unpacked_len);
-                ret = process_packet(&pb, *data, clnt);
+                ret = process_packet(&pb, *data, pc);
             } else {
-                ED2KD_LOGDBG("failed to unpack packet from %s:%u", clnt->dbg.ip_str, clnt->port);
-                ret = 0;
+                ED2KD_LOGDBG("failed to unpack packet from %s:%u", pc->clnt->dbg.ip_str, pc->port);
+                ret = -1;
             }
             free(unpacked);
         } else {
             PB_INIT(&pb, data + 1, header->length - 1);
-            ret = process_packet(&pb, *data, clnt);
+            ret = process_packet(&pb, *data, pc);
         }
 
-        if (!ret) {
-            client_portcheck_finish(clnt, PORTCHECK_FAILED);
+        if (ret) {
+            finish(pc, ret > 0 ? PORTCHECK_SUCCESS : PORTCHECK_FAILED);
             return;
         }
 
-        if (clnt->portcheck_finished)
-            return;
-
         evbuffer_drain(input, packet_len);
         src_len = evbuffer_get_length(input);
     }
 }
 
-void portcheck_timeout(struct client *clnt)
+static void portcheck_event_cb(struct bufferevent *bev, short events, void *ctx)
 {
-    if (clnt->portcheck_finished)
+    struct portcheck *pc = (struct portcheck *) ctx;
+
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        finish(pc, PORTCHECK_FAILED);
+    } else if (events & BEV_EVENT_CONNECTED) {
+        bufferevent_enable(bev, EV_READ | EV_WRITE);
+        send_hello(pc);
+    }
+}
+
+static void portcheck_timeout_cb(evutil_socket_t fd, short events, void *ctx)
+{
+    struct portcheck *pc = (struct portcheck *) ctx;
+    (void) fd;
+    (void) events;
+
+    ED2KD_LOGDBG("port check timeout for %s", pc->clnt->dbg.ip_str);
+    finish(pc, PORTCHECK_FAILED);
+}
+
+/**
+@return non-zero if connection is started
+*/
+static int start(struct portcheck *pc)
+{
+    struct sockaddr_in client_sa;
+
+    memset(&client_sa, 0, sizeof(client_sa));
+    client_sa.sin_family = AF_INET;
+    client_sa.sin_addr.s_addr = pc->ip;
+    client_sa.sin_port = htons(pc->port);
+
+    pc->bev = bufferevent_socket_new(s_pc.evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+    pc->evtimer = evtimer_new(s_pc.evbase, portcheck_timeout_cb, pc);
+    if (!pc->bev || !pc->evtimer)
+        return 0;
+
+    bufferevent_setcb(pc->bev, portcheck_read_cb, NULL, portcheck_event_cb, pc);
+    if (bufferevent_socket_connect(pc->bev, (struct sockaddr *) &client_sa, sizeof(client_sa)) < 0)
+        return 0;
+
+    evtimer_add(pc->evtimer, s_pc.timeout_tv);
+
+    return 1;
+}
+
+/* starts queued checks which fit into limits */
+static void dispatch_pending(void)
+{
+    struct portcheck *pc, *tmp;
+    size_t skipped = 0;
+    uint64_t now = metrics_now();
+
+    TAILQ_FOREACH_SAFE(pc, &s_pc.queue, qentry, tmp) {
+        if (atomic_load(&s_pc.inflight) >= s_pc.max_inflight || skipped >= PORTCHECK_MAX_SCAN)
+            break;
+
+        // client disconnected while waiting
+        if (atomic_load(&pc->clnt->deleted)) {
+            TAILQ_REMOVE(&s_pc.queue, pc, qentry);
+            atomic_fetch_sub(&s_pc.pending, 1);
+            portcheck_free_check(pc);
+            continue;
+        }
+
+        if (*subnet_load(pc) >= s_pc.max_per_subnet) {
+            skipped++;
+            continue;
+        }
+
+        TAILQ_REMOVE(&s_pc.queue, pc, qentry);
+        atomic_fetch_sub(&s_pc.pending, 1);
+        metrics_record(MH_PORTCHECK_QUEUE, now - pc->time);
+
+        TAILQ_INSERT_TAIL(&s_pc.running, pc, qentry);
+        atomic_fetch_add(&s_pc.inflight, 1);
+        (*subnet_load(pc))++;
+        pc->time = now;
+
+        if (!start(pc))
+            complete(pc, PORTCHECK_FAILED);
+    }
+}
+
+static void wakeup_cb(evutil_socket_t fd, short events, void *ctx)
+{
+    (void) fd;
+    (void) events;
+    (void) ctx;
+
+    pthread_mutex_lock(&s_pc.inbox_mutex);
+    TAILQ_CONCAT(&s_pc.queue, &s_pc.inbox, qentry);
+    pthread_mutex_unlock(&s_pc.inbox_mutex);
+
+    dispatch_pending();
+}
+
+int portcheck_init(size_t max_inflight, size_t max_per_subnet, const struct timeval *timeout)
+{
+    s_pc.max_inflight = max_inflight;
+    s_pc.max_per_subnet = max_per_subnet;
+    // configuration is not read by port check thread
+    memcpy(s_pc.hash, g_srv.cfg->hash, sizeof(s_pc.hash));
+
+    s_pc.evbase = event_base_new();
+    if (!s_pc.evbase) {
+        ED2KD_LOGERR("failed to create portcheck event loop");
+        return 0;
+    }
+
+    s_pc.ev_wakeup = event_new(s_pc.evbase, -1, 0, wakeup_cb, NULL);
+    atomic_init(&s_pc.timeout_tv, event_base_init_common_timeout(s_pc.evbase, timeout));
+
+    if (pthread_create(&s_pc.thread, NULL, server_base_worker, s_pc.evbase)) {
+        ED2KD_LOGERR("failed to start portcheck thread");
+        event_free(s_pc.ev_wakeup);
+        event_base_free(s_pc.evbase);
+        s_pc.evbase = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+int portcheck_set_timeout(const struct timeval *timeout)
+{
+    const struct timeval *tv = event_base_init_common_timeout(s_pc.evbase, timeout);
+
+    if (!tv)
+        return 0;
+
+    atomic_store(&s_pc.timeout_tv, tv);
+
+    return 1;
+}
+
+void portcheck_free(void)
+{
+    struct portcheck *pc;
+
+    if (!s_pc.evbase)
         return;
 
-    ED2KD_LOGDBG("port check timeout for %s", clnt->dbg.ip_str);
-    client_portcheck_finish(clnt, PORTCHECK_FAILED);
+    pthread_mutex_lock(&s_pc.inbox_mutex);
+    s_pc.stopping = 1;
+    pthread_mutex_unlock(&s_pc.inbox_mutex);
+
+    event_base_loopbreak(s_pc.evbase);
+    pthread_join(s_pc.thread, NULL);
+
+    pthread_mutex_lock(&s_pc.inbox_mutex);
+    TAILQ_CONCAT(&s_pc.queue, &s_pc.inbox, qentry);
+    pthread_mutex_unlock(&s_pc.inbox_mutex);
+    TAILQ_CONCAT(&s_pc.queue, &s_pc.running, qentry);
+    while ((pc = TAILQ_FIRST(&s_pc.queue))) {
+        TAILQ_REMOVE(&s_pc.queue, pc, qentry);
+        portcheck_free_check(pc);
+    }
+
+    event_free(s_pc.ev_wakeup);
+    event_base_free(s_pc.evbase);
+    s_pc.evbase = NULL;
 }
 
-void portcheck_event(struct client *clnt, short events)
+void portcheck_schedule(struct client *clnt)
 {
-    if (clnt->portcheck_finished)
+    struct portcheck *pc;
+    uint64_t now;
+
+    // repeated login must not post another check
+    if (clnt->portcheck_posted)
         return;
+    clnt->portcheck_posted = 1;
 
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    now = metrics_now();
+    if (cache_lookup(clnt, now)) {
+        metrics_add(MC_PORTCHECK_CACHE_HIT, 1);
+        client_portcheck_finish(clnt, PORTCHECK_SUCCESS);
+        return;
+    }
+    metrics_add(MC_PORTCHECK_CACHE_MISS, 1);
+
+    pc = (struct portcheck *) calloc(1, sizeof(*pc));
+    if (!pc) {
         client_portcheck_finish(clnt, PORTCHECK_FAILED);
-    } else if (events & BEV_EVENT_CONNECTED) {
-        bufferevent_enable(clnt->bev_pc, EV_READ | EV_WRITE);
-        send_hello(clnt);
+        return;
+    }
+
+    client_addref(clnt);
+    pc->clnt = clnt;
+    pc->ip = clnt->ip;
+    pc->port = clnt->port;
+    memcpy(pc->hash, clnt->hash, sizeof(pc->hash));
+    pc->time = now;
+
+    pthread_mutex_lock(&s_pc.inbox_mutex);
+    // workers may still process logins while server is terminating
+    if (s_pc.stopping) {
+        pthread_mutex_unlock(&s_pc.inbox_mutex);
+        portcheck_free_check(pc);
+        return;
     }
+    atomic_fetch_add(&s_pc.pending, 1);
+    TAILQ_INSERT_TAIL(&s_pc.inbox, pc, qentry);
+    // wakeup event is freed only after stopping flag is set
+    event_active(s_pc.ev_wakeup, EV_READ, 0);
+    pthread_mutex_unlock(&s_pc.inbox_mutex);
+}
+
+void portcheck_queue_stats(size_t *inflight, size_t *pending)
+{
+    *inflight = atomic_load(&s_pc.inflight);
+    *pending = atomic_load(&s_pc.pending);
 }
@@ -3,14 +3,75 @@
 
 /*
   @file portcheck.h
+
+  Port checks run on their own event loop thread, HELLO and HELLOANSWER
+  are handled there without job queue. Result is posted back to client as
+  JOB_PORTCHECK_RESULT job. Loop thread limits checks in flight, in total
+  and per destination /24 subnet; checks over limit wait in FIFO queue.
+  Successful results are cached, so reconnecting clients get high id
+  without new check.
 */
 
+#include <stddef.h>
+
+#define PORTCHECK_MAX_INFLIGHT      1024
+#define PORTCHECK_MAX_PER_SUBNET    16
+/* hashed subnet counters, collisions only make limit stricter */
+#define PORTCHECK_SUBNET_BITS       12
+/* queued checks of busy subnets skipped per dispatch */
+#define PORTCHECK_MAX_SCAN          64
+#define PORTCHECK_CACHE_SIZE        65536
+#define PORTCHECK_CACHE_TTL         600 // secs
+
 struct client;
+struct timeval;
+
+/**
+@brief starts port check thread
+@param max_inflight maximum checks in flight
+@param max_per_subnet maximum checks in flight to one /24 subnet
+@param timeout check timeout
+@return non-zero on success
+*/
+int portcheck_init(size_t max_inflight, size_t max_per_subnet, const struct timeval *timeout);
 
-void portcheck_read(struct client *client);
+/**
+@brief changes timeout of checks started after this call
+@return non-zero on success
+*/
+int portcheck_set_timeout(const struct timeval *timeout);
 
-void portcheck_event(struct client *client, short events);
+/**
+@brief stops port check thread and drops unfinished checks, checks
+scheduled by job workers afterwards are dropped too
+*/
+void portcheck_free(void);
 
-void portcheck_timeout(struct client *clnt);
+/**
+@brief allocates cache of successful checks keyed by ip, port and user hash
+@param size maximum entries, least recently used are evicted, 0 disables cache
+@param ttl_sec entry lifetime, hits don't extend it
+@return non-zero on success
+*/
+int portcheck_cache_init(size_t size, unsigned ttl_sec);
+
+void portcheck_cache_free(void);
+
+/**
+@return cached entries count
+*/
+size_t portcheck_cache_count(void);
+
+/**
+@brief finishes check of locked client at once if its recent check succeeded,
+otherwise posts check to port check thread, does nothing while previous
+check of client is not finished
+*/
+void portcheck_schedule(struct client *clnt);
+
+/**
+@brief current port check thread load
+*/
+void portcheck_queue_stats(size_t *inflight, size_t *pending);
 
 #endif // ED2KD_PORTCHECK_H
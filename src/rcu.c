@@ -0,0 +1,136 @@
+#include "rcu.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "util.h"
+
+struct rcu_thread {
+    /* global epoch at going online, 0 while offline */
+    atomic_uint64_t seen;
+    /* next registered thread */
+    struct rcu_thread *next;
+};
+
+static THREAD_LOCAL struct rcu_thread *s_thread;
+
+static struct {
+    /* guards threads list and retired objects list */
+    pthread_mutex_t mutex;
+    atomic_uint64_t epoch;
+    struct rcu_thread *threads;
+    /* retired objects in epoch order */
+    struct rcu_head *head;
+    struct rcu_head **tail;
+    /* retired objects count */
+    atomic_uint32_t pending;
+} s_rcu = {.mutex = PTHREAD_MUTEX_INITIALIZER, .epoch = 1, .tail = &s_rcu.head};
+
+/* called with mutex held */
+static void reclaim(void)
+{
+    uint64_t min_seen = atomic_load(&s_rcu.epoch);
+    struct rcu_thread *thread;
+
+    for (thread = s_rcu.threads; thread; thread = thread->next) {
+        uint64_t seen = atomic_load(&thread->seen);
+        if (seen && seen < min_seen)
+            min_seen = seen;
+    }
+
+    // object retired in epoch e may be referenced only by threads online since epoch <= e
+    while (s_rcu.head && s_rcu.head->epoch < min_seen) {
+        struct rcu_head *head = s_rcu.head;
+
+        s_rcu.head = head->next;
+        if (!s_rcu.head)
+            s_rcu.tail = &s_rcu.head;
+        atomic_fetch_sub(&s_rcu.pending, 1);
+
+        head->free_fn(head);
+    }
+}
+
+int rcu_register_thread(void)
+{
+    struct rcu_thread *thread = (struct rcu_thread *) calloc(1, sizeof(*thread));
+
+    if (!thread)
+        return 0;
+
+    pthread_mutex_lock(&s_rcu.mutex);
+    thread->next = s_rcu.threads;
+    s_rcu.threads = thread;
+    pthread_mutex_unlock(&s_rcu.mutex);
+
+    s_thread = thread;
+
+    return 1;
+}
+
+void rcu_unregister_thread(void)
+{
+    struct rcu_thread **prev;
+
+    if (!s_thread)
+        return;
+
+    pthread_mutex_lock(&s_rcu.mutex);
+    for (prev = &s_rcu.threads; *prev != s_thread; prev = &(*prev)->next);
+    *prev = s_thread->next;
+    reclaim();
+    pthread_mutex_unlock(&s_rcu.mutex);
+
+    free(s_thread);
+    s_thread = NULL;
+}
+
+void rcu_online(void)
+{
+    if (s_thread) {
+        atomic_store(&s_thread->seen, atomic_load(&s_rcu.epoch));
+        // following reads must not be done before writers can see thread online
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void rcu_offline(void)
+{
+    if (!s_thread)
+        return;
+
+    atomic_store(&s_thread->seen, 0);
+
+    // reclamation is not worth waiting for
+    if (atomic_load(&s_rcu.pending) && !pthread_mutex_trylock(&s_rcu.mutex)) {
+        reclaim();
+        pthread_mutex_unlock(&s_rcu.mutex);
+    }
+}
+
+void rcu_retire(struct rcu_head *head, void (*free_fn)(struct rcu_head *head))
+{
+    head->next = NULL;
+    head->free_fn = free_fn;
+
+    pthread_mutex_lock(&s_rcu.mutex);
+    head->epoch = atomic_fetch_add(&s_rcu.epoch, 1);
+    *s_rcu.tail = head;
+    s_rcu.tail = &head->next;
+    atomic_fetch_add(&s_rcu.pending, 1);
+    reclaim();
+    pthread_mutex_unlock(&s_rcu.mutex);
+}
+
+void rcu_free(void)
+{
+    pthread_mutex_lock(&s_rcu.mutex);
+    while (s_rcu.head) {
+        struct rcu_head *head = s_rcu.head;
+        s_rcu.head = head->next;
+        head->free_fn(head);
+    }
+    s_rcu.tail = &s_rcu.head;
+    atomic_store(&s_rcu.pending, 0);
+    pthread_mutex_unlock(&s_rcu.mutex);
+}
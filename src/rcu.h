@@ -0,0 +1,53 @@
+#ifndef ED2KD_RCU_H
+#define ED2KD_RCU_H
+
+/**
+@file rcu.h quiescent state based memory reclamation
+
+Registered threads (job and udp workers, admin) read shared structures
+without locks while they are online, i.e. while processing job, datagrams
+batch or admin command. Writers unlink object and retire it, object is
+freed when every thread which was online at that moment went offline at
+least once. Unregistered threads are never readers.
+*/
+
+#include <stdint.h>
+
+/* embedded into retired object */
+struct rcu_head {
+    struct rcu_head *next;
+    /* global epoch at retirement */
+    uint64_t epoch;
+    void (*free_fn)(struct rcu_head *head);
+};
+
+/**
+@brief registers calling thread as reader, thread starts offline
+@return non-zero on success
+*/
+int rcu_register_thread(void);
+
+void rcu_unregister_thread(void);
+
+/**
+@brief marks start of read-side section
+*/
+void rcu_online(void);
+
+/**
+@brief marks quiescent state, reader holds no pointers to shared objects after this call
+*/
+void rcu_offline(void);
+
+/**
+@brief frees object after grace period, object must be already unlinked
+@param free_fn called from arbitrary thread, must not retire objects
+*/
+void rcu_retire(struct rcu_head *head, void (*free_fn)(struct rcu_head *head));
+
+/**
+@brief frees all retired objects, no reader may be online
+*/
+void rcu_free(void);
+
+#endif // ED2KD_RCU_H
@@ -12,6 +12,30 @@
 #include "portcheck.h"
 #include "db.h"
 #include "log.h"
+#include "arena.h"
+#include "metrics.h"
+#include "jobtrace.h"
+#include "idmap.h"
+#include "rcu.h"
+
+#define JOB_ARENA_BLOCK_SIZE (MAX_UNCOMPRESSED_PACKET_SIZE + MAX_SEARCH_FILES * sizeof(struct pub_file))
+
+/* per-worker memory for packet parsing, released after each job */
+static THREAD_LOCAL struct arena s_arena;
+
+/* OP_GETSOURCES(_OBFU) of current read, answered together */
+static THREAD_LOCAL struct {
+    size_t count;
+    unsigned char hashes[MAX_GETSOURCES_BATCH * ED2K_HASH_SIZE];
+    /* non-zero for OP_GETSOURCES_OBFU */
+    uint8_t obfu[MAX_GETSOURCES_BATCH];
+} s_sources_batch;
+
+/* time current worker finished its last job (nsecs, monotonic) */
+static THREAD_LOCAL uint64_t s_idle_start;
+
+_Static_assert(MH_JOB_WAIT_CALLBACK_REQUESTED - MH_JOB_WAIT_SERVER_EVENT + 1 == JOB_TYPE_COUNT, "job wait histograms mismatch");
+_Static_assert(MH_JOB_SERVICE_CALLBACK_REQUESTED - MH_JOB_SERVICE_SERVER_EVENT + 1 == JOB_TYPE_COUNT, "job service histograms mismatch");
 
 static void dummy_cb(evutil_socket_t fd, short what, void *ctx)
 {
@@ -37,15 +61,88 @@ void *server_base_worker(void *arg)
 
 void server_add_job(struct job *job)
 {
+    job->enqueue_time = metrics_now();
+    metrics_add(MC_JOBS_ENQUEUED, 1);
+
     pthread_mutex_lock(&g_srv.job_mutex);
     client_addref(job->clnt);
     TAILQ_INSERT_TAIL(&g_srv.jqueue, job, qentry);
+    ++g_srv.job_count;
     pthread_mutex_unlock(&g_srv.job_mutex);
     pthread_cond_signal(&g_srv.job_cond);
 }
 
+struct job *server_get_job(void)
+{
+    struct job *job = 0;
+
+    // no client pointers are kept between jobs
+    rcu_offline();
+
+    pthread_mutex_lock(&g_srv.job_mutex);
+    for (; ;) {
+        struct job *j, *jtmp;
+
+        if (atomic_load(&g_srv.terminate))
+            break;
+
+        TAILQ_FOREACH_SAFE(j, &g_srv.jqueue, qentry, jtmp) {
+            uint32_t old_val = 0;
+            if (atomic_compare_exchange_strong(&j->clnt->locked, &old_val, 1)) {
+                TAILQ_REMOVE(&g_srv.jqueue, j, qentry);
+                --g_srv.job_count;
+                job = j;
+                break;
+            }
+        }
+
+        if (job)
+            break;
+
+        pthread_cond_wait(&g_srv.job_cond, &g_srv.job_mutex);
+    }
+    pthread_mutex_unlock(&g_srv.job_mutex);
+
+    if (job) {
+        rcu_online();
+        job->start_time = metrics_now();
+        metrics_add(MC_JOBS_DEQUEUED, 1);
+        metrics_record(MH_JOB_WAIT_SERVER_EVENT + job->type, job->start_time - job->enqueue_time);
+        if (s_idle_start)
+            metrics_worker_time(0, job->start_time - s_idle_start);
+    }
+
+    return job;
+}
+
+size_t server_job_queue_depth(void)
+{
+    size_t count;
+
+    // enqueue/dequeue counters are read without common cut, so real queue length is used
+    pthread_mutex_lock(&g_srv.job_mutex);
+    count = g_srv.job_count;
+    pthread_mutex_unlock(&g_srv.job_mutex);
+
+    return count;
+}
+
+void server_release_job(struct job *job)
+{
+    // job end is also idle start, so only one clock read is added per job
+    s_idle_start = metrics_now();
+    metrics_record(MH_JOB_SERVICE_SERVER_EVENT + job->type, s_idle_start - job->start_time);
+    metrics_worker_time(s_idle_start - job->start_time, 0);
+    jobtrace_record(job, s_idle_start);
+
+    atomic_store(&job->clnt->locked, 0);
+    client_decref(job->clnt);
+    free(job);
+}
+
 static int process_login_request(struct packet_buffer *pb, struct client *clnt)
 {
+    struct client *old;
     uint32_t tag_count;
 
     // user hash 16b
@@ -61,59 +158,58 @@ static int process_login_request(struct packet_buffer *pb, struct client *clnt)
     PB_READ_UINT32(pb, tag_count);
 
     for (; tag_count > 0; --tag_count) {
-        const struct tag_header *tag_hdr = (struct tag_header *) pb->ptr;
-
-        // no new tags allowed here
-        PB_CHECK((tag_hdr->type & 0x80) == 0);
-
-        // only int-based tag names
-        PB_CHECK(1 == tag_hdr->name_len);
+        struct tag tag;
 
-        PB_SKIP_TAGHDR(pb, tag_hdr);
+        PB_CHECK(pb_read_tag(pb, &tag));
 
-        switch (*tag_hdr->name) {
+        switch (tag.name) {
             case TN_NAME: {
-                PB_CHECK(TT_STRING == tag_hdr->type);
-                clnt->nick_len = MAX_NICK_LEN;
-                PB_READ_STRING(pb, clnt->nick, clnt->nick_len);
-                clnt->nick[clnt->nick_len] = 0;
+                uint16_t nick_len;
+                char *nick;
+
+                PB_CHECK(TT_STRING == tag.type);
+                nick_len = tag.data_len > MAX_NICK_LEN ? MAX_NICK_LEN : tag.data_len;
+                nick = (char *) malloc(nick_len + 1);
+                PB_CHECK(nick);
+                memcpy(nick, tag.data, nick_len);
+                nick[nick_len] = 0;
+
+                // admin reads nick without lock, it is not changed after client is indexed
+                free(clnt->nick);
+                clnt->nick = nick;
+                clnt->nick_len = nick_len;
                 break;
             }
 
             case TN_PORT:
-                PB_CHECK(TT_UINT16 == tag_hdr->type);
-                PB_READ_UINT16(pb, clnt->port);
+                PB_CHECK(TAG_IS_INT(&tag));
+                clnt->port = tag.int_val;
                 break;
 
-            case TN_VERSION: {
-                uint32_t ver;
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, ver);
-                PB_CHECK(EDONKEYVERSION == ver);
+            case TN_VERSION:
+                PB_CHECK(TAG_IS_INT(&tag));
+                PB_CHECK(EDONKEYVERSION == tag.int_val);
                 break;
-            }
 
             case TN_SERVER_FLAGS:
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, clnt->tcp_flags);
+                PB_CHECK(TAG_IS_INT(&tag));
+                clnt->tcp_flags = tag.int_val;
                 break;
 
-            case TN_EMULE_VERSION: {
-                uint32_t emule_ver;
-                (void) emule_ver;
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, emule_ver);
-                break;
-            }
-
             default:
-                PB_CHECK(0);
+                // skip unknown tags (TN_EMULE_VERSION, etc.)
+                break;
         }
     }
 
-    // todo: search already connected with same ip:port
+    // client reconnected before old connection was closed
+    if ((old = idmap_find(clnt->ip, clnt->port))) {
+        ED2KD_LOGDBG("dropping previous connection of %s:%u", clnt->dbg.ip_str, clnt->port);
+        server_event_cb(NULL, BEV_EVENT_EOF, old);
+        client_decref(old);
+    }
 
-    client_portcheck_start(clnt);
+    portcheck_schedule(clnt);
 
     return 1;
 
@@ -121,7 +217,7 @@ static int process_login_request(struct packet_buffer *pb, struct client *clnt)
     return 0;
 }
 
-static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
+int parse_offer_files(struct packet_buffer *pb, struct arena *arena, struct pub_file **out_files, size_t *out_count)
 {
     size_t i;
     uint32_t count;
@@ -131,9 +227,9 @@ static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
     PB_CHECK(count <= 200);
 
     i = count;
-    // todo: limit total files count on server
 
-    cur_file = files = (struct pub_file *) calloc(count, sizeof(*files));
+    cur_file = files = (struct pub_file *) arena_zalloc(arena, count * sizeof(*files));
+    PB_CHECK(files);
 
     while (i-- > 0) {
         uint32_t tag_count, id;
@@ -151,92 +247,70 @@ static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
         PB_READ_UINT32(pb, tag_count);
 
         for (; tag_count > 0; --tag_count) {
-            struct tag_header *tag_hdr = (struct tag_header *) pb->ptr;
-
-            // todo: new tags support
-            PB_CHECK((tag_hdr->type & 0x80) == 0);
-
-            PB_SKIP_TAGHDR(pb, tag_hdr);
-
-            // string-named tags
-            if (tag_hdr->name_len > 1) {
-                if (strncmp(TNS_MEDIA_LENGTH, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    if (TT_UINT32 == tag_hdr->type) {
-                        PB_READ_UINT32(pb, cur_file->media_length);
-                    } else if (TT_STRING == tag_hdr->type) {
-                        // todo: support string values ( hh:mm:ss )
-                        uint16_t len;
-                        PB_READ_UINT16(pb, len);
-                        PB_SEEK(pb, len);
+            struct tag tag;
+
+            PB_CHECK(pb_read_tag(pb, &tag));
+
+            switch (tag.name) {
+                case TN_FILENAME:
+                    PB_CHECK(TT_STRING == tag.type);
+                    cur_file->name_len = tag.data_len > MAX_FILENAME_LEN ? MAX_FILENAME_LEN : tag.data_len;
+                    cur_file->name = (const char *) tag.data;
+                    break;
+
+                case TN_FILESIZE:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->size += tag.int_val;
+                    break;
+
+                case TN_FILESIZE_HI:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->size += tag.int_val << 32;
+                    break;
+
+                case TN_FILERATING:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->rating = tag.int_val > 5 ? 5 : tag.int_val;
+                    break;
+
+                case TN_FILETYPE:
+                    if (TAG_IS_INT(&tag)) {
+                        cur_file->type = tag.int_val;
+                    } else if (TT_STRING == tag.type) {
+                        cur_file->type = get_ed2k_file_type((const char *) tag.data, tag.data_len);
                     } else {
                         PB_CHECK(0);
                     }
-                } else if (strncmp(TNS_MEDIA_BITRATE, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    PB_CHECK(TT_UINT32 == tag_hdr->type);
-                    PB_READ_UINT32(pb, cur_file->media_bitrate);
-                } else if (strncmp(TNS_MEDIA_CODEC, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    uint16_t len = MAX_MCODEC_LEN;
-                    PB_CHECK(TT_STRING == tag_hdr->type);
-                    PB_READ_STRING(pb, cur_file->media_codec, len);
-                    cur_file->media_codec[len] = 0;
-                } else {
-                    PB_CHECK(0);
-                }
-            } else {
-                switch (*tag_hdr->name) {
-
-                    case TN_FILENAME:
-                        PB_CHECK(TT_STRING == tag_hdr->type);
-                        PB_READ_UINT16(pb, cur_file->name_len);
-                        cur_file->name_len = cur_file->name_len > MAX_FILENAME_LEN ? MAX_FILENAME_LEN : cur_file->name_len;
-                        PB_MEMCPY(pb, cur_file->name, cur_file->name_len);
-                        cur_file->name[cur_file->name_len] = 0;
-                        break;
-
-                    case TN_FILESIZE:
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, cur_file->size);
-                        break;
-
-                    case TN_FILESIZE_HI: {
-                        uint32_t size_hi;
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, size_hi);
-                        cur_file->size += (uint64_t) size_hi << 32;
-                        break;
-                    }
+                    break;
 
-                    case TN_FILERATING:
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, cur_file->rating);
-                        if (cur_file->rating > 5) {
-                            cur_file->rating = 5;
-                        }
-                        break;
-
-                    case TN_FILETYPE:
-                        if (TT_UINT32 == tag_hdr->type) {
-                            PB_READ_UINT32(pb, cur_file->type);
-                        } else if (TT_STRING == tag_hdr->type) {
-                            uint16_t len;
-                            PB_READ_UINT16(pb, len);
-                            cur_file->type = get_ed2k_file_type((const char *) pb->ptr, len);
-                            PB_SEEK(pb, len);
-                        } else {
-                            PB_CHECK(0);
-                        }
-                        break;
-
-                    default:
-                        PB_CHECK(0);
-                }
+                case TN_MEDIA_LENGTH:
+                    // todo: support string values ( hh:mm:ss )
+                    if (TAG_IS_INT(&tag))
+                        cur_file->media_length = tag.int_val;
+                    break;
+
+                case TN_MEDIA_BITRATE:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->media_bitrate = tag.int_val;
+                    break;
+
+                case TN_MEDIA_CODEC:
+                    PB_CHECK(TT_STRING == tag.type);
+                    cur_file->media_codec_len = tag.data_len > MAX_MCODEC_LEN ? MAX_MCODEC_LEN : tag.data_len;
+                    cur_file->media_codec = (const char *) tag.data;
+                    break;
+
+                default:
+                    // skip unknown tags
+                    break;
             }
         }
 
         cur_file++;
     }
 
-    client_share_files(clnt, files, count);
+    *out_files = files;
+    *out_count = count;
 
     return 1;
 
@@ -244,25 +318,38 @@ static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
     return 0;
 }
 
-static int process_search_request(struct packet_buffer *pb, struct client *clnt)
+static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
 {
-    struct search_node *n, root;
-    n = &root;
+    struct pub_file *files;
+    size_t count;
 
-    memset(&root, 0, sizeof(root));
+    // todo: limit total files count on server
+    if (!parse_offer_files(pb, &s_arena, &files, &count))
+        return 0;
+
+    client_share_files(clnt, files, count);
+
+    return 1;
+}
+
+int parse_search_request(struct packet_buffer *pb, struct arena *arena, struct search_node *root)
+{
+    struct search_node *n = root;
+
+    memset(root, 0, sizeof(*root));
 
     while (n) {
         if ((ST_AND <= n->type) && (ST_NOT >= n->type)) {
             if (!n->left) {
-                struct search_node *new_node = (struct search_node *) alloca(sizeof(struct search_node));
-                memset(new_node, 0, sizeof(struct search_node));
+                struct search_node *new_node = (struct search_node *) arena_zalloc(arena, sizeof(*new_node));
+                PB_CHECK(new_node);
                 new_node->parent = n;
                 n->left = new_node;
                 n = new_node;
                 continue;
             } else if (!n->right) {
-                struct search_node *new_node = (struct search_node *) alloca(sizeof(struct search_node));
-                memset(new_node, 0, sizeof(struct search_node));
+                struct search_node *new_node = (struct search_node *) arena_zalloc(arena, sizeof(*new_node));
+                PB_CHECK(new_node);
                 new_node->parent = n;
                 n->right = new_node;
                 n = new_node;
@@ -348,8 +435,80 @@ static int process_search_request(struct packet_buffer *pb, struct client *clnt)
         n = n->parent;
     }
 
+    return 1;
+
+    malformed:
+    return 0;
+}
+
+static int process_search_request(struct packet_buffer *pb, struct client *clnt)
+{
+    struct search_node root;
+
+    if (!parse_search_request(pb, &s_arena, &root))
+        return 0;
+
     client_search_files(clnt, &root);
     return 1;
+}
+
+static int process_callback_request(struct packet_buffer *pb, struct client *clnt)
+{
+    struct client *target = NULL;
+    uint32_t id;
+
+    PB_READ_UINT32(pb, id);
+
+    // lowid client can't accept connection, highid clients are connected directly
+    if (clnt->lowid || id >= MAX_LOWID || !(target = idmap_find(id, 0))) {
+        metrics_add(MC_CALLBACK_FAILED, 1);
+        send_callback_fail(clnt->bev);
+    } else {
+        struct job_callback *job = (struct job_callback *) calloc(1, sizeof(*job));
+
+        // target's connection is written only by its own job
+        job->hdr.type = JOB_CALLBACK_REQUESTED;
+        job->hdr.clnt = target;
+        job->ip = clnt->ip;
+        job->port = clnt->port;
+        server_add_job((struct job *) job);
+        metrics_add(MC_CALLBACK_FORWARDED, 1);
+    }
+
+    if (target)
+        client_decref(target);
+
+    return 1;
+
+    malformed:
+    return 0;
+}
+
+static void flush_get_sources(struct client *clnt)
+{
+    if (!s_sources_batch.count)
+        return;
+
+    if (!clnt->deleted)
+        client_get_sources(clnt, &s_arena, s_sources_batch.hashes, s_sources_batch.obfu, s_sources_batch.count);
+    s_sources_batch.count = 0;
+}
+
+static int process_get_sources(struct packet_buffer *pb, struct client *clnt, int obfu)
+{
+    size_t i = s_sources_batch.count;
+
+    // <hash16>[<size4>], large files: <hash16><0 4><size8>
+    PB_CHECK(PB_LEFT(pb) == ED2K_HASH_SIZE || PB_LEFT(pb) == ED2K_HASH_SIZE + sizeof(uint32_t)
+            || PB_LEFT(pb) == ED2K_HASH_SIZE + sizeof(uint32_t) + sizeof(uint64_t));
+
+    // answered by flush_get_sources() with following requests of the same read
+    memcpy(s_sources_batch.hashes + i * ED2K_HASH_SIZE, pb->ptr, ED2K_HASH_SIZE);
+    s_sources_batch.obfu[i] = obfu;
+    if (++s_sources_batch.count == MAX_GETSOURCES_BATCH)
+        flush_get_sources(clnt);
+
+    return 1;
 
     malformed:
     return 0;
@@ -360,18 +519,23 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
     PB_CHECK(clnt->portcheck_finished || (OP_LOGINREQUEST == opcode));
 
     switch (opcode) {
-        case OP_LOGINREQUEST:
-            /* client already logined */
-            if (clnt->id)
-                client_delete(clnt);
+        case OP_LOGINREQUEST: {
+            const struct server_config *cfg = g_srv.cfg;
 
-            send_server_message(clnt->bev, g_srv.cfg->welcome_msg, g_srv.cfg->welcome_msg_len);
-            if (!g_srv.cfg->allow_lowid) {
-                static const char msg_highid[] = "WARNING: Only HighID clients!";
-                send_server_message(clnt->bev, msg_highid, sizeof(msg_highid) - 1);
+            /* client already logined, its connection is closed */
+            if (clnt->id) {
+                client_delete(clnt);
+                return 0;
             }
+
+            // pending port check result is for address of first login
+            if (clnt->portcheck_posted)
+                return 1;
+
+            send_static(clnt->bev, cfg, cfg->login_pkt, cfg->login_pkt_len);
             PB_CHECK(process_login_request(pb, clnt));
             return 1;
+        }
 
         case OP_GETSERVERLIST:
             send_server_ident(clnt->bev);
@@ -395,8 +559,7 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
             return 1;
 
         case OP_GETSOURCES:
-            PB_CHECK(PB_LEFT(pb) == ED2K_HASH_SIZE);
-            client_get_sources(clnt, pb->ptr);
+            PB_CHECK(process_get_sources(pb, clnt, 0));
             return 1;
 
         case OP_OFFERFILES:
@@ -409,10 +572,11 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
             return 1;
 
         case OP_CALLBACKREQUEST:
-            send_callback_fail(clnt->bev);
+            PB_CHECK(process_callback_request(pb, clnt));
             return 1;
 
         case OP_GETSOURCES_OBFU:
+            PB_CHECK(process_get_sources(pb, clnt, 1));
             return 1;
 
         case OP_REJECT:
@@ -423,6 +587,7 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
     }
 
     malformed:
+    metrics_add(MC_PACKETS_MALFORMED, 1);
     ED2KD_LOGDBG("malformed tcp packet (opcode:%u)", opcode);
     client_delete(clnt);
     return 0;
@@ -437,6 +602,8 @@ static void server_read(struct client *clnt)
         unsigned char *data;
         struct packet_buffer pb;
         size_t packet_len;
+        uint64_t start;
+        uint8_t opcode;
         int ret;
         const struct packet_header *header =
                 (struct packet_header *) evbuffer_pullup(input, sizeof(struct packet_header));
@@ -444,42 +611,58 @@ static void server_read(struct client *clnt)
         if ((PROTO_PACKED != header->proto) && (PROTO_EDONKEY != header->proto)) {
             ED2KD_LOGDBG("unknown packet protocol from %s:%u", clnt->dbg.ip_str, clnt->port);
             client_delete(clnt);
-            return;
+            break;
         }
 
         // wait for full length packet
         packet_len = header->length + sizeof(struct packet_header);
         if (packet_len > src_len)
-            return;
+            break;
 
         data = evbuffer_pullup(input, packet_len);
         header = (struct packet_header *) data;
         data += sizeof(struct packet_header);
+        opcode = *data;
+
+        metrics_add(MC_PACKETS_IN, 1);
+        metrics_add(MC_BYTES_IN, packet_len);
 
         if (PROTO_PACKED == header->proto) {
             unsigned long unpacked_len = MAX_UNCOMPRESSED_PACKET_SIZE;
-            unsigned char *unpacked = (unsigned char *) malloc(unpacked_len);
+            unsigned char *unpacked = (unsigned char *) arena_alloc(&s_arena, unpacked_len);
 
-            ret = uncompress(unpacked, &unpacked_len, data + 1, header->length - 1);
-            if (Z_OK == ret) {
-                PB_INIT(&pb, unpacked, unpacked_len);
-                ret = process_packet(&pb, *data, clnt);
-            } else {
+            start = metrics_now();
+            ret = unpacked ? uncompress(unpacked, &unpacked_len, data + 1, header->length - 1) : Z_MEM_ERROR;
+            metrics_record_since(MH_ZLIB_UNPACK, start);
+            if (Z_OK != ret) {
                 ED2KD_LOGDBG("failed to unpack packet from %s:%u", clnt->dbg.ip_str, clnt->port);
-                ret = 0;
+                break;
             }
-            free(unpacked);
+            metrics_add(MC_ZLIB_BYTES_IN, header->length - 1);
+            metrics_add(MC_ZLIB_BYTES_OUT, unpacked_len);
+            PB_INIT(&pb, unpacked, unpacked_len);
         } else {
             PB_INIT(&pb, data + 1, header->length - 1);
-            ret = process_packet(&pb, *data, clnt);
         }
 
+        // replies keep requests order
+        if (OP_GETSOURCES != opcode && OP_GETSOURCES_OBFU != opcode)
+            flush_get_sources(clnt);
+
+        // packet data may be freed with client, so opcode is saved above
+        start = metrics_now();
+        ret = process_packet(&pb, opcode, clnt);
+        metrics_record_since(metrics_opcode_hist(opcode), start);
+
         if (!ret)
-            return;
+            break;
 
         evbuffer_drain(input, packet_len);
         src_len = evbuffer_get_length(input);
+        arena_reset(&s_arena);
     }
+
+    flush_get_sources(clnt);
 }
 
 static void server_event(struct client *clnt, short events)
@@ -494,39 +677,30 @@ void *server_job_worker(void *ctx)
 {
     (void) ctx;
 
+    if (!arena_init(&s_arena, JOB_ARENA_BLOCK_SIZE)) {
+        ED2KD_LOGERR("failed to allocate job arena");
+        return NULL;
+    }
+
     if (!db_open()) {
         ED2KD_LOGERR("failed to open database");
+        arena_destroy(&s_arena);
         return NULL;
     }
 
-    for (; ;) {
-        struct job *job = 0;
-
-        pthread_mutex_lock(&g_srv.job_mutex);
-        for (; ;) {
-            struct job *j, *jtmp;
-
-            if (atomic_load(&g_srv.terminate)) {
-                pthread_mutex_unlock(&g_srv.job_mutex);
-                goto exit;
-            }
-
-            TAILQ_FOREACH_SAFE(j, &g_srv.jqueue, qentry, jtmp) {
-                uint32_t old_val = 0;
-                if (atomic_compare_exchange_strong(&j->clnt->locked, &old_val, 1)) {
-                    TAILQ_REMOVE(&g_srv.jqueue, j, qentry);
-                    job = j;
-                    break;
-                }
-            }
-
-            if (job)
-                break;
+    // jobs look up other clients in id index without locks
+    if (!rcu_register_thread()) {
+        ED2KD_LOGERR("failed to register job worker");
+        db_close();
+        arena_destroy(&s_arena);
+        return NULL;
+    }
 
-            pthread_cond_wait(&g_srv.job_cond, &g_srv.job_mutex);
-        }
+    for (; ;) {
+        struct job *job = server_get_job();
 
-        pthread_mutex_unlock(&g_srv.job_mutex);
+        if (!job)
+            break;
 
         if (!atomic_load(&job->clnt->deleted)) {
             switch (job->type) {
@@ -549,21 +723,17 @@ void *server_job_worker(void *ctx)
                     event_add(job->clnt->evtimer_status_notify, g_srv.status_notify_tv);
                     break;
 
-                case JOB_PORTCHECK_EVENT: {
-                    struct job_event *j = (struct job_event *) job;
-                    //ED2KD_LOGDBG("JOB_PORTCHECK_EVENT event");
-                    portcheck_event(job->clnt, j->events);
+                case JOB_PORTCHECK_RESULT: {
+                    struct job_portcheck *j = (struct job_portcheck *) job;
+                    client_portcheck_finish(job->clnt, (enum portcheck_result) j->result);
                     break;
                 }
 
-                case JOB_PORTCHECK_READ:
-                    //ED2KD_LOGDBG("JOB_PORTCHECK_READ event");
-                    portcheck_read(job->clnt);
-                    break;
-
-                case JOB_PORTCHECK_TIMEOUT:
-                    portcheck_timeout(job->clnt);
+                case JOB_CALLBACK_REQUESTED: {
+                    struct job_callback *j = (struct job_callback *) job;
+                    send_callback_requested(job->clnt->bev, j->ip, j->port);
                     break;
+                }
 
                 default:
                     assert(0);
@@ -571,15 +741,17 @@ void *server_job_worker(void *ctx)
             }
         }
 
-        atomic_store(&job->clnt->locked, 0);
-        client_decref(job->clnt);
-        free(job);
+        server_release_job(job);
+        arena_reset(&s_arena);
     }
 
-    exit:
+    rcu_unregister_thread();
+
     if (!db_close())
         ED2KD_LOGERR("failed to close database");
 
+    arena_destroy(&s_arena);
+
     return NULL;
 }
 
@@ -10,11 +10,17 @@
 #include <sys/time.h>
 #include "job.h"
 #include "atomic.h"
+#include "rcu.h"
 
 struct event_base;
 struct evconnlistener;
 struct bufferevent;
 struct client;
+struct packet_buffer;
+struct arena;
+struct pub_file;
+struct search_node;
+struct server_entry;
 
 #define MAX_WELCOMEMSG_LEN        1024
 #define MAX_SERVER_NAME_LEN        64
@@ -23,6 +29,12 @@ struct client;
 #define MAX_UNCOMPRESSED_PACKET_SIZE    300*1024
 
 struct server_config {
+    /* retired on reload */
+    struct rcu_head rcu;
+
+    /* published and queued static packets references */
+    atomic_uint32_t ref_cnt;
+
     /* listen ip address */
     char *listen_addr;
 
@@ -59,6 +71,18 @@ struct server_config {
     /* port check timeout */
     struct timeval portcheck_timeout_tv;
 
+    /* maximum port checks in flight */
+    size_t portcheck_max_inflight;
+
+    /* maximum port checks in flight to one /24 subnet */
+    size_t portcheck_max_per_subnet;
+
+    /* successful port checks cache size, 0 disables cache */
+    size_t portcheck_cache_size;
+
+    /* successful port check lifetime in cache (seconds) */
+    unsigned portcheck_cache_ttl;
+
     /* server status sending interval */
     struct timeval status_notify_tv;
 
@@ -79,6 +103,54 @@ struct server_config {
 
     /* allow lowid clients flag */
     unsigned allow_lowid:1;
+
+    /* maximum connections from one ip, 0 for unlimited */
+    size_t max_clients_per_ip;
+
+    /* banned networks file path (optional) */
+    char *ban_file;
+
+    /* admin control socket path (optional) */
+    char *admin_socket;
+
+    /* last jobs count traced per worker, 0 disables tracing */
+    size_t job_trace_size;
+
+    /* slow operations log threshold (milliseconds), 0 disables log */
+    unsigned slow_query_threshold;
+
+    /* udp server protocol enabled flag */
+    unsigned udp_enabled:1;
+
+    /* udp reply datagrams per second per source ip */
+    unsigned udp_rate_limit;
+
+    /* peer servers sent in OP_SERVERLIST */
+    struct server_entry *peer_servers;
+    /* peer servers count */
+    size_t peer_server_count;
+
+    /* peer servers status request interval (seconds) */
+    unsigned peer_ping_interval;
+
+    /* files index snapshot path (optional) */
+    char *snapshot_file;
+
+    /* snapshot saving interval (seconds) */
+    unsigned snapshot_interval;
+
+    /* lifetime of sources loaded from snapshot and not offered again (seconds) */
+    unsigned snapshot_grace;
+
+    /* precomputed OP_SERVERMESSAGE packets sent on login */
+    unsigned char *login_pkt;
+    /* login packets length */
+    size_t login_pkt_len;
+
+    /* precomputed OP_SERVERIDENT packet */
+    unsigned char *ident_pkt;
+    /* server ident packet length */
+    size_t ident_pkt_len;
 };
 
 struct server_instance {
@@ -88,8 +160,8 @@ struct server_instance {
     struct event_base *evbase_main;
     /* tcp connection listener */
     struct evconnlistener *tcp_listener;
-    /* server configuration loaded from file */
-    const struct server_config *cfg;
+    /* server configuration loaded from file, replaced on reload, valid while reader is online */
+    _Atomic(const struct server_config *) cfg;
     /* working threads count */
     size_t thread_count;
     /* connected users count */
@@ -107,11 +179,11 @@ struct server_instance {
     pthread_cond_t job_cond;
     /* job queue */
     struct job_queue jqueue;
+    /* jobs in queue, protected by job_mutex */
+    size_t job_count;
 
-    /* common timeval for port check timeout */
-    const struct timeval *portcheck_timeout_tv;
     /* common server status notify interval */
-    const struct timeval *status_notify_tv;
+    _Atomic(const struct timeval *) status_notify_tv;
 };
 
 extern struct server_instance g_srv;
@@ -123,11 +195,27 @@ extern struct server_instance g_srv;
 */
 int server_load_config(const char *path);
 
+/**
+@brief loads configuration file again and publishes it, called by main thread
+@return non-zero on success, running configuration is kept on failure
+*/
+int server_reload_config(void);
+
 /**
 @brief frees server configuration
 */
 void server_free_config(void);
 
+/**
+@brief keeps configuration alive after reload, e.g. while its packets are queued
+*/
+void server_config_ref(const struct server_config *cfg);
+
+/**
+@brief releases reference, configuration is freed after last one
+*/
+void server_config_unref(const struct server_config *cfg);
+
 /**
 @brief start main loop and accept incoming connections
 @return non-zero on success
@@ -156,4 +244,32 @@ void *server_job_worker(void *ctx);
 */
 void server_add_job(struct job *job);
 
+/**
+@brief waits for job of not locked client and locks this client
+@return job or NULL if server is terminating
+*/
+struct job *server_get_job(void);
+
+/**
+@return number of jobs waiting in queue
+*/
+size_t server_job_queue_depth(void);
+
+/**
+@brief unlocks job's client and frees job
+*/
+void server_release_job(struct job *job);
+
+/**
+@brief parses OP_OFFERFILES payload, files are allocated from arena
+@return non-zero on success
+*/
+int parse_offer_files(struct packet_buffer *pb, struct arena *arena, struct pub_file **files, size_t *count);
+
+/**
+@brief parses OP_SEARCHREQUEST payload into search tree, nodes are allocated from arena
+@return non-zero on success
+*/
+int parse_search_request(struct packet_buffer *pb, struct arena *arena, struct search_node *root);
+
 #endif // ED2KD_SERVER_H
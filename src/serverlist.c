@@ -0,0 +1,260 @@
+#include "serverlist.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/util.h>
+#include <event2/buffer.h>
+
+#include "ed2k_proto.h"
+#include "packet.h"
+#include "metrics.h"
+#include "atomic.h"
+#include "udp.h"
+#include "log.h"
+
+struct peer {
+    /* tcp address */
+    struct server_entry addr;
+    /* challenge of unanswered status request, 0 if answered */
+    uint32_t challenge;
+    /* unanswered status requests in a row */
+    unsigned missed;
+    /* answered at least once */
+    unsigned answered:1;
+    uint32_t user_count;
+    uint32_t file_count;
+    /* 0 if peer didn't report it */
+    uint32_t max_users;
+};
+
+static struct {
+    /* guards peers state, which is changed only by udp thread */
+    pthread_mutex_t mutex;
+    struct peer *peers;
+    size_t count;
+    /* nsecs, 0 if peers are not pinged */
+    uint64_t ping_interval;
+    uint64_t next_ping;
+    _Atomic(struct serverlist_packet *) packet;
+} s_list = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static int peer_listed(const struct peer *peer)
+{
+    if (!s_list.ping_interval)
+        return 1;
+
+    return peer->answered && peer->missed < SERVERLIST_MAX_MISSED
+            && (!peer->max_users || peer->user_count < peer->max_users);
+}
+
+/* users per 1/1000 of capacity, peers without limit go after limited ones with the same load */
+static uint64_t peer_load(const struct peer *peer)
+{
+    return peer->max_users ? (uint64_t) peer->user_count * 1000 / peer->max_users : peer->user_count;
+}
+
+static int peer_cmp(const void *a, const void *b)
+{
+    uint64_t la = peer_load(*(const struct peer **) a), lb = peer_load(*(const struct peer **) b);
+    return (la > lb) - (la < lb);
+}
+
+static void packet_free(struct rcu_head *head)
+{
+    free((struct serverlist_packet *) ((char *) head - offsetof(struct serverlist_packet, rcu)));
+}
+
+/* rebuilds OP_SERVERLIST, called with mutex held */
+static void publish(void)
+{
+    struct peer *listed[SERVERLIST_MAX_PEERS];
+    struct server_entry entries[SERVERLIST_MAX_PEERS];
+    struct serverlist_packet *pkt = NULL, *old;
+    size_t i, count = 0;
+
+    for (i = 0; i < s_list.count; ++i) {
+        if (peer_listed(&s_list.peers[i]))
+            listed[count++] = &s_list.peers[i];
+    }
+
+    if (count) {
+        struct evbuffer *buf = evbuffer_new();
+        size_t len;
+
+        qsort(listed, count, sizeof(*listed), peer_cmp);
+        for (i = 0; i < count; ++i) {
+            entries[i] = listed[i]->addr;
+        }
+        write_server_list(buf, entries, count);
+
+        len = evbuffer_get_length(buf);
+        pkt = (struct serverlist_packet *) malloc(sizeof(*pkt) + len);
+        if (pkt) {
+            pkt->len = len;
+            evbuffer_remove(buf, pkt->data, len);
+        }
+        evbuffer_free(buf);
+
+        if (!pkt) {
+            ED2KD_LOGERR("failed to allocate server list");
+            return;
+        }
+    }
+
+    old = atomic_load(&s_list.packet);
+    // status answers mostly change nothing listed
+    if (old && pkt && old->len == pkt->len && !memcmp(old->data, pkt->data, pkt->len)) {
+        free(pkt);
+        return;
+    }
+
+    atomic_store_explicit(&s_list.packet, pkt, memory_order_release);
+    if (old)
+        rcu_retire(&old->rcu, packet_free);
+}
+
+int serverlist_init(const struct server_entry *peers, size_t count, unsigned ping_interval)
+{
+    size_t i;
+
+    if (!count)
+        return 1;
+
+    s_list.peers = (struct peer *) calloc(count, sizeof(*s_list.peers));
+    if (!s_list.peers) {
+        ED2KD_LOGERR("failed to allocate server list");
+        return 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        s_list.peers[i].addr = peers[i];
+    }
+    s_list.count = count;
+    s_list.ping_interval = (uint64_t) ping_interval * 1000000000;
+
+    // not pinged peers are listed right away
+    pthread_mutex_lock(&s_list.mutex);
+    publish();
+    pthread_mutex_unlock(&s_list.mutex);
+
+    return 1;
+}
+
+void serverlist_free(void)
+{
+    free(atomic_load(&s_list.packet));
+    atomic_store(&s_list.packet, NULL);
+    free(s_list.peers);
+    s_list.peers = NULL;
+    s_list.count = 0;
+}
+
+const struct serverlist_packet *serverlist_packet(void)
+{
+    return atomic_load_explicit(&s_list.packet, memory_order_acquire);
+}
+
+void serverlist_ping(int fd)
+{
+    uint64_t now;
+    size_t i;
+
+    if (!s_list.ping_interval)
+        return;
+
+    now = metrics_now();
+    if (now < s_list.next_ping)
+        return;
+    s_list.next_ping = now + s_list.ping_interval;
+
+    pthread_mutex_lock(&s_list.mutex);
+    for (i = 0; i < s_list.count; ++i) {
+        struct peer *peer = &s_list.peers[i];
+        struct sockaddr_in sa;
+        struct udp_server_status_req req;
+
+        if (peer->challenge)
+            peer->missed++;
+
+        // answer without current challenge is ignored
+        do {
+            evutil_secure_rng_get_bytes((char *) &peer->challenge, sizeof(peer->challenge));
+        } while (!peer->challenge);
+
+        req.hdr.proto = PROTO_EDONKEY;
+        req.hdr.opcode = OP_GLOBSERVSTATREQ;
+        req.challenge = peer->challenge;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = peer->addr.ip;
+        sa.sin_port = htons(peer->addr.port + UDP_PORT_OFFSET);
+
+        if (sendto(fd, &req, sizeof(req), 0, (struct sockaddr *) &sa, sizeof(sa)) == sizeof(req)) {
+            metrics_add(MC_UDP_PACKETS_OUT, 1);
+            metrics_add(MC_UDP_BYTES_OUT, sizeof(req));
+        }
+    }
+    publish();
+    pthread_mutex_unlock(&s_list.mutex);
+}
+
+int serverlist_status(const struct sockaddr_in *addr, struct packet_buffer *pb)
+{
+    uint32_t challenge, user_count, file_count, max_users = 0;
+    uint16_t port = ntohs(addr->sin_port) - UDP_PORT_OFFSET;
+    size_t i;
+
+    PB_READ_UINT32(pb, challenge);
+    PB_READ_UINT32(pb, user_count);
+    PB_READ_UINT32(pb, file_count);
+    // old servers send only counts
+    if ((size_t) PB_LEFT(pb) >= sizeof(max_users))
+        PB_READ_UINT32(pb, max_users);
+
+    pthread_mutex_lock(&s_list.mutex);
+    for (i = 0; i < s_list.count; ++i) {
+        struct peer *peer = &s_list.peers[i];
+
+        if (peer->addr.ip != addr->sin_addr.s_addr || peer->addr.port != port)
+            continue;
+
+        if (peer->challenge && peer->challenge == challenge) {
+            peer->challenge = 0;
+            peer->missed = 0;
+            peer->answered = 1;
+            peer->user_count = user_count;
+            peer->file_count = file_count;
+            peer->max_users = max_users;
+            publish();
+        }
+        break;
+    }
+    pthread_mutex_unlock(&s_list.mutex);
+
+    return 1;
+
+    malformed:
+    return 0;
+}
+
+void serverlist_dump(struct evbuffer *out)
+{
+    size_t i;
+
+    pthread_mutex_lock(&s_list.mutex);
+    for (i = 0; i < s_list.count; ++i) {
+        const struct peer *peer = &s_list.peers[i];
+        char ip_str[INET_ADDRSTRLEN];
+
+        evutil_inet_ntop(AF_INET, &peer->addr.ip, ip_str, sizeof(ip_str));
+        evbuffer_add_printf(out, "%s:%u %s users %u/%u files %u missed %u\n", ip_str, peer->addr.port,
+                peer_listed(peer) ? "listed" : "unlisted", peer->user_count, peer->max_users, peer->file_count,
+                peer->missed);
+    }
+    pthread_mutex_unlock(&s_list.mutex);
+}
@@ -0,0 +1,76 @@
+#ifndef ED2KD_SERVERLIST_H
+#define ED2KD_SERVERLIST_H
+
+/**
+@file serverlist.h peer servers list
+
+Peer servers from config are pinged by udp thread with OP_GLOBSERVSTATREQ,
+their answers keep user and file counts. OP_SERVERLIST is encoded on every
+change and shared by job workers (see rcu.h). It lists only answering peers
+with free slots, least loaded first, so clients asking for servers go to
+nodes which can take them. Without udp peers are never pinged and all of
+them are listed.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rcu.h"
+
+/* OP_SERVERLIST count is one byte */
+#define SERVERLIST_MAX_PEERS        255
+/* default peers ping interval (seconds) */
+#define SERVERLIST_PING_INTERVAL    60
+/* peer is not listed after this many unanswered pings */
+#define SERVERLIST_MAX_MISSED       3
+
+struct evbuffer;
+struct packet_buffer;
+struct sockaddr_in;
+struct server_entry;
+
+/* encoded OP_SERVERLIST */
+struct serverlist_packet {
+    struct rcu_head rcu;
+    size_t len;
+    unsigned char data[];
+};
+
+/**
+@param peers peer servers tcp addresses
+@param count at most SERVERLIST_MAX_PEERS
+@param ping_interval seconds between status requests, 0 if peers are not pinged
+@return non-zero on success
+*/
+int serverlist_init(const struct server_entry *peers, size_t count, unsigned ping_interval);
+
+/**
+@brief frees list, no reader may be online
+*/
+void serverlist_free(void);
+
+/**
+@brief current OP_SERVERLIST, valid until calling worker goes offline
+@return packet or NULL if there are no peers to list
+*/
+const struct serverlist_packet *serverlist_packet(void);
+
+/**
+@brief sends status requests to peers due for ping, called by udp thread
+@param fd udp socket
+*/
+void serverlist_ping(int fd);
+
+/**
+@brief handles OP_GLOBSERVSTATRES, called by udp thread
+@param addr datagram source
+@param pb datagram payload after opcode
+@return zero if datagram is malformed
+*/
+int serverlist_status(const struct sockaddr_in *addr, struct packet_buffer *pb);
+
+/**
+@brief writes peers and their state in text form
+*/
+void serverlist_dump(struct evbuffer *out);
+
+#endif // ED2KD_SERVERLIST_H
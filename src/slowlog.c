@@ -0,0 +1,63 @@
+#include "slowlog.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "log.h"
+
+static uint64_t s_threshold;
+
+static struct {
+    pthread_mutex_t mutex;
+    /* entries dropped by rate limit */
+    size_t suppressed;
+    struct token_bucket limit;
+} s_log = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+int slowlog_init(unsigned threshold_ms)
+{
+    token_bucket_init(&s_log.limit, SLOWLOG_RATE);
+    s_threshold = (uint64_t) threshold_ms * 1000000;
+
+    return 1;
+}
+
+void slowlog_free(void)
+{
+    s_threshold = 0;
+
+    if (s_log.suppressed)
+        ED2KD_LOGWRN("slow: %zu entries suppressed", s_log.suppressed);
+    s_log.suppressed = 0;
+}
+
+uint64_t slowlog_threshold(void)
+{
+    return s_threshold;
+}
+
+void slowlog_write(const char *fmt, ...)
+{
+    char entry[SLOWLOG_MAX_ENTRY];
+    size_t suppressed;
+    va_list ap;
+
+    pthread_mutex_lock(&s_log.mutex);
+    if (!token_bucket_update(&s_log.limit, SLOWLOG_RATE)) {
+        s_log.suppressed++;
+        pthread_mutex_unlock(&s_log.mutex);
+        return;
+    }
+    suppressed = s_log.suppressed;
+    s_log.suppressed = 0;
+    pthread_mutex_unlock(&s_log.mutex);
+
+    va_start(ap, fmt);
+    vsnprintf(entry, sizeof(entry), fmt, ap);
+    va_end(ap);
+
+    if (suppressed)
+        ED2KD_LOGWRN("slow: %zu entries suppressed", suppressed);
+    ED2KD_LOGWRN("slow: %s", entry);
+}
@@ -0,0 +1,46 @@
+#ifndef ED2KD_SLOWLOG_H
+#define ED2KD_SLOWLOG_H
+
+/**
+@file slowlog.h log of operations slower than configured threshold
+
+Entries go to the regular asynchronous log. At most SLOWLOG_RATE entries
+per second are written, the rest are counted and reported as suppressed.
+*/
+
+#include <stdint.h>
+
+#define SLOWLOG_RATE        10
+#define SLOWLOG_MAX_ENTRY   1024
+
+/**
+@param threshold_ms operations slower than this are logged, 0 disables log
+@return non-zero on success
+*/
+int slowlog_init(unsigned threshold_ms);
+
+/**
+@brief disables log and reports suppressed entries
+*/
+void slowlog_free(void);
+
+/**
+@return threshold (nsecs) or 0 if log is disabled
+*/
+uint64_t slowlog_threshold(void);
+
+/**
+@return non-zero if operation of given duration must be logged
+*/
+static inline int slowlog_is_slow(uint64_t nsecs)
+{
+    uint64_t threshold = slowlog_threshold();
+    return threshold && nsecs >= threshold;
+}
+
+/**
+@brief writes log entry unless rate limit is exceeded
+*/
+void slowlog_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif // ED2KD_SLOWLOG_H
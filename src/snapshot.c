@@ -0,0 +1,175 @@
+#include "snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "db.h"
+#include "metrics.h"
+#include "log.h"
+
+static struct {
+    pthread_t thread;
+    /* guards fields below */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned running:1;
+    unsigned requested:1;
+    unsigned stop:1;
+    char *path;
+    unsigned interval;
+    /* next snapshot (monotonic seconds) */
+    time_t next_save;
+    /* unconfirmed sources removal (monotonic seconds), 0 if there are none */
+    time_t expire_at;
+} s_snap = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void save(void)
+{
+    size_t files, sources;
+    uint64_t start = metrics_now();
+
+    if (db_snapshot_save(s_snap.path, &files, &sources))
+        ED2KD_LOGNFO("snapshot: saved %zu files, %zu sources in %" PRIu64 "ms", files, sources,
+                (metrics_now() - start) / 1000000);
+}
+
+static void expire(void)
+{
+    size_t count;
+
+    if (db_expire_unconfirmed(&count))
+        ED2KD_LOGNFO("snapshot: removed %zu unconfirmed sources", count);
+}
+
+static void *snapshot_worker(void *arg)
+{
+    (void) arg;
+
+    if (!db_open()) {
+        ED2KD_LOGERR("snapshot: failed to open database");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s_snap.mutex);
+    for (;;) {
+        time_t now = now_sec();
+        int stop = s_snap.stop;
+        int do_save = stop || s_snap.requested || now >= s_snap.next_save;
+        int do_expire = s_snap.expire_at && now >= s_snap.expire_at;
+
+        if (!do_save && !do_expire) {
+            struct timespec ts = {s_snap.next_save, 0};
+
+            if (s_snap.expire_at && s_snap.expire_at < ts.tv_sec)
+                ts.tv_sec = s_snap.expire_at;
+            pthread_cond_timedwait(&s_snap.cond, &s_snap.mutex, &ts);
+            continue;
+        }
+
+        s_snap.requested = 0;
+        if (do_expire)
+            s_snap.expire_at = 0;
+        pthread_mutex_unlock(&s_snap.mutex);
+
+        // expired sources are not saved
+        if (do_expire)
+            expire();
+        if (do_save)
+            save();
+
+        pthread_mutex_lock(&s_snap.mutex);
+        if (stop)
+            break;
+        if (do_save)
+            s_snap.next_save = now_sec() + s_snap.interval;
+    }
+    pthread_mutex_unlock(&s_snap.mutex);
+
+    if (!db_close())
+        ED2KD_LOGERR("snapshot: failed to close database");
+
+    return NULL;
+}
+
+int snapshot_load(const char *path, unsigned grace)
+{
+    size_t files, sources;
+    uint64_t start = metrics_now();
+
+    if (!db_snapshot_load(path, &files, &sources))
+        return 0;
+
+    ED2KD_LOGNFO("snapshot: loaded %zu files, %zu sources in %" PRIu64 "ms", files, sources,
+            (metrics_now() - start) / 1000000);
+
+    if (sources)
+        s_snap.expire_at = now_sec() + grace;
+
+    return 1;
+}
+
+int snapshot_start(const char *path, unsigned interval)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s_snap.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    s_snap.path = strdup(path);
+    s_snap.interval = interval;
+    s_snap.next_save = now_sec() + interval;
+
+    if (pthread_create(&s_snap.thread, NULL, snapshot_worker, NULL)) {
+        ED2KD_LOGERR("snapshot: failed to start thread");
+        pthread_cond_destroy(&s_snap.cond);
+        free(s_snap.path);
+        s_snap.path = NULL;
+        return 0;
+    }
+    s_snap.running = 1;
+
+    return 1;
+}
+
+int snapshot_request(void)
+{
+    int running;
+
+    pthread_mutex_lock(&s_snap.mutex);
+    running = s_snap.running;
+    if (running) {
+        s_snap.requested = 1;
+        pthread_cond_signal(&s_snap.cond);
+    }
+    pthread_mutex_unlock(&s_snap.mutex);
+
+    return running;
+}
+
+void snapshot_stop(void)
+{
+    if (!s_snap.running)
+        return;
+
+    pthread_mutex_lock(&s_snap.mutex);
+    s_snap.stop = 1;
+    pthread_cond_signal(&s_snap.cond);
+    pthread_mutex_unlock(&s_snap.mutex);
+
+    pthread_join(s_snap.thread, NULL);
+    pthread_cond_destroy(&s_snap.cond);
+    free(s_snap.path);
+    s_snap.path = NULL;
+    s_snap.running = 0;
+}
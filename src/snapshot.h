@@ -0,0 +1,43 @@
+#ifndef ED2KD_SNAPSHOT_H
+#define ED2KD_SNAPSHOT_H
+
+/**
+@file snapshot.h periodic snapshot of shared files index
+
+Files and HighID sources are saved by background thread (see
+db_snapshot_save()) every interval and on shutdown. Sources loaded on
+startup are unconfirmed, they are confirmed by the same client offering
+the file again and removed when grace window ends.
+*/
+
+/* default snapshot interval (seconds) */
+#define SNAPSHOT_INTERVAL   300
+/* default unconfirmed sources lifetime (seconds) */
+#define SNAPSHOT_GRACE      600
+
+/**
+@brief loads snapshot into just created database, missing file is not an error
+@param grace seconds before unconfirmed sources are removed
+@return non-zero on success
+*/
+int snapshot_load(const char *path, unsigned grace);
+
+/**
+@brief starts snapshot thread
+@param interval seconds between snapshots
+@return non-zero on success
+*/
+int snapshot_start(const char *path, unsigned interval);
+
+/**
+@brief asks snapshot thread to save snapshot now
+@return zero if thread is not running
+*/
+int snapshot_request(void);
+
+/**
+@brief saves last snapshot and stops thread, database must not be changed anymore
+*/
+void snapshot_stop(void);
+
+#endif // ED2KD_SNAPSHOT_H
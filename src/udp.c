@@ -0,0 +1,480 @@
+// recvmmsg(), sendmmsg()
+#define _GNU_SOURCE
+
+#include "udp.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "client.h"
+#include "db.h"
+#include "packet.h"
+#include "ed2k_proto.h"
+#include "arena.h"
+#include "metrics.h"
+#include "util.h"
+#include "log.h"
+#include "serverlist.h"
+
+#define UDP_ARENA_BLOCK_SIZE    (UDP_MAX_REQUEST * 4)
+#define UDP_MAX_OUT             (UDP_BATCH * UDP_MAX_REPLY)
+
+struct udp_datagram {
+    struct sockaddr_in addr;
+    size_t len;
+    unsigned char data[UDP_MAX_DATAGRAM];
+};
+
+/* request being answered */
+struct udp_request {
+    const struct sockaddr_in *addr;
+    /* source ip rate limit */
+    struct token_bucket *limit;
+    /* reply datagrams queued */
+    unsigned replies;
+    /* datagram being filled, NULL before first reply */
+    struct udp_datagram *cur;
+};
+
+/* all buffers are used only by udp thread */
+static struct {
+    int fd;
+    pthread_t thread;
+    /* reply datagrams per second per source ip */
+    unsigned rate;
+    struct arena arena;
+    /* search results */
+    struct evbuffer *result;
+    struct token_bucket limits[1u << UDP_RATE_BITS];
+
+    struct mmsghdr in_msgs[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct sockaddr_in in_addr[UDP_BATCH];
+    /* PB_READ_* may peek few bytes past datagram end */
+    unsigned char in_data[UDP_BATCH][UDP_MAX_REQUEST + sizeof(uint64_t)];
+
+    struct mmsghdr out_msgs[UDP_MAX_OUT];
+    struct iovec out_iov[UDP_MAX_OUT];
+    struct udp_datagram out[UDP_MAX_OUT];
+    size_t out_count;
+} s_udp = {.fd = -1};
+
+static inline struct token_bucket *ip_limit(uint32_t ip)
+{
+    return &s_udp.limits[(ip * 0x9E3779B1u) >> (32 - UDP_RATE_BITS)];
+}
+
+/**
+@return space for len bytes in reply, NULL if request used up its replies
+*/
+static unsigned char *reply_reserve(struct udp_request *req, size_t len)
+{
+    struct udp_datagram *dgram = req->cur;
+    unsigned char *p;
+
+    if (!dgram || dgram->len + len > sizeof(dgram->data)) {
+        if (len > sizeof(dgram->data) || req->replies >= UDP_MAX_REPLY)
+            return NULL;
+        // first reply was paid by request itself
+        if (req->replies && !token_bucket_update(req->limit, s_udp.rate)) {
+            metrics_add(MC_UDP_RATE_LIMITED, 1);
+            return NULL;
+        }
+
+        // UDP_MAX_REPLY per request, can't overflow
+        dgram = req->cur = &s_udp.out[s_udp.out_count++];
+        dgram->addr = *req->addr;
+        dgram->len = 0;
+        req->replies++;
+    }
+
+    p = dgram->data + dgram->len;
+    dgram->len += len;
+
+    return p;
+}
+
+static void flush_replies(void)
+{
+    size_t i, sent = 0;
+
+    for (i = 0; i < s_udp.out_count; ++i) {
+        struct msghdr *hdr = &s_udp.out_msgs[i].msg_hdr;
+
+        s_udp.out_iov[i].iov_base = s_udp.out[i].data;
+        s_udp.out_iov[i].iov_len = s_udp.out[i].len;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &s_udp.out[i].addr;
+        hdr->msg_namelen = sizeof(s_udp.out[i].addr);
+        hdr->msg_iov = &s_udp.out_iov[i];
+        hdr->msg_iovlen = 1;
+
+        metrics_add(MC_UDP_BYTES_OUT, s_udp.out[i].len);
+    }
+
+    while (sent < s_udp.out_count) {
+        int ret = sendmmsg(s_udp.fd, s_udp.out_msgs + sent, s_udp.out_count - sent, 0);
+
+        if (ret < 0) {
+            if (EINTR == errno)
+                continue;
+            // only first datagram failed, skip it
+            ED2KD_LOGDBG("udp: send failed (%s)", strerror(errno));
+            sent++;
+            continue;
+        }
+
+        metrics_add(MC_UDP_PACKETS_OUT, ret);
+        sent += ret;
+    }
+
+    s_udp.out_count = 0;
+}
+
+/**
+@return non-zero if all sources were queued
+*/
+static int reply_found_sources(struct udp_request *req, const struct source_query *queries, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        const struct source_query *q = &queries[i];
+        size_t srcs_len = q->count * sizeof(struct file_source);
+        struct udp_found_sources *res;
+
+        if (!q->count)
+            continue;
+
+        res = (struct udp_found_sources *) reply_reserve(req, sizeof(*res) + srcs_len);
+        if (!res)
+            return 0;
+
+        res->hdr.proto = PROTO_EDONKEY;
+        res->hdr.opcode = OP_GLOBFOUNDSOURCES;
+        memcpy(res->hash, q->hash, sizeof(res->hash));
+        res->count = q->count;
+        memcpy(res + 1, q->sources, srcs_len);
+    }
+
+    return 1;
+}
+
+static int process_get_sources(struct packet_buffer *pb, struct udp_request *req, int with_size)
+{
+    struct file_source sources[MAX_GETSOURCES_BATCH][MAX_FOUND_SOURCES];
+    struct source_query queries[MAX_GETSOURCES_BATCH];
+    size_t count = 0;
+
+    while (PB_END(pb)) {
+        queries[count].hash = pb->ptr;
+        queries[count].sources = sources[count];
+        queries[count].obfu = 0;
+        queries[count].count = MAX_FOUND_SOURCES;
+
+        PB_SEEK(pb, ED2K_HASH_SIZE);
+        if (with_size) {
+            uint32_t size;
+            PB_READ_UINT32(pb, size);
+            // large file size follows zero
+            if (!size) {
+                PB_SEEK(pb, sizeof(uint64_t));
+            }
+        }
+
+        // hashes of one datagram are looked up together
+        if (++count == MAX_GETSOURCES_BATCH || !PB_END(pb)) {
+            if (!db_get_sources_batch(queries, count) || !reply_found_sources(req, queries, count))
+                break;
+            count = 0;
+        }
+    }
+
+    return 1;
+
+    malformed:
+    // answer well-formed part
+    if (count && db_get_sources_batch(queries, count))
+        reply_found_sources(req, queries, count);
+    return 0;
+}
+
+static int process_search(struct packet_buffer *pb, struct udp_request *req)
+{
+    struct search_node root;
+    size_t i, begin = 0, count = UDP_MAX_SEARCH_RESULTS;
+    size_t ends[UDP_MAX_SEARCH_RESULTS];
+    const unsigned char *data;
+
+    if (!parse_search_request(pb, &s_udp.arena, &root))
+        return 0;
+
+    if (!db_search_files(&root, s_udp.result, &count, ends) || !count)
+        goto done;
+
+    // every result goes as separate packet, several packets are sent in one datagram
+    data = evbuffer_pullup(s_udp.result, -1);
+    for (i = 0; i < count; ++i) {
+        size_t len = ends[i] - begin;
+        struct udp_header *hdr = (struct udp_header *) reply_reserve(req, sizeof(*hdr) + len);
+
+        if (!hdr)
+            break;
+
+        hdr->proto = PROTO_EDONKEY;
+        hdr->opcode = OP_GLOBSEARCHRES;
+        memcpy(hdr + 1, data + begin, len);
+        begin = ends[i];
+    }
+
+    done:
+    evbuffer_drain(s_udp.result, evbuffer_get_length(s_udp.result));
+    return 1;
+}
+
+static int process_server_status(struct packet_buffer *pb, struct udp_request *req)
+{
+    const struct server_config *cfg = g_srv.cfg;
+    struct udp_server_status *res;
+    uint32_t challenge;
+
+    PB_READ_UINT32(pb, challenge);
+
+    res = (struct udp_server_status *) reply_reserve(req, sizeof(*res));
+    if (!res)
+        return 1;
+
+    res->hdr.proto = PROTO_EDONKEY;
+    res->hdr.opcode = OP_GLOBSERVSTATRES;
+    res->challenge = challenge;
+    res->user_count = atomic_load(&g_srv.user_count);
+    res->file_count = atomic_load(&g_srv.file_count);
+    res->max_users = cfg->max_clients;
+    res->soft_files = cfg->max_files_per_client;
+    res->hard_files = cfg->max_files_per_client;
+    res->udp_flags = SRV_UDPFLG_EXT_GETSOURCES | SRV_UDPFLG_EXT_GETSOURCES2 | SRV_UDPFLG_LARGEFILES;
+    // lowid clients are not counted
+    res->lowid_users = 0;
+
+    return 1;
+
+    malformed:
+    return 0;
+}
+
+static void process_datagram(const unsigned char *data, size_t len, const struct sockaddr_in *addr)
+{
+    struct packet_buffer pb;
+    struct udp_request req;
+    enum metric_hist hist;
+    uint64_t start = metrics_now();
+    uint8_t proto, opcode;
+    int ret;
+
+    metrics_add(MC_UDP_PACKETS_IN, 1);
+    metrics_add(MC_UDP_BYTES_IN, len);
+
+    PB_INIT(&pb, data, len);
+    PB_READ_UINT8(&pb, proto);
+    PB_READ_UINT8(&pb, opcode);
+    PB_CHECK(PROTO_EDONKEY == proto);
+
+    req.addr = addr;
+    req.limit = ip_limit(addr->sin_addr.s_addr);
+    req.replies = 0;
+    req.cur = NULL;
+
+    if (!token_bucket_update(req.limit, s_udp.rate)) {
+        metrics_add(MC_UDP_RATE_LIMITED, 1);
+        return;
+    }
+
+    switch (opcode) {
+        case OP_GLOBGETSOURCES:
+            hist = MH_UDP_GETSOURCES;
+            ret = process_get_sources(&pb, &req, 0);
+            break;
+
+        case OP_GLOBGETSOURCES2:
+            hist = MH_UDP_GETSOURCES;
+            ret = process_get_sources(&pb, &req, 1);
+            break;
+
+        case OP_GLOBSEARCHREQ:
+        case OP_GLOBSEARCHREQ2:
+            hist = MH_UDP_SEARCH;
+            ret = process_search(&pb, &req);
+            break;
+
+        case OP_GLOBSERVSTATREQ:
+            hist = MH_UDP_OTHER;
+            ret = process_server_status(&pb, &req);
+            break;
+
+        case OP_GLOBSERVSTATRES:
+            hist = MH_UDP_OTHER;
+            ret = serverlist_status(addr, &pb);
+            break;
+
+        default:
+            // other server and kad requests are not supported
+            hist = MH_UDP_OTHER;
+            ret = 1;
+            break;
+    }
+
+    metrics_record_since(hist, start);
+    PB_CHECK(ret);
+
+    return;
+
+    malformed:
+    metrics_add(MC_UDP_MALFORMED, 1);
+    ED2KD_LOGDBG("udp: malformed datagram from %s:%u", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+}
+
+static void *udp_worker(void *arg)
+{
+    size_t i;
+
+    (void) arg;
+
+    if (!arena_init(&s_udp.arena, UDP_ARENA_BLOCK_SIZE)) {
+        ED2KD_LOGERR("udp: failed to allocate arena");
+        return NULL;
+    }
+
+    if (!(s_udp.result = evbuffer_new())) {
+        ED2KD_LOGERR("udp: failed to allocate search buffer");
+        arena_destroy(&s_udp.arena);
+        return NULL;
+    }
+
+    if (!db_open()) {
+        ED2KD_LOGERR("udp: failed to open database");
+        evbuffer_free(s_udp.result);
+        arena_destroy(&s_udp.arena);
+        return NULL;
+    }
+
+    // server status reads configuration which is replaced on reload
+    if (!rcu_register_thread()) {
+        ED2KD_LOGERR("udp: failed to register thread");
+        db_close();
+        evbuffer_free(s_udp.result);
+        arena_destroy(&s_udp.arena);
+        return NULL;
+    }
+
+    for (i = 0; i < UDP_BATCH; ++i) {
+        struct msghdr *hdr = &s_udp.in_msgs[i].msg_hdr;
+
+        s_udp.in_iov[i].iov_base = s_udp.in_data[i];
+        s_udp.in_iov[i].iov_len = UDP_MAX_REQUEST;
+        hdr->msg_name = &s_udp.in_addr[i];
+        hdr->msg_iov = &s_udp.in_iov[i];
+        hdr->msg_iovlen = 1;
+    }
+
+    while (!atomic_load(&g_srv.terminate)) {
+        int n;
+
+        // receive timeout keeps pings going without traffic
+        serverlist_ping(s_udp.fd);
+
+        for (i = 0; i < UDP_BATCH; ++i) {
+            s_udp.in_msgs[i].msg_hdr.msg_namelen = sizeof(s_udp.in_addr[i]);
+        }
+
+        // blocks until first datagram or receive timeout, then takes what is queued
+        n = recvmmsg(s_udp.fd, s_udp.in_msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+                continue;
+            ED2KD_LOGERR("udp: receive failed (%s)", strerror(errno));
+            break;
+        }
+
+        rcu_online();
+        for (i = 0; i < (size_t) n; ++i) {
+            const struct mmsghdr *msg = &s_udp.in_msgs[i];
+
+            if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+                metrics_add(MC_UDP_MALFORMED, 1);
+                continue;
+            }
+
+            process_datagram(s_udp.in_data[i], msg->msg_len, &s_udp.in_addr[i]);
+        }
+
+        flush_replies();
+        rcu_offline();
+        arena_reset(&s_udp.arena);
+    }
+
+    rcu_unregister_thread();
+
+    if (!db_close())
+        ED2KD_LOGERR("udp: failed to close database");
+    evbuffer_free(s_udp.result);
+    arena_destroy(&s_udp.arena);
+
+    return NULL;
+}
+
+int udp_start(unsigned rate_limit)
+{
+    struct sockaddr_in bind_sa;
+    struct timeval tv = {0, UDP_POLL_INTERVAL * 1000};
+    uint16_t port = g_srv.cfg->listen_port + UDP_PORT_OFFSET;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ED2KD_LOGERR("udp: failed to create socket (%s)", strerror(errno));
+        return 0;
+    }
+
+    memset(&bind_sa, 0, sizeof(bind_sa));
+    bind_sa.sin_family = AF_INET;
+    bind_sa.sin_addr.s_addr = g_srv.cfg->listen_addr_inaddr;
+    bind_sa.sin_port = htons(port);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
+            || bind(fd, (struct sockaddr *) &bind_sa, sizeof(bind_sa)) < 0) {
+        ED2KD_LOGERR("udp: failed to bind %s:%u (%s)", g_srv.cfg->listen_addr, port, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    s_udp.fd = fd;
+    s_udp.rate = rate_limit;
+
+    if (pthread_create(&s_udp.thread, NULL, udp_worker, NULL)) {
+        ED2KD_LOGERR("udp: failed to start thread");
+        close(fd);
+        s_udp.fd = -1;
+        return 0;
+    }
+
+    ED2KD_LOGNFO("udp: listening on %s:%u", g_srv.cfg->listen_addr, port);
+
+    return 1;
+}
+
+void udp_stop(void)
+{
+    if (s_udp.fd < 0)
+        return;
+
+    pthread_join(s_udp.thread, NULL);
+    close(s_udp.fd);
+    s_udp.fd = -1;
+}
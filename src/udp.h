@@ -0,0 +1,45 @@
+#ifndef ED2KD_UDP_H
+#define ED2KD_UDP_H
+
+/**
+@file udp.h eDonkey2000 UDP server protocol
+
+Global source queries, global searches and server status requests are
+served on listen_port+4 by dedicated thread with its own database
+connection. Datagrams are received and answered in batches with
+recvmmsg/sendmmsg. Every reply datagram costs source ip one token of
+rate limit, so server can't be used for traffic amplification.
+*/
+
+#include <stdint.h>
+
+#define UDP_PORT_OFFSET         4
+/* datagrams received or sent per system call */
+#define UDP_BATCH               32
+/* maximum reply datagram size */
+#define UDP_MAX_DATAGRAM        1400
+/* larger requests are dropped */
+#define UDP_MAX_REQUEST         4096
+/* maximum reply datagrams per request */
+#define UDP_MAX_REPLY           4
+#define UDP_MAX_SEARCH_RESULTS  64
+/* reply datagrams per second per source ip */
+#define UDP_RATE_LIMIT          20
+/* hashed per ip token buckets, collisions only make limit stricter */
+#define UDP_RATE_BITS           14
+/* socket receive timeout (msecs), termination flag check interval */
+#define UDP_POLL_INTERVAL       200
+
+/**
+@brief binds udp socket and starts udp thread
+@param rate_limit reply datagrams per second per source ip
+@return non-zero on success
+*/
+int udp_start(unsigned rate_limit);
+
+/**
+@brief waits for udp thread exit (server_stop() must be called before)
+*/
+void udp_stop(void);
+
+#endif // ED2KD_UDP_H
@@ -6,26 +6,21 @@
 
 int hex2bin(const char *src, unsigned char *dst, size_t dst_len)
 {
-    size_t i;
+    size_t i, j;
     for (i = 0; i < dst_len; ++i) {
         dst[i] = 0;
-        if (src[i] >= '0' && src[i] <= '9')
-            dst[i] = 16 * (src[i] - '0');
-        else if (src[i] >= 'a' && src[i] <= 'f')
-            dst[i] = 16 * (src[i] - 'a' + 10);
-        else if (src[i] >= 'A' && src[i] <= 'F')
-            dst[i] = 16 * (src[i] - 'A' + 10);
-        else
-            return -1;
-
-        if (src[i + 1] >= '0' && src[i + 1] <= '9')
-            dst[i] += src[i + 1] - '0';
-        else if (src[i + 1] >= 'a' && src[i + 1] <= 'f')
-            dst[i] += src[i + 1] - 'a' + 10;
-        else if (src[i + i] >= 'A' && src[i + 1] <= 'F')
-            dst[i] += src[i + 1] - 'A' + 10;
-        else
-            return -1;
+        for (j = 0; j < 2; ++j) {
+            char c = src[i * 2 + j];
+            dst[i] <<= 4;
+            if (c >= '0' && c <= '9')
+                dst[i] += c - '0';
+            else if (c >= 'a' && c <= 'f')
+                dst[i] += c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                dst[i] += c - 'A' + 10;
+            else
+                return -1;
+        }
     }
 
     return 0;
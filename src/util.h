@@ -7,7 +7,11 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef USE_DEBUG
 #define DEBUG_ONLY(x) x
@@ -45,6 +49,35 @@ int bin2hex(const unsigned char *src, char *dst, size_t dst_len);
 */
 void get_random_user_hash(unsigned char *hash);
 
+/**
+@brief compare two ed2k hashes
+@return non-zero if hashes are equal
+*/
+static inline int hash_equal(const unsigned char *a, const unsigned char *b)
+{
+#ifdef __SSE2__
+    __m128i va = _mm_loadu_si128((const __m128i *) a);
+    __m128i vb = _mm_loadu_si128((const __m128i *) b);
+    return 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+#else
+    uint64_t va[2], vb[2];
+    memcpy(va, a, sizeof(va));
+    memcpy(vb, b, sizeof(vb));
+    return (va[0] == vb[0]) && (va[1] == vb[1]);
+#endif
+}
+
+/**
+@brief get 64-bit key of ed2k hash
+@note MD4 digests are uniformly distributed, so the first 8 bytes are as good as any hash function
+*/
+static inline uint64_t hash_key64(const unsigned char *hash)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return key;
+}
+
 /**
 @brief get integer ed2k file type from string file type
 @param type   string type